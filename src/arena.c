@@ -0,0 +1,85 @@
+#include "common.h"
+#include "mm.h"
+#include "arena.h"
+
+/*
+ * Region (arena) allocator
+ *
+ * For memory whose lifetime is one unit of work, eg. building a packet or
+ * a DHCP transaction. An arena is a single kmalloc block that allocations
+ * are bumped out of with no per object bookkeeping, and everything in it is
+ * freed at once by arena_reset. arena_mark / arena_release roll back just
+ * what was allocated since the mark, so nested users (each protocol layer
+ * of a send) can share one arena as long as they release in LIFO order.
+ *
+ * An arena is not locked, users that share one have to serialize.
+ */
+#define ARENA_ALIGN 8
+
+struct arena {
+  char * base;                  /* first usable byte, just after this header */
+  unsigned int size;            /* bytes available at base */
+  unsigned int used;
+};
+
+/*
+ * Creates an arena that can hold at least 'size' bytes, or returns NULL
+ */
+struct arena * arena_create(size_t size)
+{
+  struct arena * arena = kmalloc(sizeof(struct arena) + size);
+  if(arena == NULL)
+    return NULL;
+
+  /* whatever kmalloc rounded the block up to is usable too */
+  arena->base = (char *)(arena + 1);
+  arena->size = ksize(arena) - sizeof(struct arena);
+  arena->used = 0;
+  return arena;
+}
+
+/*
+ * Returns 'size' bytes (ARENA_ALIGN aligned) from the arena, or NULL if it
+ * is full. The memory is not zeroed
+ */
+void * arena_alloc(struct arena * arena, size_t size)
+{
+  unsigned int start = (arena->used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+  if(size > arena->size || start > arena->size - size)
+    return NULL;
+
+  arena->used = start + size;
+  return arena->base + start;
+}
+
+/*
+ * Returns a mark for arena_release
+ */
+unsigned int arena_mark(struct arena * arena)
+{
+  return arena->used;
+}
+
+/*
+ * Frees everything allocated from the arena since 'mark' was taken
+ */
+void arena_release(struct arena * arena, unsigned int mark)
+{
+  arena->used = mark;
+}
+
+/*
+ * Frees everything allocated from the arena
+ */
+void arena_reset(struct arena * arena)
+{
+  arena->used = 0;
+}
+
+/*
+ * Returns the arena's memory to the heap
+ */
+void arena_destroy(struct arena * arena)
+{
+  kfree(arena);
+}
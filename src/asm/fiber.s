@@ -0,0 +1,25 @@
+; Fiber context switch. Only the kernel links this, not the stage2.5 loader
+
+; void fiber_switch(unsigned int * save_esp, unsigned int esp): saves the
+; callee saved registers on the current stack, stores its esp and carries
+; on from esp, as saved by an earlier fiber_switch (or set up like one by
+; fiber_spawn). Everything else the C caller already assumes is clobbered,
+; except the x87 control word and MXCSR: fibers must leave those as they
+; found them (see fiber.c)
+global fiber_switch
+fiber_switch:
+  push ebp
+  push ebx
+  push esi
+  push edi
+
+  mov eax,[esp+20]
+  mov edx,[esp+24]
+  mov [eax],esp
+  mov esp,edx
+
+  pop edi
+  pop esi
+  pop ebx
+  pop ebp
+  ret
@@ -318,6 +318,7 @@ global irq14
 global irq15
 
 extern timer_handler
+extern task_switch_done
 
 ; 32: IRQ0
 irq0:
@@ -337,6 +338,7 @@ irq0:
   call timer_handler
 
   mov esp,eax
+  call task_switch_done     ; on the next thread's stack now (see task.c)
 
   mov al,0x20
   out 0x20,al
@@ -350,6 +352,42 @@ irq0:
 
 iret
 
+; Gives up the cpu from C ('extern void task_yield();', with the cpu's run
+; queue lock held). Builds the same frame as irq0 does, so the thread can be
+; resumed by either path: the flags are pushed before cli so iret puts
+; them back as they were
+global task_yield
+extern task_schedule
+task_yield:
+  pushf
+  cli
+  push cs
+  push yield_return
+
+  pusha
+  push ds
+  push es
+  push fs
+  push gs
+
+  push esp
+  call task_schedule
+
+  mov esp,eax
+  call task_switch_done
+
+  pop gs
+  pop fs
+  pop es
+  pop ds
+
+  popa
+
+iret
+
+yield_return:
+  ret
+
 ; 33: IRQ1
 irq1:
   cli
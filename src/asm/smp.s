@@ -0,0 +1,133 @@
+; Start up code for the other cpus (application processors) and their
+; local APIC interrupts. Only the kernel links this, not the stage2.5 loader
+
+; The trampoline is copied to SMP_TRAMPOLINE (must match smp.h) and the
+; startup IPI starts the cpu there in real mode, so everything inside it
+; is addressed relative to that copy rather than where it was linked
+SMP_TRAMPOLINE equ 0xE000
+%define TRAMPOLINE_ADDR(label) (SMP_TRAMPOLINE + ((label) - ap_trampoline))
+
+global ap_trampoline
+global ap_trampoline_args
+global ap_trampoline_end
+
+align 16
+[bits 16]
+ap_trampoline:
+  cli
+  cld
+  xor ax,ax
+  mov ds,ax
+  lgdt [TRAMPOLINE_ADDR(ap_gdt_ptr)]
+  mov eax,cr0
+  or eax,1
+  mov cr0,eax
+  jmp dword 0x08:TRAMPOLINE_ADDR(ap_protected)
+
+[bits 32]
+ap_protected:
+  mov eax,0x10
+  mov ds,eax
+  mov es,eax
+  mov fs,eax
+  mov gs,eax
+  mov ss,eax
+  mov esp,[TRAMPOLINE_ADDR(ap_stack)]
+
+  ; turn paging on the way the boot cpu has it, if it has
+  mov eax,[TRAMPOLINE_ADDR(ap_cr3)]
+  test eax,eax
+  jz .no_paging
+  mov cr3,eax
+  mov eax,[TRAMPOLINE_ADDR(ap_cr4)]
+  mov cr4,eax
+  mov eax,cr0
+  or eax,0x80010000         ; paging, and write protect in ring 0 too
+  mov cr0,eax
+.no_paging:
+  mov eax,[TRAMPOLINE_ADDR(ap_entry)]
+  call eax
+.halt:
+  cli
+  hlt
+  jmp .halt
+
+; flat code and data segments, just to get into protected mode (the C code
+; loads the kernel's GDT)
+align 8
+ap_gdt:
+  dq 0
+  dq 0x00CF9A000000FFFF
+  dq 0x00CF92000000FFFF
+ap_gdt_ptr:
+  dw 23
+  dd TRAMPOLINE_ADDR(ap_gdt)
+
+; filled in by smp_init for each cpu it starts, see struct ap_args
+align 4
+ap_trampoline_args:
+ap_stack:
+  dd 0
+ap_cr3:
+  dd 0
+ap_cr4:
+  dd 0
+ap_entry:
+  dd 0
+ap_trampoline_end:
+
+; Local APIC timer, the scheduler tick of the other cpus. Same frame as irq0
+global lapic_timer
+extern lapic_timer_handler
+extern task_switch_done
+lapic_timer:
+  pusha
+  push ds
+  push es
+  push fs
+  push gs
+
+  mov eax,0x10
+  mov ds,eax
+  mov es,eax
+  mov fs,eax
+  mov gs,eax
+
+  push esp
+  call lapic_timer_handler
+
+  mov esp,eax
+  call task_switch_done     ; on the next thread's stack now (see task.c)
+
+  pop gs
+  pop fs
+  pop es
+  pop ds
+
+  popa
+
+iret
+
+; Spurious local APIC interrupts need no EOI
+global lapic_spurious
+lapic_spurious:
+iret
+
+; TLB shootdown IPI, see tlb_shootdown in smp.c
+global lapic_tlb
+extern tlb_shootdown_handler
+lapic_tlb:
+  pusha
+  push ds
+  push es
+
+  mov eax,0x10
+  mov ds,eax
+  mov es,eax
+
+  call tlb_shootdown_handler
+
+  pop es
+  pop ds
+  popa
+iret
@@ -0,0 +1,193 @@
+; System call entry points and the switch to and from ring 3. Only the
+; kernel links this, not the stage2.5 loader (see syscall.c for the ABI)
+
+extern syscall_dispatch
+extern thread_set_kernel_stack
+
+; Kernel side of SYSENTER. The cpu loads cs, ss, esp and eip from the MSRs
+; with interrupts off and saves nothing, so the user passes its esp in ecx
+; and where to return to in edx. SYSENTER_ESP is the word just above this
+; cpu's TSS esp0 (see gdt.c), the thread's kernel stack is loaded from it.
+; The frame an int 0x80 would have left is pushed by hand, so the rest is
+; the same either way in. ds and es stay the flat user segments, which
+; ring 0 can use as they are
+global sysenter_entry
+sysenter_entry:
+  mov esp,[esp-4]
+  push dword 0x23           ; ss, user data (see gdt.c)
+  push ecx                  ; esp
+  pushfd
+  or dword [esp],0x200      ; the user had interrupts on
+  push dword 0x1B           ; cs, user code
+  push edx                  ; eip
+  sti
+
+  push ebp                  ; struct syscall_regs
+  push edi
+  push esi
+  push edx
+  push ecx
+  push ebx
+  push eax
+  push esp
+  call syscall_dispatch
+  add esp,8                 ; the frame pointer, and eax which is the result
+
+  pop ebx
+  pop ecx
+  pop edx
+  pop esi
+  pop edi
+  pop ebp
+  mov edx,[esp]             ; SYSEXIT returns to edx with ecx as esp
+  mov ecx,[esp+12]
+  sysexit
+
+; int 0x80, the fallback for cpus without SYSENTER. A trap gate, so
+; interrupts stay on. Same registers as above, all but eax preserved
+global syscall_int
+syscall_int:
+  push ebp                  ; struct syscall_regs
+  push edi
+  push esi
+  push edx
+  push ecx
+  push ebx
+  push eax
+  push esp
+  call syscall_dispatch
+  add esp,8
+
+  pop ebx
+  pop ecx
+  pop edx
+  pop esi
+  pop edi
+  pop ebp
+iret
+
+; int user_enter(eip, esp): runs eip in ring 3 on the stack esp until it
+; makes the SYS_EXIT call, and returns what it passed. Everything ring 3
+; does in the kernel happens on the stack below the registers saved here
+global user_enter
+user_enter:
+  push ebp
+  push ebx
+  push esi
+  push edi
+  push esp
+  call thread_set_kernel_stack
+  add esp,4
+
+  mov eax,[esp+20]
+  mov edx,[esp+24]
+  mov ecx,0x23              ; user data, see gdt.c
+  mov ds,ecx
+  mov es,ecx
+  mov fs,ecx
+  mov gs,ecx
+
+  push ecx                  ; ss
+  push edx                  ; esp
+  pushfd
+  or dword [esp],0x200      ; with interrupts on
+  push dword 0x1B           ; user code
+  push eax
+iret
+
+; void user_return(stack, value): back out of user_enter, stack is the
+; kernel stack it recorded. Called by the SYS_EXIT handler
+global user_return
+user_return:
+  mov eax,[esp+8]
+  mov esp,[esp+4]
+  mov ecx,0x10
+  mov ds,ecx
+  mov es,ecx
+  mov fs,ecx
+  mov gs,ecx
+
+  pop edi
+  pop esi
+  pop ebx
+  pop ebp
+  ret
+
+; The ring 3 half of syscall_bench, copied to a user page so it must not
+; refer to anything outside itself by address. Its stack starts with a
+; struct bench_args (see syscall.c): it makes that many null calls each
+; way, stores how many tsc cycles they took and exits
+SYS_NULL equ 0
+SYS_EXIT equ 1
+SYS_FORK equ 3
+
+global user_bench
+global user_bench_end
+user_bench:
+  mov ebp,esp
+  call .base
+.base:
+  pop esi
+
+  mov edi,[ebp]
+  test edi,edi
+  jz .int80
+  rdtsc
+  mov [ebp+8],eax
+  mov [ebp+12],edx
+.sysenter_loop:
+  mov eax,SYS_NULL
+  mov ecx,esp
+  lea edx,[esi + .sysenter_done - .base]
+  sysenter
+.sysenter_done:
+  dec edi
+  jnz .sysenter_loop
+  rdtsc
+  sub eax,[ebp+8]
+  sbb edx,[ebp+12]
+  mov [ebp+8],eax
+  mov [ebp+12],edx
+
+.int80:
+  mov edi,[ebp+4]
+  rdtsc
+  mov [ebp+16],eax
+  mov [ebp+20],edx
+.int80_loop:
+  mov eax,SYS_NULL
+  int 0x80
+  dec edi
+  jnz .int80_loop
+  rdtsc
+  sub eax,[ebp+16]
+  sbb edx,[ebp+20]
+  mov [ebp+16],eax
+  mov [ebp+20],edx
+
+  mov eax,SYS_EXIT
+  xor ebx,ebx
+  int 0x80
+user_bench_end:
+
+; The ring 3 half of fork_test, position independent like user_bench.
+; Its stack starts with a word fork_test has filled in: it forks, the
+; child overwrites the word and exits, and the parent exits with the
+; child's id (or -1) for fork_test to wait on
+global user_fork
+global user_fork_end
+user_fork:
+  mov ebp,esp
+  mov eax,SYS_FORK
+  int 0x80
+  test eax,eax
+  jnz .parent
+  mov dword [ebp],0xBAD
+  mov eax,SYS_EXIT
+  xor ebx,ebx
+  int 0x80
+.parent:
+  mov ebx,eax
+  mov eax,SYS_EXIT
+  int 0x80
+user_fork_end:
@@ -4,6 +4,8 @@
 #include "idt.h"
 #include "timer.h"
 #include "task.h"
+#include "mm.h"
+#include "slab.h"
 
 // https://forum.osdev.org/viewtopic.php?t=13538
 static const char * drive_types[8] = {
@@ -45,10 +47,9 @@ enum floppy_commands {
 //  64k boundary. It can be up to 64k-1 in size for ISA DMA. In the example here, they use 0x4800 bytes, which is a full
 //  track of 18 sectors. The track size is determined by the geometry of the disk, and the sectors per track, ie)
 //  2 * 18 * 512 = 0x4800 = 18432. https://forum.osdev.org/viewtopic.php?t=13538
-// todo: we may be able to relocate this to a fixed position so that it doesn't make the binary larger than it needs
-//  to be: https://stackoverflow.com/questions/4067811/how-to-place-a-variable-at-a-given-absolute-address-in-memory-with-gcc
+// The buffer comes from dma_alloc (below 16MB, not crossing 64k) in fdd_initialize, so it isn't part of the binary.
 #define floppy_dmalen 0x200
-static const char floppy_dmabuf[floppy_dmalen];
+static char * floppy_dmabuf;
 char fat12_table[floppy_dmalen]; // if this is static const we get all zeros
 
 // can't actually implement the init function here because main needs to be the first function
@@ -70,6 +71,11 @@ int main(void) {
     interrupt_init();
     print_status(1);
 
+    /* Sets up the page allocator that backs malloc and the thread stacks */
+    mm_init((struct e820_map *)E820_MAP_ADDR);
+    slab_init();
+    kmalloc_init();
+
     /* Sets up the thread structures so we can do context switches */
     print_string("Initializing Threads & System Timer...");
     thread_init();
@@ -97,7 +103,7 @@ static void floppy_dma_init(floppy_dir dir) {
         unsigned long l;    // 1 long = 32-bit
     } a, c; // address and count
 
-    a.l = (unsigned long) &floppy_dmabuf;
+    a.l = (unsigned long) floppy_dmabuf;
     c.l = (unsigned) floppy_dmalen - 1; // -1 because of DMA counting
 
     // check that address is at most 24-bits (under 16MB)
@@ -105,7 +111,7 @@ static void floppy_dma_init(floppy_dir dir) {
     // check that if we add count and address we don't get a carry
     // (DMA can't deal with such a carry, this is the 64k boundary limit)
     if((a.l >> 24) || (c.l >> 16) || (((a.l&0xffff)+c.l)>>16)) {
-        print_string("floppy_dma_init: static buffer problem\n");
+        print_string("floppy_dma_init: dma buffer problem\n");
     }
 
     unsigned char mode;
@@ -653,6 +659,12 @@ void fdd_initialize() {
     print_string((char*)drive_types[drives & 0xf]);
     print_string("\n");
 
+    floppy_dmabuf = dma_alloc(floppy_dmalen, floppy_dmalen, ISA_DMA_LIMIT, ISA_DMA_BOUNDARY);
+    if(floppy_dmabuf == NULL) {
+        print_string("Could not allocate the floppy DMA buffer\n");
+        return;
+    }
+
     print_string("Resetting floppy controller");
     int reset_result = floppy_reset(floppy_base);
     print_status(reset_result == 0);
@@ -794,8 +806,9 @@ void fdd_initialize() {
         }
         print_string("Done reading kernel.bin\n");
 
-        int (*func)(void) = (int (*)(void))0x100000;
-        func();
+        /* the kernel gets the BIOS memory map that stage2 collected */
+        int (*func)(struct e820_map *) = (int (*)(struct e820_map *))0x100000;
+        func((struct e820_map *)E820_MAP_ADDR);
     } else {
         print_string("Kernel file not found\n");
     }
@@ -37,6 +37,7 @@ end:
 ; - layout of memory
 ; - video mode changes
 ;-----------------------------------------------------------------------
+  call detectMemory
 
 ;-----------------------------------------------------------------------
 ; Protected mode initialization
@@ -66,6 +67,43 @@ jmp SYS_CODE_SEL:protectedMode
 %include 'src/boot/fat12.s'
 %include 'src/boot/util.s'
 
+;-----------------------------------------------------------------------
+; detectMemory: asks the BIOS for the physical memory map (INT 0x15,
+; EAX=0xE820) and leaves it at E820_SEG:0 for the kernel. The first dword
+; is the number of entries, followed by 24 byte entries (base, length,
+; type, ACPI attributes). The count stays 0 if the BIOS has no E820
+;-----------------------------------------------------------------------
+E820_SEG        equ 0x1000      ; physical 0x10000, must match E820_MAP_ADDR
+E820_MAX        equ 32          ; must match E820_MAX_ENTRIES
+
+detectMemory:
+  pushad
+  push es
+  mov ax,E820_SEG
+  mov es,ax
+  mov dword [es:0],0          ; no entries yet
+  mov di,4
+  xor ebx,ebx                 ; continuation value, 0 for the first entry
+.nextEntry:
+  mov dword [es:di+20],1      ; ACPI attributes, in case the BIOS only fills 20 bytes
+  mov eax,0xe820
+  mov ecx,24
+  mov edx,0x534d4150          ; 'SMAP'
+  int 0x15
+  jc .done                    ; unsupported, or already past the last entry
+  cmp eax,0x534d4150
+  jne .done
+  inc dword [es:0]
+  add di,24
+  cmp dword [es:0],E820_MAX
+  jae .done
+  test ebx,ebx                ; 0 means that was the last entry
+  jnz .nextEntry
+.done:
+  pop es
+  popad
+ret
+
 ;-----------------------------------------------------------------------
 ; emptyKbuffer: empties the keyboard buffer (used to enable A20 line)
 ;-----------------------------------------------------------------------
@@ -2,17 +2,22 @@
 #include "screen.h"
 #include "kb.h"
 #include "mm.h"
+#include "slab.h"
+#include "task.h"
+#include "syscall.h"
+#include "mutex.h"
 #include "net.h"
 #include "net/dhcp.h"
 #include "pci.h"
 #include "fs/fat.h"
 #include "net/icmp.h"
+#include "net/in.h"
 
 void cli_main(void)
 {
   print_string("--------------------------------------------------------------------------------");
   print_string("Welcome to POS console\n");
-  print_string("commands: help clear dhcp freemem ip ls lspci ping shutdown reboot\n");
+  print_string("commands: help clear dhcp forktest freemem ip lockbench ls lspci memstat ping sched slabinfo shutdown syscallbench reboot top\n");
 	
   char buffer[1024];
 
@@ -26,15 +31,29 @@ void cli_main(void)
     //eventually this should check some path in the filesystem
     //for the programs we know about (or the current console path)
     if(strcmp(buffer,"help")==0) {
-      print_string("commands: help clear dhcp freemem ip ls lspci ping shutdown reboot\n");
+      print_string("commands: help clear dhcp forktest freemem ip lockbench ls lspci memstat ping sched slabinfo shutdown syscallbench reboot top\n");
     } else if(strcmp(buffer,"reboot")==0) {
       reboot();
     } else if(strcmp(buffer,"clear")==0) {
       screen_clear();
     } else if(strcmp(buffer,"freemem")==0) {
       display_free_bytes();
+    } else if(strcmp(buffer,"slabinfo")==0) {
+      slabinfo();
+    } else if(strcmp(buffer,"memstat")==0) {
+      display_memstat();
+    } else if(strcmp(buffer,"sched")==0) {
+      sched_stats();
+    } else if(strcmp(buffer,"top")==0) {
+      top();
+    } else if(strcmp(buffer,"syscallbench")==0) {
+      syscall_bench();
+    } else if(strcmp(buffer,"forktest")==0) {
+      fork_test();
+    } else if(strcmp(buffer,"lockbench")==0) {
+      lock_bench();
     } else if(strcmp(buffer,"dhcp")==0) {
-      dhcp_discover();
+      dhcp_start();
     } else if(strcmp(buffer,"ip")==0) {
       ip();
     } else if(strcmp(buffer,"ls")==0) {
@@ -44,7 +63,9 @@ void cli_main(void)
     } else if (strcmp(buffer, "lspci")==0) {
       lspci();
     } else if (strcmp(buffer, "ping")==0) {
-      icmp_ping(string_to_ip("10.0.2.1"));
+      unsigned char * destination = string_to_ip("10.0.2.1");
+      icmp_ping((char *)destination);
+      free_ip(destination);
     } else {
       print_string("Unknown command. Please try again. \n");
     }
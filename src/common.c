@@ -160,6 +160,50 @@ void outportsl(unsigned short port, const void * addr, unsigned long int count)
                        :"d" (port), "0" (addr), "1" (count));
 }
 
+/*
+ * Disables interrupts and returns the previous EFLAGS so that nested
+ * callers can put the interrupt flag back the way they found it
+ */
+unsigned int irq_save(void)
+{
+  unsigned int flags;
+  __asm__ __volatile__ ("pushf ; pop %0 ; cli" : "=r" (flags) : : "memory");
+  return flags;
+}
+
+/*
+ * Restores the EFLAGS returned by irq_save
+ */
+void irq_restore(unsigned int flags)
+{
+  __asm__ __volatile__ ("push %0 ; popf" : : "r" (flags) : "memory", "cc");
+}
+
+/*
+ * Reads the cpu's time stamp counter (cycles since reset)
+ */
+unsigned long long rdtsc(void)
+{
+  unsigned int lo, hi;
+  __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+  return ((unsigned long long)hi << 32) | lo;
+}
+
+/*
+ * Divides a 64 bit number by a 32 bit one. There is no libgcc to do
+ * 64 bit division, so it is two 32 bit divl steps
+ */
+unsigned long long udiv64(unsigned long long n, unsigned int d)
+{
+  unsigned int hi = n >> 32;
+  unsigned int lo = n;
+  unsigned int q_hi = hi / d;
+  unsigned int q_lo, r = hi % d;
+
+  __asm__ ("divl %4" : "=a" (q_lo), "=d" (r) : "a" (lo), "d" (r), "rm" (d));
+  return ((unsigned long long)q_hi << 32) | q_lo;
+}
+
 /*
  * Sets count bytes of destination to val
  */
@@ -7,6 +7,8 @@
 #include "net/eth.h"
 #include "net/dhcp.h"
 #include "task.h"
+#include "workqueue.h"
+#include "mutex.h"
 
 /*
  * Double-check this init procedure, this code seems to freeze after a few mins of running
@@ -14,9 +16,14 @@
 
 unsigned long int ioaddr;
 unsigned short int tx_current_buffer;
+spinlock_t tx_lock;                       //the transmit descriptors, senders may be on any cpu
 unsigned short int rx_index;
-char rx_buffer[RX_BUFFER_SIZE];  //for some reason if the rx buffer is dyanmically allocated we go full reboot :/ prob an alignment problem
+char * rx_buffer;   //the card needs physically contiguous buffers, so both come from dma_alloc
 char * tx_buffers;
+struct work rtl8139_work;                 //the receive processing, run by the worker thread
+volatile unsigned int rtl8139_events;     //ISR bits seen since rtl8139_work last ran
+
+static void rtl8139_work_handler(struct work * work);
 
 /*
  * Registers the IRQ handler for the device, inits the device
@@ -58,6 +65,8 @@ void install_rtl8139(struct pci_device * device) {
   print_address(ioaddr);
   print_string("\n");
 
+  work_init(&rtl8139_work, rtl8139_work_handler);
+  rtl8139_events = 0;
   irq_install_handler(device->interrupt_line, rtl8139_handler);
 
   print_string("  Installing on IRQ: ");
@@ -81,14 +90,20 @@ void install_rtl8139(struct pci_device * device) {
   print_string("  Resetting RTL8139...");
   outportb(ioaddr + ChipCmd, CmdReset);
   
-  //allocate the transmit buffers
-  tx_buffers = calloc(sizeof(char) * TX_BUF_SIZE * NUM_TX_DESC);
+  //allocate the transmit buffers (the card takes 32-bit physical
+  //addresses, and memory is identity mapped so virtual == physical)
+  tx_buffers = dma_alloc(sizeof(char) * TX_BUF_SIZE * NUM_TX_DESC, 4, 0, 0);
   tx_current_buffer = 0;
+  spin_lock_init(&tx_lock);
   
   //allocate the receive buffer
-  //rx_buffer = calloc(sizeof(char) * RX_BUFFER_SIZE);
+  rx_buffer = dma_alloc(sizeof(char) * RX_BUFFER_SIZE, 4, 0, 0);
+  if(tx_buffers == NULL || rx_buffer == NULL) {
+    print_string("Could not allocate the RTL8139 DMA buffers\n");
+    return;
+  }
   rx_index = 0;
-  outportl(ioaddr + ChipRxBuffer, (unsigned long)&rx_buffer);
+  outportl(ioaddr + ChipRxBuffer, (unsigned long)rx_buffer);
   
   //enable transmit and receive
   outportb(ioaddr + ChipCmd, CmdRxEnb | CmdTxEnb);
@@ -109,9 +124,8 @@ void rtl8139_send_handler() {}
 void rtl8139_recv_handler() {
   unsigned long length = (rx_buffer[3 + rx_index] << 8) + rx_buffer[2+rx_index];
   
-  //todo: need to free these packets at some point or we'll run out of
-  //memory just from packets being received.
-  char * packet = calloc(sizeof(unsigned char) * length);
+  /* every byte is copied in from the ring below, so no need to zero it */
+  char * packet = malloc(sizeof(unsigned char) * length);
   unsigned long ring_offset = rx_index % RX_BUFFER_SIZE;
   
   if(ring_offset + length > RX_BUFFER_SIZE) {
@@ -128,6 +142,7 @@ void rtl8139_recv_handler() {
   
   //pass the received packet up to the next layer
   eth_receive_frame(packet, length);
+  kfree(packet);
   
   //compute the new index in the ring buffer
   rx_index = (rx_index + length + 4 + 3) & ~3;
@@ -136,12 +151,32 @@ void rtl8139_recv_handler() {
   outportw(ioaddr + ChipRxBufTail, rx_index - 16);
 }
 
+/*
+ * Only acknowledges the interrupt, everything else (copying the packets
+ * out and the protocol processing) happens in rtl8139_work_handler with
+ * interrupts on
+ */
 void rtl8139_handler(struct regs * r) {
   unsigned short val = inportw(ioaddr + ChipISR);
 
+  outportw(ioaddr + ChipISR, val);
+  __sync_fetch_and_or(&rtl8139_events, val);
+  work_schedule(&rtl8139_work);
+  r = r;
+}
+
+/*
+ * Deferred half of the interrupt handler. Interrupts that came in before
+ * it got to run are merged into one, so it takes every packet waiting in
+ * the ring
+ */
+static void rtl8139_work_handler(struct work * work) {
+  unsigned int val = __sync_lock_test_and_set(&rtl8139_events, 0);
+
   if (val & RxOK) {
     print_string("RTL8139 Receive OK\n");
-    rtl8139_recv_handler();
+    while (!(inportb(ioaddr + ChipCmd) & RxBufEmpty))
+      rtl8139_recv_handler();
   } else if (val & TxOK) {
     print_string("RTL8139 Transmit OK\n");
   } else if (val & RxErr) {
@@ -160,12 +195,12 @@ void rtl8139_handler(struct regs * r) {
     print_string(itoa(val, temp, 16));
     print_string("\n");
   }
-
-  outportw(ioaddr + ChipISR, val);
-  r = r;
+  work = work;
 }
 
 void rtl8139_send_packet(void * data, unsigned long int length) {
+  unsigned int flags = spin_lock_irqsave(&tx_lock);
+
   //copy the packet into the buffer
   memcpy(&tx_buffers[tx_current_buffer * TX_BUF_SIZE], data, length); 
   
@@ -181,6 +216,7 @@ void rtl8139_send_packet(void * data, unsigned long int length) {
   //advance to next transmit buffer
   tx_current_buffer++;
   tx_current_buffer %= 4;
+  spin_unlock_irqrestore(&tx_lock, flags);
 }
 
 /*
@@ -0,0 +1,270 @@
+#include "common.h"
+#include "screen.h"
+#include "slab.h"
+#include "task.h"
+#include "fiber.h"
+#include "mutex.h"
+
+/*
+ * Fibers
+ *
+ * Stackful coroutines, all multiplexed onto one kernel thread. A fiber
+ * runs until it calls fiber_yield, fiber_await or returns, and switching
+ * between them only saves the callee saved registers and the stack
+ * pointer (fiber_switch in fiber.s), so there is no timer, run queue or
+ * full register frame involved. Each costs a small slab object and a
+ * FIBER_STACK_SIZE stack instead of a thread's page, which makes one per
+ * outstanding request (a DHCP or UDP transaction) affordable.
+ *
+ * Fibers must not block the thread under them (wait_event, thread_sleep
+ * and so on would stop every fiber), they wait with fiber_await instead.
+ * Anything can make one runnable again with fiber_signal, from another
+ * thread or an interrupt handler. The host thread sleeps while no fiber
+ * is ready.
+ *
+ * The fibers also share the host thread's FPU state, which fiber_switch
+ * leaves alone: saving even the control words would make the host
+ * thread take the #NM trap and carry FPU state when no fiber uses it (see
+ * fpu.c). So a fiber must not change the x87 control word or MXCSR,
+ * which the i386 ABI expects to survive a call.
+ */
+struct fiber {
+  unsigned int id;
+  unsigned int esp;                   /* saved by fiber_switch while it isn't running */
+  void (*func)(void * arg);
+  void * arg;
+  void * stack;
+  unsigned int done;                  /* func returned, free it once switched off */
+  struct fiber * next;                /* ready list or event waiters */
+};
+
+extern void fiber_switch(unsigned int * save_esp, unsigned int esp);
+
+struct fiber * fiber_ready_head;
+struct fiber * fiber_ready_tail;
+struct fiber * fiber_running;         /* NULL while the host thread itself runs */
+unsigned int fiber_host_esp;
+unsigned int fiber_thread;
+unsigned int fiber_next_id;
+spinlock_t fiber_lock;                /* ready list and events, signalers may be on any cpu */
+struct wait_queue fiber_wait;
+struct kmem_cache * fiber_cache;
+struct kmem_cache * fiber_stack_cache;
+
+static void fiber_task(void);
+
+/*
+ * Puts a fiber at the end of the ready list. Called with fiber_lock held
+ */
+static void fiber_enqueue(struct fiber * fiber)
+{
+  fiber->next = NULL;
+  if(fiber_ready_tail != NULL)
+    fiber_ready_tail->next = fiber;
+  else
+    fiber_ready_head = fiber;
+  fiber_ready_tail = fiber;
+}
+
+/*
+ * Takes the first ready fiber off, or returns NULL if there is none
+ */
+static struct fiber * fiber_dequeue(void)
+{
+  struct fiber * fiber;
+  unsigned int flags = spin_lock_irqsave(&fiber_lock);
+
+  fiber = fiber_ready_head;
+  if(fiber != NULL)
+  {
+    fiber_ready_head = fiber->next;
+    if(fiber_ready_head == NULL)
+      fiber_ready_tail = NULL;
+  }
+  spin_unlock_irqrestore(&fiber_lock, flags);
+  return fiber;
+}
+
+/*
+ * Sets up the caches and starts the thread the fibers run on (needs
+ * threading up)
+ */
+void fiber_init(void)
+{
+  fiber_ready_head = NULL;
+  fiber_ready_tail = NULL;
+  fiber_running = NULL;
+  fiber_next_id = 1;
+  fiber_thread = 0;
+  spin_lock_init(&fiber_lock);
+  wait_queue_init(&fiber_wait);
+  fiber_cache = kmem_cache_create("fiber", sizeof(struct fiber), NULL);
+  fiber_stack_cache = kmem_cache_create("fiber_stack", FIBER_STACK_SIZE, NULL);
+  create_task(fiber_task);
+}
+
+/*
+ * Where a new fiber starts, on its own stack
+ */
+static void fiber_start(void)
+{
+  struct fiber * fiber = fiber_running;
+
+  fiber->func(fiber->arg);
+  fiber->done = 1;
+  fiber_switch(&fiber->esp, fiber_host_esp);
+}
+
+/*
+ * Creates a fiber that runs func(arg) and makes it ready. Can be called
+ * from any thread, or a fiber. Returns its id, 0 if out of memory
+ */
+unsigned int fiber_spawn(void (*func)(void * arg), void * arg)
+{
+  struct fiber * fiber = kmem_cache_alloc(fiber_cache);
+  unsigned int * stack;
+  unsigned int flags, id;
+
+  if(fiber == NULL)
+    return 0;
+  fiber->stack = kmem_cache_alloc(fiber_stack_cache);
+  if(fiber->stack == NULL)
+  {
+    kmem_cache_free(fiber_cache, fiber);
+    return 0;
+  }
+  fiber->func = func;
+  fiber->arg = arg;
+  fiber->done = 0;
+
+  /* what fiber_switch pops: edi, esi, ebx, ebp, then returns into fiber_start */
+  stack = (unsigned int *)((char *)fiber->stack + FIBER_STACK_SIZE);
+  *--stack = 0;
+  *--stack = (unsigned int)fiber_start;
+  *--stack = 0;
+  *--stack = 0;
+  *--stack = 0;
+  *--stack = 0;
+  fiber->esp = (unsigned int)stack;
+
+  /* it may have run and gone by the time we return, so keep its id */
+  flags = spin_lock_irqsave(&fiber_lock);
+  id = fiber->id = fiber_next_id++;
+  fiber_enqueue(fiber);
+  spin_unlock_irqrestore(&fiber_lock, flags);
+
+  wake_up(&fiber_wait);
+  return id;
+}
+
+/*
+ * Returns the running fiber, NULL if the caller isn't one
+ */
+struct fiber * fiber_current(void)
+{
+  return thread_id() == fiber_thread ? fiber_running : NULL;
+}
+
+/*
+ * Returns the id of the running fiber, 0 if the caller isn't one
+ */
+unsigned int fiber_id(void)
+{
+  struct fiber * fiber = fiber_current();
+  return fiber != NULL ? fiber->id : 0;
+}
+
+/*
+ * Lets the other ready fibers run before carrying on
+ */
+void fiber_yield(void)
+{
+  struct fiber * fiber = fiber_running;
+  unsigned int flags = spin_lock_irqsave(&fiber_lock);
+
+  fiber_enqueue(fiber);
+  spin_unlock_irqrestore(&fiber_lock, flags);
+  fiber_switch(&fiber->esp, fiber_host_esp);
+}
+
+void fiber_event_init(struct fiber_event * event)
+{
+  event->signaled = 0;
+  event->waiters = NULL;
+}
+
+/*
+ * Switches away from the running fiber until the event is signaled, or
+ * returns straight away if it has been since the last fiber_await on it.
+ * Wake ups can be spurious, so wait in a loop (fiber_wait_event)
+ */
+void fiber_await(struct fiber_event * event)
+{
+  struct fiber * fiber = fiber_running;
+  unsigned int flags = spin_lock_irqsave(&fiber_lock);
+
+  if(event->signaled)
+  {
+    event->signaled = 0;
+    spin_unlock_irqrestore(&fiber_lock, flags);
+    return;
+  }
+  fiber->next = event->waiters;
+  event->waiters = fiber;
+  spin_unlock_irqrestore(&fiber_lock, flags);
+
+  /* only this thread takes fibers off the ready list, so it can't run yet */
+  fiber_switch(&fiber->esp, fiber_host_esp);
+}
+
+/*
+ * Makes every fiber waiting on the event ready, and marks it signaled so
+ * that one about to wait doesn't miss it. Safe to call from interrupt
+ * handlers
+ */
+void fiber_signal(struct fiber_event * event)
+{
+  struct fiber * fiber;
+  struct fiber * next;
+  unsigned int flags = spin_lock_irqsave(&fiber_lock);
+  int woke = event->waiters != NULL;
+
+  event->signaled = 1;
+  for(fiber = event->waiters; fiber != NULL; fiber = next)
+  {
+    next = fiber->next;
+    fiber_enqueue(fiber);
+  }
+  event->waiters = NULL;
+  spin_unlock_irqrestore(&fiber_lock, flags);
+
+  if(woke)
+    wake_up(&fiber_wait);
+}
+
+/*
+ * Kernel thread the fibers run on: switches to each ready fiber in turn
+ * and frees the ones that have finished
+ */
+static void fiber_task(void)
+{
+  struct fiber * fiber;
+
+  fiber_thread = thread_id();
+  for(;;)
+  {
+    wait_event(&fiber_wait, fiber_ready_head != NULL);
+    while((fiber = fiber_dequeue()) != NULL)
+    {
+      fiber_running = fiber;
+      fiber_switch(&fiber_host_esp, fiber->esp);
+      fiber_running = NULL;
+
+      if(fiber->done)
+      {
+        kmem_cache_free(fiber_stack_cache, fiber->stack);
+        kmem_cache_free(fiber_cache, fiber);
+      }
+    }
+  }
+}
@@ -0,0 +1,81 @@
+#include "common.h"
+#include "screen.h"
+#include "idt.h"
+#include "task.h"
+#include "fpu.h"
+
+/*
+ * FPU and SSE
+ *
+ * Turns on the x87 FPU and SSE and leaves CR0.TS set, so the first FPU or
+ * SSE instruction a thread runs traps with #NM (isr7). Only then does the
+ * scheduler give it an FXSAVE area and load its state (see task.c), so
+ * threads that never use them cost nothing on a switch.
+ *
+ * Interrupt handlers must not use the FPU or SSE: they would trap, or
+ * change the registers of whichever thread they interrupted.
+ */
+#define CPUID_FXSR        0x01000000
+#define CPUID_SSE         0x02000000
+#define CPUID_SSE2        0x04000000
+
+unsigned int fpu_enabled;
+
+static inline unsigned int cpuid_edx(unsigned int leaf)
+{
+  unsigned int eax, ebx, ecx, edx;
+  __asm__ __volatile__ ("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (leaf));
+  return edx;
+}
+
+/*
+ * Called on the first FPU/SSE instruction after a switch (CR0.TS set)
+ */
+static void fpu_trap(struct regs * r)
+{
+  thread_fpu_trap();
+  r = r;
+}
+
+/*
+ * Checks for FXSAVE and SSE, turns them on for the boot cpu and starts
+ * lazy switching. Needs threading initialized
+ */
+void fpu_init(void)
+{
+  unsigned int features = cpuid_edx(1);
+
+  fpu_enabled = 0;
+  print_string("FPU: ");
+  if((features & (CPUID_FXSR | CPUID_SSE)) != (CPUID_FXSR | CPUID_SSE))
+  {
+    print_string("no FXSAVE/SSE, left disabled\n");
+    return;
+  }
+
+  isr_install_handler(7, fpu_trap);
+  thread_fpu_init();
+  fpu_enabled = 1;
+  fpu_cpu_init();
+  print_string(features & CPUID_SSE2 ? "SSE2 enabled\n" : "SSE enabled\n");
+}
+
+/*
+ * Turns the FPU and SSE on for the cpu we are running on, trapping on
+ * first use (the other cpus call this as they start)
+ */
+void fpu_cpu_init(void)
+{
+  unsigned int cr0, cr4;
+
+  if(!fpu_enabled)
+    return;
+
+  __asm__ __volatile__ ("mov %%cr4, %0" : "=r" (cr4));
+  cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+  __asm__ __volatile__ ("mov %0, %%cr4" : : "r" (cr4));
+
+  __asm__ __volatile__ ("mov %%cr0, %0" : "=r" (cr0));
+  cr0 = (cr0 & ~CR0_EM) | CR0_MP | CR0_NE | CR0_TS;
+  __asm__ __volatile__ ("mov %0, %%cr0" : : "r" (cr0));
+}
@@ -1,4 +1,6 @@
 #include "common.h"
+#include "gdt.h"
+#include "smp.h"
 
 /* Defines a GDT entry. We say packed, because it prevents the
 *  compiler from doing things that it thinks is best: Prevent
@@ -77,11 +79,12 @@ struct tss_entry {
   unsigned short iomap;
 } __attribute__((packed));
 
-/* Our GDT, with 3 entries, and finally our special GDT pointer */
-/* Update 4th entry for TSS, and tss_table pointer */
-struct gdt_entry gdt[4];
+/* Our GDT: null, kernel code and data, user code and data (in the order SYSENTER / SYSEXIT
+*  expect them), followed by one TSS entry per cpu (the task register is also how a cpu tells
+*  which one it is), and finally our special GDT pointer */
+struct gdt_entry gdt[GDT_TSS + MAX_CPUS];
 struct gdt_ptr gp;
-struct tss_entry tss;
+struct tss_entry tss[MAX_CPUS];
 
 /* This will be a function in start.asm. We use this to properly
 *  reload the new segment registers */
@@ -111,18 +114,10 @@ void gdt_set_gate(int num, unsigned long base, unsigned long limit, unsigned cha
 *  new segment registers */
 void gdt_init(void)
 {
-  /* Setup the GDT pointer and limit */
-  gp.limit = (sizeof(struct gdt_entry) * 5) - 1;
-  gp.base = (unsigned int)&gdt;
-
-  /* Our NULL descriptor */
-  gdt_set_gate(0, 0, 0, 0, 0);
+  int i;
 
-  /* The second entry is our Code Segment. The base address
-   * is 0, the limit is 4GBytes, it uses 4KByte granularity,
-   * uses 32-bit opcodes, and is a Code Segment descriptor.
-   * Setup the GDT pointer and limit */
-  gp.limit = (sizeof(struct gdt_entry) * 5) - 1;
+  /* Setup the GDT pointer and limit */
+  gp.limit = sizeof(gdt) - 1;
   gp.base = (unsigned int)&gdt;
 
   /* Our NULL descriptor */
@@ -140,16 +135,44 @@ void gdt_init(void)
    *  this entry's access byte says it's a Data Segment */
   gdt_set_gate(2, 0, 0xFFFFFFFF, 0x92, 0xCF);
 
-  /* The fourth entry is the Task State Segement */
+  /* The same two again for ring 3 (DPL 3 in the access byte) */
+  gdt_set_gate(3, 0, 0xFFFFFFFF, 0xFA, 0xCF);
+  gdt_set_gate(4, 0, 0xFFFFFFFF, 0xF2, 0xCF);
+
+  /* The rest are the Task State Segements, one per cpu */
   /* may need to switch 0x89 (access) and 0x5f (granularity) */
-  gdt_set_gate(3, (unsigned long int)&tss, sizeof(struct tss_entry), 0x89, 0x00);
-		
-  memset(&tss, 0, sizeof(struct tss_entry));
-  tss.ss0 = 0x10;										//set stack to data segment
-  tss.esp0 = 0x0;
-			
+  for(i = 0; i < MAX_CPUS; i++)
+  {
+    gdt_set_gate(GDT_TSS + i, (unsigned long int)&tss[i], sizeof(struct tss_entry), 0x89, 0x00);
+
+    memset(&tss[i], 0, sizeof(struct tss_entry));
+    tss[i].ss0 = 0x10;										//set stack to data segment
+    tss[i].esp0 = 0x0;
+  }
+
   /* Flush out the old GDT and install the new changes! */
+  gdt_cpu_init(0);
+}
+
+/* Sets the stack a cpu switches to when something in ring 3 enters the
+*  kernel (an interrupt, int 0x80 or SYSENTER, see syscall.c) */
+void gdt_set_kernel_stack(unsigned int cpu, unsigned int esp0)
+{
+  tss[cpu].esp0 = esp0;
+}
+
+/* Returns what a cpu's SYSENTER_ESP points at: the word just above its
+*  TSS's esp0, so the entry code can load the real stack from [esp - 4] */
+unsigned int gdt_sysenter_stack(unsigned int cpu)
+{
+  return (unsigned int)&tss[cpu].esp0 + 4;
+}
+
+/* Loads the shared GDT and the cpu's own TSS. The boot cpu gets here
+*  from gdt_init, the others when they start up */
+void gdt_cpu_init(unsigned int cpu)
+{
   gdt_flush();
-		   
-  asm volatile ("ltr %%ax;"::"a"(3 << 3));		//gate is 3 but we set the last two bits for RPL = 3
+
+  asm volatile ("ltr %%ax;"::"a"((GDT_TSS + cpu) << 3));		//RPL is 0
 }
@@ -1,6 +1,7 @@
 #include "common.h"
 #include "screen.h"
 #include "idt.h"
+#include "task.h"
 
 void idt_init(void);
 void isrs_init(void);
@@ -80,6 +81,16 @@ extern void irq15();
 struct idt_entry idt[256];	/* 256 idts */
 struct idt_ptr idtp;		/* pointer to idt */
 static volatile unsigned char irq_received[16] = {0};
+static struct wait_queue irq_waiters[16];	/* threads blocked in irq_wait */
+
+/* Array of function pointers, used to handle custom exception handlers for given ISR */
+void *isr_routines[32] =
+{
+  0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0
+};
 
 /* Array of function pointers, used to handle custom IRQ handlers for given IRQ */
 void *irq_routines[16] =
@@ -96,6 +107,13 @@ void *irq_routines[16] =
  */ 
 void interrupt_init(void)
 {
+	int i;
+	for(i = 0; i < 16; i++)
+	{
+		irq_received[i] = 0;
+		wait_queue_init(&irq_waiters[i]);
+	}
+
 	idt_init();	
 	isrs_init();
 	irq_init();
@@ -240,6 +258,7 @@ void irq_handler(struct regs *r)
 	/* Execute the interrupt handler routine */
 	if(handler)
 		handler(r);
+	wake_up(&irq_waiters[r->int_no - 32]);
 
     // let the wait for IRQ function clear this after it's done
     // irq_received[r->int_no - 32] = 0;
@@ -300,16 +319,36 @@ char * const exception_messages[] =
 	"Reserved",
 };
 
+/* 
+ * Install a custom exception handler for the given ISR. The handler
+ * returns to the faulting instruction, so it must fix the cause first
+ */
+void isr_install_handler(int isr, void (*handler)(struct regs *r))
+{
+	isr_routines[isr] = handler;
+}
+
 /*
  * Common fault handler routine
- * - Display and error message regarding the exception
+ * - Run the installed handler for the exception, if there is one
+ * - Otherwise display an error message regarding the exception
  * - TODO: add register dump to provide more information
  */
 void fault_handler(struct regs *r)
 {
+	/* Blank function pointer */
+	void (*handler)(struct regs *r);
+
 	/* Check if fault between 0 and 31 */
 	if(r->int_no < 32)
 	{
+		handler = isr_routines[r->int_no];
+		if(handler)
+		{
+			handler(r);
+			return;
+		}
+
 		print_string(exception_messages[r->int_no]);
 		print_string(" Exception. System Halted!\n");
 		for(;;);
@@ -328,8 +367,6 @@ void irq_wait(int irq) {
 //  print_string(temp);
 //  print_string("\n");
   // note: only a single thread can wait for a particular irq at a time for now
-  while (!irq_received[irq]) {
-    __asm__("hlt");
-  }
+  wait_event(&irq_waiters[irq], irq_received[irq]);
   irq_received[irq] = 0;
 }
\ No newline at end of file
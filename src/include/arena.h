@@ -0,0 +1,15 @@
+#ifndef ARENA_HEADER
+#define ARENA_HEADER
+
+#include "common.h"
+
+struct arena;
+
+struct arena * arena_create(size_t size);
+void * arena_alloc(struct arena * arena, size_t size);
+unsigned int arena_mark(struct arena * arena);
+void arena_release(struct arena * arena, unsigned int mark);
+void arena_reset(struct arena * arena);
+void arena_destroy(struct arena * arena);
+
+#endif
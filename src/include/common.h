@@ -26,6 +26,11 @@ void outportsb(unsigned short port, const void * addr, unsigned long int count);
 void outportsw(unsigned short port, const void * addr, unsigned long int count);
 void outportsl(unsigned short port, const void * addr, unsigned long int count);
 
+unsigned int irq_save(void);
+void irq_restore(unsigned int flags);
+unsigned long long rdtsc(void);
+unsigned long long udiv64(unsigned long long n, unsigned int d);
+
 void *memset(void *dest, char val, unsigned int count);
 void * memcpy(void * dest, void * src, unsigned int count);
 int strpos(const char *str, const char c);
@@ -0,0 +1,33 @@
+#ifndef FIBER_HEADER
+#define FIBER_HEADER
+
+#define FIBER_STACK_SIZE  2048    /* interrupts taken while a fiber runs use it too */
+
+struct fiber;
+
+/* something fibers wait for, see fiber_await */
+struct fiber_event {
+  volatile unsigned int signaled;     /* set by fiber_signal, cleared by fiber_await */
+  struct fiber * waiters;
+};
+
+/*
+ * Blocks the running fiber (not the thread it runs on) until condition
+ * is true. Whoever makes it true calls fiber_signal on the event after
+ */
+#define fiber_wait_event(event, condition)  \
+  do {                                      \
+    while(!(condition))                     \
+      fiber_await(event);                   \
+  } while(0)
+
+void fiber_init(void);
+unsigned int fiber_spawn(void (*func)(void * arg), void * arg);
+struct fiber * fiber_current(void);
+unsigned int fiber_id(void);
+void fiber_yield(void);
+void fiber_event_init(struct fiber_event * event);
+void fiber_await(struct fiber_event * event);
+void fiber_signal(struct fiber_event * event);
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef FPU_HEADER
+#define FPU_HEADER
+
+#define FPU_STATE_SIZE    512       /* FXSAVE area, 16 byte aligned */
+#define MXCSR_DEFAULT     0x1F80    /* all SIMD exceptions masked, round to nearest */
+
+#define CR0_MP            0x00000002
+#define CR0_EM            0x00000004
+#define CR0_TS            0x00000008
+#define CR0_NE            0x00000020
+#define CR4_OSFXSR        0x00000200
+#define CR4_OSXMMEXCPT    0x00000400
+
+void fpu_init(void);
+void fpu_cpu_init(void);
+
+/*
+ * Lets the next FPU/SSE instruction run without trapping
+ */
+static inline void fpu_clts(void)
+{
+  __asm__ __volatile__ ("clts");
+}
+
+/*
+ * Makes the next FPU/SSE instruction trap with #NM (isr7)
+ */
+static inline void fpu_stts(void)
+{
+  unsigned int cr0;
+  __asm__ __volatile__ ("mov %%cr0, %0" : "=r" (cr0));
+  if(!(cr0 & CR0_TS))
+    __asm__ __volatile__ ("mov %0, %%cr0" : : "r" (cr0 | CR0_TS));
+}
+
+static inline int fpu_trapping(void)
+{
+  unsigned int cr0;
+  __asm__ __volatile__ ("mov %%cr0, %0" : "=r" (cr0));
+  return (cr0 & CR0_TS) != 0;
+}
+
+static inline void fpu_save(void * state)
+{
+  __asm__ __volatile__ ("fxsave (%0)" : : "r" (state) : "memory");
+}
+
+static inline void fpu_restore(void * state)
+{
+  __asm__ __volatile__ ("fxrstor (%0)" : : "r" (state) : "memory");
+}
+
+/*
+ * Puts the x87 and SSE control state back to the defaults, for a thread
+ * using the FPU for the first time
+ */
+static inline void fpu_reset(void)
+{
+  unsigned int mxcsr = MXCSR_DEFAULT;
+  __asm__ __volatile__ ("fninit; ldmxcsr %0" : : "m" (mxcsr));
+}
+
+#endif
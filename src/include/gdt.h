@@ -1,6 +1,14 @@
 #ifndef GDT_HEADER
 #define GDT_HEADER
 
+#define GDT_TSS   5   /* index of cpu 0's TSS, cpu n uses GDT_TSS + n */
+
+#define USER_CS   0x1B  /* ring 3 code and data selectors (RPL 3) */
+#define USER_DS   0x23
+
 void gdt_init(void);
+void gdt_cpu_init(unsigned int cpu);
+void gdt_set_kernel_stack(unsigned int cpu, unsigned int esp0);
+unsigned int gdt_sysenter_stack(unsigned int cpu);
 
 #endif
@@ -4,7 +4,9 @@
 #include "common.h"
 
 void interrupt_init(void);
+void isr_install_handler(int isr, void (*handler)(struct regs *r));
 void irq_install_handler(int irq, void (*handler)(struct regs *r));
 void irq_wait(int irq);
+void idt_set_gate(unsigned char num, unsigned long base, unsigned short sel, unsigned char flags);
 
 #endif
@@ -1,10 +1,86 @@
 #ifndef MM_HEADER
 #define MM_HEADER
 
+#define PAGE_SHIFT    12
+#define PAGE_SIZE     (1 << PAGE_SHIFT)
+#define MM_MAX_ORDER  11    /* largest buddy block is 2^10 pages (4MB) */
+
+#define MM_START      0x1000000   /* below this is the kernel image and boot stack */
+
+/*
+ * dma_alloc constraints. Buffers that must be below MM_START come from a
+ * small zone between the boot stack and the heap
+ */
+#define DMA_ZONE_START    0xF00000
+#define ISA_DMA_LIMIT     0x1000000   /* the ISA DMA controller has 24 address bits */
+#define ISA_DMA_BOUNDARY  0x10000     /* and can't carry past a 64KB boundary */
+
+/*
+ * BIOS memory map left behind by stage2 (INT 15h, EAX=0xE820): a count
+ * followed by the entries. 64 bit fields are split into low / high halves
+ */
+#define E820_MAP_ADDR     0x10000
+#define E820_MAX_ENTRIES  32
+#define E820_USABLE       1
+#define E820_RESERVED     2
+#define E820_ACPI         3     /* reclaimable once the ACPI tables are read */
+#define E820_NVS          4
+
+struct e820_entry {
+  unsigned int base_low;
+  unsigned int base_high;
+  unsigned int length_low;
+  unsigned int length_high;
+  unsigned int type;
+  unsigned int acpi;            /* ACPI 3.0 extended attributes */
+} __attribute__((packed));
+
+struct e820_map {
+  unsigned int count;
+  struct e820_entry entries[E820_MAX_ENTRIES];
+} __attribute__((packed));
+
+/* snapshot of the allocator for sizing node memory, see mm_get_stats */
+struct mm_stats {
+  unsigned int free_bytes;      /* free in the page allocator */
+  unsigned int largest_free;    /* largest contiguous free block */
+  unsigned int heap_live;       /* bytes currently handed out by kmalloc */
+  unsigned int slab_bytes;      /* bytes held by slabs */
+  unsigned int slab_used;       /* bytes in allocated slab objects */
+  unsigned int internal_frag;   /* percent lost rounding up kmalloc requests */
+  unsigned int external_frag;   /* percent of free memory broken below the max order */
+  unsigned int slab_frag;       /* percent of slab memory not holding objects */
+};
+
+void mm_init(struct e820_map * map);
+void * kalloc_pages(unsigned int order);
+void kfree_pages(void * addr);
 void * kalloc_page(void);
+void kfree_page(void * page);
+void * kalloc_zeroed_page(void);
+int page_ref_get(void * page);
+int page_ref_put(void * page);
+unsigned int page_ref_count(void * page);
+void page_zero_task(void);
+void * dma_alloc(size_t size, unsigned int align, unsigned int max_addr, unsigned int boundary);
+void dma_free(void * addr, size_t size);
+void mm_set_slab(void * block, unsigned int order);
+int mm_slab_order(void * addr);
+
+void kmalloc_init(void);
+void * kmalloc(size_t size);
+void * krealloc(void * ptr, size_t size);
+size_t ksize(void * ptr);
+void kfree(void * ptr);
 void * malloc(size_t size);
 void * calloc(size_t size);
+
+void mm_get_stats(struct mm_stats * stats);
 void display_free_bytes(void);
-int mm_get_free(void);
+void mm_profile_tick(void);
+void display_memstat(void);
+unsigned int mm_get_free(void);
+unsigned int mm_get_total(void);
+unsigned int mm_get_top(void);
 
 #endif
@@ -1,7 +1,96 @@
 #ifndef MUTEX_H
 #define MUTEX_H
 
-void spinlock();
-void spinunlock();
+/*
+ * A ticket spinlock. Lockers take a ticket from next and spin until owner
+ * reaches it, so the lock is handed out in the order it was asked for
+ */
+typedef union {
+  volatile unsigned int value;
+  struct {
+    volatile unsigned short owner;    /* ticket being served */
+    volatile unsigned short next;     /* next ticket to hand out */
+  } ticket;
+} spinlock_t;
+
+#define SPIN_LOCK_UNLOCKED  { 0 }
+
+#define RW_WRITER           0x80000000    /* a writer holds the lock, or is waiting for the readers to leave */
+
+/*
+ * A reader-writer spinlock: any number of readers, or one writer. A
+ * waiting writer keeps new readers out, so it can't be starved
+ */
+typedef struct {
+  volatile unsigned int value;        /* RW_WRITER, plus the number of readers in */
+} rwlock_t;
+
+#define RW_LOCK_UNLOCKED    { 0 }
+
+/*
+ * A sequence lock: writers take the spinlock and make sequence odd while
+ * they change the data, readers take nothing and just retry if sequence
+ * moved under them. Readers never write to the lock, so they don't bounce
+ * its cache line between cpus, but the data must be safe to read while it
+ * changes (no pointers to follow), and they must only act on it once
+ * read_seqretry says it was consistent
+ */
+typedef struct {
+  volatile unsigned int sequence;     /* odd while a writer is in */
+  spinlock_t lock;                    /* between writers */
+} seqlock_t;
+
+#define SEQLOCK_UNLOCKED    { 0, SPIN_LOCK_UNLOCKED }
+
+void spin_lock_init(spinlock_t * lock);
+void spin_lock(spinlock_t * lock);
+int spin_trylock(spinlock_t * lock);
+void spin_unlock(spinlock_t * lock);
+int spin_is_locked(spinlock_t * lock);
+unsigned int spin_lock_irqsave(spinlock_t * lock);
+void spin_unlock_irqrestore(spinlock_t * lock, unsigned int flags);
+
+void rwlock_init(rwlock_t * lock);
+void read_lock(rwlock_t * lock);
+void read_unlock(rwlock_t * lock);
+void write_lock(rwlock_t * lock);
+void write_unlock(rwlock_t * lock);
+unsigned int read_lock_irqsave(rwlock_t * lock);
+void read_unlock_irqrestore(rwlock_t * lock, unsigned int flags);
+unsigned int write_lock_irqsave(rwlock_t * lock);
+void write_unlock_irqrestore(rwlock_t * lock, unsigned int flags);
+
+void seqlock_init(seqlock_t * lock);
+void write_seqlock(seqlock_t * lock);
+void write_sequnlock(seqlock_t * lock);
+unsigned int write_seqlock_irqsave(seqlock_t * lock);
+void write_sequnlock_irqrestore(seqlock_t * lock, unsigned int flags);
+
+/*
+ * Starts a seqlock read section, returns the sequence to give
+ * read_seqretry. Waits out a writer that is already in
+ */
+static inline unsigned int read_seqbegin(seqlock_t * lock)
+{
+  unsigned int sequence;
+
+  while((sequence = lock->sequence) & 1)
+    __asm__ __volatile__ ("pause" : : : "memory");
+  /* x86 doesn't reorder loads, the compiler mustn't either */
+  __asm__ __volatile__ ("" : : : "memory");
+  return sequence;
+}
+
+/*
+ * Ends a seqlock read section. Returns non-zero if a writer got in since
+ * read_seqbegin, and what was read has to be read again
+ */
+static inline int read_seqretry(seqlock_t * lock, unsigned int start)
+{
+  __asm__ __volatile__ ("" : : : "memory");
+  return lock->sequence != start;
+}
+
+void lock_bench(void);
 
 #endif
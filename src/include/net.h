@@ -1,6 +1,10 @@
 #ifndef NET_HEADER
 #define NET_HEADER
 
+#define NET_BUFFER_SIZE 1536   /* largest ethernet frame, rounded to a cache line */
+#define NET_TX_LAYERS   3      /* udp -> ipv4 -> ethernet each build a buffer */
+
+void net_init(void);
 void ip(void);
 
 #endif
@@ -1,6 +1,8 @@
 #ifndef DHCP_HEADER
 #define DHCP_HEADER
 
+void dhcp_init(void);
 void dhcp_discover(void);
+void dhcp_start(void);
 
 #endif
@@ -1,6 +1,8 @@
 #ifndef IN_HEADER
 #define IN_HEADER
 
+unsigned char * string_to_ip(char * string_ip);
+void free_ip(unsigned char * ip);
 void print_ip(unsigned char * ip);
 void print_mac(unsigned char * mac);
 
@@ -0,0 +1,30 @@
+#ifndef PAGING_HEADER
+#define PAGING_HEADER
+
+#define PTE_PRESENT     0x001
+#define PTE_WRITE       0x002
+#define PTE_USER        0x004
+#define PTE_PWT         0x008   /* write-through */
+#define PTE_PCD         0x010   /* cache disable, for device memory */
+#define PTE_LARGE       0x080   /* 4MB page (directory entries only) */
+#define PTE_GLOBAL      0x100   /* not flushed on cr3 reload */
+#define PTE_COW         0x200   /* read-only until written, then copied (a bit the cpu ignores) */
+
+#define KERNEL_MAP_END  0x4000000   /* identity map at least this much, 64MB */
+
+/*
+ * Each address space has its own mappings here, everything else is the
+ * kernel's. The page allocator stops at USER_BASE so the identity map
+ * never reaches it, and it ends below the IOAPIC and local APIC
+ */
+#define USER_BASE       0xC0000000
+#define USER_END        0xF0000000
+
+void paging_init(void);
+int map_page(void * virt, unsigned int phys, unsigned int flags);
+void unmap_page(void * virt);
+unsigned int virt_to_phys(void * virt);
+unsigned int paging_fork(void);
+void paging_free(unsigned int directory);
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef SLAB_HEADER
+#define SLAB_HEADER
+
+#include "common.h"
+
+#define CACHE_LINE_SIZE 64
+
+struct kmem_cache;
+
+void slab_init(void);
+struct kmem_cache * kmem_cache_create(char * name, size_t size, void (*ctor)(void *));
+void * kmem_cache_alloc(struct kmem_cache * cache);
+void kmem_cache_free(struct kmem_cache * cache, void * obj);
+struct kmem_cache * virt_to_cache(void * obj);
+unsigned char * kmem_cache_tag(struct kmem_cache * cache, void * obj);
+size_t kmem_cache_size(struct kmem_cache * cache);
+void kmem_cache_usage(unsigned int * slab_bytes, unsigned int * object_bytes);
+void slabinfo(void);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef SMP_HEADER
+#define SMP_HEADER
+
+#include "gdt.h"
+
+#define MAX_CPUS              8
+#define SMP_TRAMPOLINE        0xE000  /* real mode start up page for the other cpus, must match smp.s */
+
+#define LAPIC_TIMER_VECTOR    48      /* just above the remapped IRQs */
+#define LAPIC_TLB_VECTOR      49      /* TLB shootdown IPI */
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+void smp_init(void);
+unsigned int smp_cpu_count(void);
+unsigned int lapic_timer_handler(unsigned int old_esp);
+void tlb_shootdown(unsigned int directory, void * virt);
+void tlb_shootdown_handler(void);
+
+/*
+ * Returns the number of the cpu we are running on (0 is the boot cpu).
+ * Each cpu loads its own TSS, so the task register says which one it is
+ */
+static inline unsigned int cpu_id(void)
+{
+  unsigned short tr;
+  __asm__ __volatile__ ("str %0" : "=r" (tr));
+  return (tr >> 3) - GDT_TSS;
+}
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef SYSCALL_HEADER
+#define SYSCALL_HEADER
+
+#define SYSCALL_VECTOR  0x80
+
+/* system call numbers (eax), must match the table in syscall.c */
+#define SYS_NULL        0     /* does nothing, for measuring the entry and exit */
+#define SYS_EXIT        1     /* back to whoever called user_enter with ebx, or ends a forked thread */
+#define SYS_GETTID      2
+#define SYS_FORK        3     /* the new thread's id, 0 in the new thread */
+#define SYSCALL_COUNT   4
+
+/*
+ * What both entry stubs save, laid out like an int 0x80 from ring 3 (the
+ * SYSENTER stub fakes the part the cpu would have pushed)
+ */
+struct syscall_regs {
+  unsigned int eax, ebx, ecx, edx, esi, edi, ebp;   /* pushed by the stub */
+  unsigned int eip, cs, eflags, esp, ss;            /* pushed by the cpu */
+};
+
+void syscall_init(void);
+void syscall_cpu_init(void);
+int syscall_dispatch(struct syscall_regs * regs);
+int user_enter(unsigned int eip, unsigned int esp);
+void syscall_bench(void);
+void fork_test(void);
+
+#endif
@@ -1,9 +1,84 @@
 #ifndef TASK_HEADER
 #define TASK_HEADER
 
+#define THREAD_PRIORITIES         32    /* 0 is the highest */
+#define THREAD_PRIORITY_HIGH      4     /* latency sensitive, e.g. packet processing */
+#define THREAD_PRIORITY_DEFAULT   16
+#define THREAD_PRIORITY_IDLE      31    /* background work, e.g. zeroing free pages */
+
+#define LOAD_FSHIFT               11    /* fixed point bits of the load averages */
+
+struct thread;
+struct syscall_regs;
+
+/* what thread_stats reports for each thread */
+struct thread_stat {
+  unsigned int id;
+  unsigned int priority;
+  char state;                           /* R running, Q queued, B blocked, Z zombie */
+  unsigned int cpu;                     /* running or queued on, or last ran on */
+  unsigned long long runtime;           /* tsc cycles spent running */
+  unsigned long long wait_time;         /* tsc cycles spent runnable but queued */
+  unsigned int nvcsw;                   /* voluntary switches (blocked or yielded) */
+  unsigned int nivcsw;                  /* involuntary switches (preempted) */
+};
+
+/* threads blocked until some event, woken in FIFO order */
+struct wait_queue {
+  struct thread * head;
+  struct thread * tail;
+};
+
+/*
+ * Blocks the running thread until condition is true. Whoever makes it
+ * true calls wake_up on the queue afterwards
+ */
+#define wait_event(queue, condition)  \
+  do {                                \
+    for(;;)                           \
+    {                                 \
+      prepare_to_wait(queue);         \
+      if(condition)                   \
+        break;                        \
+      task_wait();                    \
+    }                                 \
+    finish_wait(queue);               \
+  } while(0)
+
 void thread_init(void);
+int thread_cpu_init(unsigned int cpu, void * stack);
+void thread_cpu_start(void);
+void cpu_idle(void);
 unsigned int task_switch(unsigned int old_esp);
-void create_task(void (*t)());
-int fork(void);
+unsigned int task_schedule(unsigned int old_esp);
+void task_switch_done(void);
+unsigned int create_task(void (*t)());
+unsigned int create_task_priority(void (*t)(), unsigned int priority);
+int thread_set_priority(unsigned int id, unsigned int priority);
+unsigned int thread_id(void);
+void thread_set_kernel_stack(unsigned int esp);
+unsigned int thread_kernel_stack(void);
+void wait_queue_init(struct wait_queue * queue);
+void prepare_to_wait(struct wait_queue * queue);
+void task_wait(void);
+void finish_wait(struct wait_queue * queue);
+void wake_up(struct wait_queue * queue);
+void thread_sleep_until(unsigned int wake_time);
+void task_wake_sleepers(unsigned int now);
+int task_needs_tick(void);
+int task_next_wake(unsigned int * wake_time);
+void thread_exit(void);
+int thread_join(unsigned int id);
+int thread_exists(unsigned int id);
+void sched_stats(void);
+int thread_stats(struct thread_stat * stats, int max);
+int cpu_idle_time(unsigned int id, unsigned long long * idle);
+void task_load_update(unsigned int seconds);
+void task_load_average(unsigned int * load);
+void top(void);
+void thread_fpu_init(void);
+void thread_fpu_trap(void);
+int fork(struct syscall_regs * regs);
+unsigned int thread_set_address_space(unsigned int cr3);
 
 #endif
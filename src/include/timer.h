@@ -3,8 +3,30 @@
 
 #include "common.h"
 
+/*
+ * A software timer, see timer_add. Set up with timer_setup before use,
+ * the rest belongs to timer.c
+ */
+struct timer {
+  struct timer * next;
+  struct timer ** pprev;              /* NULL while not pending */
+  unsigned int expires;               /* in timer_jiffies */
+  void (*func)(struct timer * timer);
+};
+
 void timer_init(void);
 unsigned int timer_handler(unsigned int old_esp);
+void timer_sync(void);
+void timer_kick(void);
+void timer_pit_wait(unsigned int us);
+unsigned long long clock_monotonic_ns(void);
+unsigned long long cycles_to_ns(unsigned long long cycles);
+unsigned int clock_tsc_khz(void);
+void ndelay(unsigned int ns);
+void udelay(unsigned int us);
 void sleep(int time_ms);
+void timer_setup(struct timer * timer, void (*func)(struct timer * timer));
+void timer_add(struct timer * timer, unsigned int ms);
+int timer_cancel(struct timer * timer);
 
 #endif
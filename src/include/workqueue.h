@@ -0,0 +1,15 @@
+#ifndef WORKQUEUE_HEADER
+#define WORKQUEUE_HEADER
+
+/* a piece of deferred work, usually embedded in a driver's state */
+struct work {
+  void (*func)(struct work * work);
+  struct work * next;
+  volatile unsigned int pending;      /* queued and not started yet */
+};
+
+void workqueue_init(void);
+void work_init(struct work * work, void (*func)(struct work * work));
+int work_schedule(struct work * work);
+
+#endif
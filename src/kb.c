@@ -2,6 +2,7 @@
 #include "screen.h"
 #include "idt.h"
 #include "kb.h"
+#include "task.h"
 
 #define KB_META_ALT		0x0200
 #define KB_META_CTRL	0x0400
@@ -13,6 +14,7 @@
 
 char kb_buffer[KB_BUFFER_SIZE];
 int input_ready;
+struct wait_queue input_waiters;	/* threads blocked in kb_gets */
 int buffer_position;
 void reboot(void);	
 
@@ -21,6 +23,7 @@ void kb_init(void)
   irq_install_handler(1, kb_handler);
   input_ready = -1;
   buffer_position = 0;
+  wait_queue_init(&input_waiters);
 }
 
 char kbcdn[128] =
@@ -64,6 +67,7 @@ void kb_handler(struct regs *r)
         kb_buffer[buffer_position-1] = '\0';
         buffer_position = 0;
         input_ready = 1;
+        wake_up(&input_waiters);
       }
     }//end else
   }
@@ -114,7 +118,7 @@ void reboot(void)
 char * kb_gets(char * str)
 {
   int length;
-  while(input_ready == -1) {__asm__("hlt");}
+  wait_event(&input_waiters, input_ready != -1);
   input_ready = -1;
   length = strlen(kb_buffer);
   memcpy(str, kb_buffer, length+1);
@@ -1,10 +1,21 @@
+#include "common.h"
 #include "screen.h"
 #include "cli.h"
+#include "mm.h"
+#include "task.h"
 
-int main(void) {
+/*
+ * Entered from the stage2.5 loader with the BIOS E820 memory map that
+ * stage2 collected before switching to protected mode
+ */
+int main(struct e820_map * memory_map) {
     screen_init();
     screen_clear();
     print_string("I'm in the kernel now!!");
+    (void)memory_map;
+
+    /* Nothing below is booted yet: the Makefile only links kernel.o, screen.o
+     * and common.o into KERNEL.BIN (see "What is not booted yet" in README.md) */
 
 //  /* Global Descriptor Table - Sets up Rings, Flat memory segments
 //   * (ie, 4GB available for each ring) */
@@ -14,25 +25,51 @@ int main(void) {
 //  screen_init();
 //  screen_clear();
 //
-//  ipv4_init();
-//  udp_init();
-//
 //  /* Create the table of exception and interrupt functions */
 //  print_string("Setting Up Interrupts...");
 //  interrupt_init();
 //  print_status(1);
 //
+//  /* Sets up the page allocator over all usable RAM, this backs malloc and
+//   * the thread stacks */
+//  mm_init(memory_map);
+//  slab_init();
+//  kmalloc_init();
+//
+//  /* Identity map the kernel and heap with 4MB pages and turn on paging */
+//  paging_init();
+//
+//  net_init();
+//
 //  /* Sets up the thread structures so we can do context switches */
 //  print_string("Initializing Threads & System Timer...");
 //  thread_init();
 //
-//  /* Starts the system clock */
+//  /* Turns on the FPU and SSE, thread state is saved lazily */
+//  fpu_init();
+//
+//  /* Ring 3 entry points: the int 0x80 gate, and SYSENTER if the cpu has it */
+//  syscall_init();
+//
+//  /* Runs the work interrupt handlers defer, e.g. network receive processing */
+//  workqueue_init();
+//
+//  /* Runs fibers, cheap cooperative tasks for e.g. one per network transaction */
+//  fiber_init();
+//
+//  /* Keeps a pool of zeroed pages ready for calloc and page tables */
+//  create_task_priority(page_zero_task, THREAD_PRIORITY_IDLE);
+//
+//  /* Starts the system clock, and the thread that runs timer callbacks */
 //  timer_init();
 //  print_status(1);
 //
 //  /* Enable interrupts */
 //  asm volatile ("sti");
 //
+//  /* Start the other cpus, they pick up threads from the same run queues */
+//  smp_init();
+//
 //  /* Scan the PCI bus for devices we recognize and init the driver for each device */
 //  print_string("Scanning PCI Bus for devices...\n");
 //  pci_init();
@@ -1,8 +1,542 @@
 #include "common.h"
 #include "screen.h"
+#include "mm.h"
+#include "paging.h"
+#include "slab.h"
+#include "task.h"
+#include "mutex.h"
 
-void * mem = (void*)0x1000000;			/* the address where we start giving out memory from */
-void * lim = (void*)0x3FFFFFF;			/* the end address of the malloc space */
+/*
+ * Physical page frame allocator (binary buddy system)
+ *
+ * All usable RAM above MM_START, as reported by the BIOS memory map, is
+ * split into naturally aligned blocks of 2^order pages.
+ * Each order keeps its own doubly linked free list, threaded through the
+ * free blocks themselves (RAM is identity mapped, so physical == virtual).
+ * Allocating splits a larger block down to the requested order and freeing
+ * merges a block with its buddy for as long as the buddy is also free, so
+ * both operations are O(MM_MAX_ORDER).
+ *
+ * page_info holds one byte per page: the order of the block that starts on
+ * that page, plus PAGE_FREE if the block is sitting on a free list. Pages in
+ * the middle of a block are zero, except for slabs where every page is
+ * tagged PAGE_SLAB with the slab order so kfree can find the slab header.
+ * Pages that are not usable RAM are PAGE_RESERVED.
+ *
+ * On top of that sits kmalloc: requests up to KMALLOC_MAX_SIZE come from
+ * power of two slab caches (a free list pop), anything larger is rounded up
+ * to a whole block of pages.
+ *
+ * dma_alloc gives out physically contiguous buffers with alignment, address
+ * limit and boundary constraints for devices. The buddy blocks already
+ * are naturally aligned, so it only has to look for one low enough. ISA
+ * DMA wants memory below 16MB, which the heap doesn't have, so the usable
+ * pages between DMA_ZONE_START and MM_START are kept in a small bitmap
+ * zone of their own.
+ *
+ * A small pool of pages that have already been zeroed is kept topped up by
+ * page_zero_task when the system is otherwise idle, so calloc of a page and
+ * new page tables don't have to clear memory on the hot path.
+ *
+ * Every kmalloc / malloc / calloc / kalloc_page is charged to the return
+ * address of its caller in a small hash table of allocation sites. The
+ * allocation keeps a one byte tag naming its site (in page_tag for blocks
+ * of pages, in the slab header for objects) so frees are charged back and
+ * each site has live and peak byte counts. That costs a hash probe per
+ * call, so it is always on; see display_memstat.
+ */
+#define PAGE_FREE   0x80
+#define PAGE_SLAB   0x40
+#define PAGE_RESERVED 0x20      /* not usable RAM, never on a free list */
+#define PAGE_ORDER  0x0F
+
+#define MM_DEFAULT_END  0x4000000   /* heap end if the BIOS gave no memory map */
+#define MM_MAX_PFN      (USER_BASE >> PAGE_SHIFT)   /* the user window and firmware are above */
+
+#define KMALLOC_MIN_SHIFT 6     /* smallest class is a cache line */
+#define KMALLOC_MAX_SHIFT 11
+#define KMALLOC_MAX_SIZE  (1 << KMALLOC_MAX_SHIFT)
+#define KMALLOC_CLASSES   (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+
+#define DMA_ZONE_PFN      (DMA_ZONE_START >> PAGE_SHIFT)
+#define DMA_ZONE_PAGES    ((MM_START - DMA_ZONE_START) >> PAGE_SHIFT)
+
+#define ALLOC_SITES       128   /* tag 0 is untracked, 1 collects sites that don't fit */
+#define ALLOC_SITE_OTHER  1
+#define ALLOC_SITE_PROBES 8
+#define MEMSTAT_TOP       10
+
+#define ZERO_POOL_LOW     16    /* refill the zeroed pool below this many pages */
+#define ZERO_POOL_MAX     64
+#define ZERO_POOL_RESERVE 1024  /* leave this many pages in the buddy lists */
+
+struct free_block {
+  struct free_block * next;
+  struct free_block * prev;
+};
+
+struct free_block * free_area[MM_MAX_ORDER];	/* per-order free lists */
+unsigned int free_count[MM_MAX_ORDER];		/* number of blocks on each list */
+unsigned char * page_info;			/* per page order and flags */
+unsigned char * page_tag;			/* allocation site of each tagged block */
+unsigned char * page_refs;			/* mappings of each page beyond the first, see page_ref_get */
+unsigned int mm_base_pfn;			/* first page frame we manage */
+unsigned int mm_total_pages;			/* pages covered by page_info, holes included */
+unsigned int mm_usable_pages;			/* pages that went onto the free lists */
+unsigned int mm_free_pages;
+unsigned int mm_min_free_pages;			/* low water mark of mm_free_pages */
+spinlock_t zone_lock;				/* the free lists, page_info and the counts above */
+
+unsigned int dma_zone_map[DMA_ZONE_PAGES / 32];	/* set bits are free pages */
+spinlock_t dma_lock;
+
+struct zero_page {
+  struct zero_page * next;      /* the only non-zero word while pooled */
+};
+
+struct zero_page * zero_pool;			/* pages that are already zeroed */
+unsigned int zero_pool_count;
+spinlock_t zero_pool_lock;
+struct wait_queue zero_pool_wait;		/* page_zero_task, while the pool is full enough */
+
+struct kmem_cache * kmalloc_caches[KMALLOC_CLASSES];
+char * kmalloc_names[KMALLOC_CLASSES] = {
+  "kmalloc-64", "kmalloc-128", "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048"
+};
+
+/*
+ * Running totals for the internal fragmentation estimate: the bytes callers
+ * asked kmalloc for vs the bytes handed out once rounded up to a size class
+ * or to whole pages. Both are halved together before they can overflow so
+ * the ratio keeps tracking recent behaviour.
+ */
+unsigned int heap_requested;
+unsigned int heap_granted;
+unsigned int heap_live;                         /* granted bytes not yet freed */
+unsigned int heap_peak;
+spinlock_t mm_stats_lock;			/* the totals above and alloc_sites */
+
+struct alloc_site {
+  void * caller;                /* return address of the allocating call */
+  unsigned int allocs;
+  unsigned int frees;
+  unsigned int live;            /* bytes currently allocated */
+  unsigned int peak;            /* most bytes allocated at once */
+  unsigned int rate;            /* allocations in the last second */
+  unsigned int last_allocs;     /* allocs at the start of that second */
+};
+
+struct alloc_site * alloc_sites;		/* ALLOC_SITES entries, NULL until kmalloc_init */
+
+static inline unsigned int addr_to_pfn(void * addr)
+{
+  return ((unsigned int)addr >> PAGE_SHIFT) - mm_base_pfn;
+}
+
+static inline void * pfn_to_addr(unsigned int pfn)
+{
+  return (void*)((pfn + mm_base_pfn) << PAGE_SHIFT);
+}
+
+static inline int mm_owns(void * addr)
+{
+  return ((unsigned int)addr >> PAGE_SHIFT) - mm_base_pfn < mm_total_pages;
+}
+
+/*
+ * Zeroes count dwords at dest with rep stosd
+ */
+static inline void zero_dwords(void * dest, unsigned int count)
+{
+  __asm__ __volatile__ ("cld; rep stosl" : "+D" (dest), "+c" (count) : "a" (0) : "memory");
+}
+
+/*
+ * Pops a page off the zeroed pool, or returns NULL if it is empty
+ */
+static void * zero_pool_get(void)
+{
+  struct zero_page * page;
+  unsigned int flags = spin_lock_irqsave(&zero_pool_lock);
+  page = zero_pool;
+  if(page != NULL)
+  {
+    zero_pool = page->next;
+    zero_pool_count--;
+    if(zero_pool_count < ZERO_POOL_LOW)
+      wake_up(&zero_pool_wait);
+  }
+  spin_unlock_irqrestore(&zero_pool_lock, flags);
+  if(page != NULL)
+    page->next = NULL;
+  return page;
+}
+
+/*
+ * Finds the profiling slot for an allocation site, claiming an empty one
+ * the first time the site is seen. Sites that can't be placed within a few
+ * probes share ALLOC_SITE_OTHER. Called with interrupts off
+ */
+static unsigned int alloc_site_slot(void * caller)
+{
+  unsigned int hash = ((unsigned int)caller * 2654435761u) >> 25;
+  unsigned int i, slot;
+
+  for(i = 0; i < ALLOC_SITE_PROBES; i++)
+  {
+    slot = (hash + i) % (ALLOC_SITES - 2) + 2;
+    if(alloc_sites[slot].caller == caller)
+      return slot;
+    if(alloc_sites[slot].caller == NULL)
+    {
+      alloc_sites[slot].caller = caller;
+      return slot;
+    }
+  }
+  return ALLOC_SITE_OTHER;
+}
+
+/*
+ * Charges an allocation of 'bytes' to the site it was made from. Returns
+ * the tag to keep with the allocation so profile_free can charge it back
+ */
+static unsigned char profile_alloc(void * caller, unsigned int bytes)
+{
+  struct alloc_site * site;
+  unsigned int slot, flags;
+
+  if(alloc_sites == NULL)
+    return 0;
+
+  flags = spin_lock_irqsave(&mm_stats_lock);
+  slot = alloc_site_slot(caller);
+  site = &alloc_sites[slot];
+  site->allocs++;
+  site->live += bytes;
+  if(site->live > site->peak)
+    site->peak = site->live;
+  spin_unlock_irqrestore(&mm_stats_lock, flags);
+  return slot;
+}
+
+/*
+ * Charges a free of 'bytes' back to the site with the given tag
+ */
+static void profile_free(unsigned char tag, unsigned int bytes)
+{
+  unsigned int flags;
+
+  if(tag == 0 || alloc_sites == NULL)
+    return;
+
+  flags = spin_lock_irqsave(&mm_stats_lock);
+  alloc_sites[tag].frees++;
+  alloc_sites[tag].live -= bytes;
+  spin_unlock_irqrestore(&mm_stats_lock, flags);
+}
+
+/*
+ * Pushes the block starting at pfn onto the free list for order
+ */
+static void free_list_add(unsigned int pfn, unsigned int order)
+{
+  struct free_block * block = pfn_to_addr(pfn);
+  block->prev = NULL;
+  block->next = free_area[order];
+  if(free_area[order] != NULL)
+    free_area[order]->prev = block;
+  free_area[order] = block;
+  free_count[order]++;
+  page_info[pfn] = PAGE_FREE | order;
+}
+
+/*
+ * Unlinks the block starting at pfn from the free list for order
+ */
+static void free_list_del(unsigned int pfn, unsigned int order)
+{
+  struct free_block * block = pfn_to_addr(pfn);
+  if(block->prev != NULL)
+    block->prev->next = block->next;
+  else
+    free_area[order] = block->next;
+  if(block->next != NULL)
+    block->next->prev = block->prev;
+  free_count[order]--;
+  page_info[pfn] = order;
+}
+
+/*
+ * Clips a memory map entry to whole pages between floor and MM_MAX_PFN.
+ * Usable ranges are rounded inwards and everything else outwards, so a
+ * partial page is never handed out. Returns 0 if nothing is left
+ */
+static int e820_range(struct e820_entry * entry, unsigned int floor, unsigned int * start, unsigned int * end)
+{
+  unsigned int first = entry->base_low;
+  unsigned int last = entry->base_low + entry->length_low - 1;
+
+  if(entry->base_high != 0 || (entry->length_low == 0 && entry->length_high == 0))
+    return 0;
+  if(entry->length_high != 0 || last < first)
+    last = 0xFFFFFFFF;                          /* runs past 4GB */
+
+  if(entry->type == E820_USABLE)
+  {
+    *start = (first >> PAGE_SHIFT) + ((first & (PAGE_SIZE - 1)) != 0);
+    *end = (last >> PAGE_SHIFT) + ((last & (PAGE_SIZE - 1)) == PAGE_SIZE - 1);
+  }
+  else
+  {
+    *start = first >> PAGE_SHIFT;
+    *end = (last >> PAGE_SHIFT) + 1;
+  }
+
+  if(*start < floor)
+    *start = floor;
+  if(*end > MM_MAX_PFN)
+    *end = MM_MAX_PFN;
+  return *start < *end;
+}
+
+/*
+ * Sets up the free lists over all the usable memory in the BIOS memory map
+ * above MM_START, and the DMA zone below it. If there is no map (the BIOS
+ * does not do E820) the old fixed 48MB heap is assumed. The page_info,
+ * page_tag and page_refs tables are carved out of the first usable range big enough to
+ * hold them, and any page the BIOS did not report as usable (reserved,
+ * ACPI, holes) is marked PAGE_RESERVED so it is never handed out or merged
+ * with.
+ */
+void mm_init(struct e820_map * map)
+{
+  struct e820_entry fallback;
+  struct e820_entry * entries;
+  unsigned int count, i, pfn, start, end, info_pages, info, top;
+
+  spin_lock_init(&zone_lock);
+  for(i = 0; i < MM_MAX_ORDER; i++)
+  {
+    free_area[i] = NULL;
+    free_count[i] = 0;
+  }
+
+  entries = map->entries;
+  count = map->count;
+  if(count == 0 || count > E820_MAX_ENTRIES)
+  {
+    fallback.base_low = DMA_ZONE_START;
+    fallback.base_high = 0;
+    fallback.length_low = MM_DEFAULT_END - DMA_ZONE_START;
+    fallback.length_high = 0;
+    fallback.type = E820_USABLE;
+    entries = &fallback;
+    count = 1;
+  }
+
+  /* the highest usable page decides how many pages page_info covers */
+  mm_base_pfn = MM_START >> PAGE_SHIFT;
+  top = mm_base_pfn;
+  for(i = 0; i < count; i++)
+    if(entries[i].type == E820_USABLE && e820_range(&entries[i], mm_base_pfn, &start, &end) && end > top)
+      top = end;
+  mm_total_pages = top - mm_base_pfn;
+  info_pages = (3 * mm_total_pages + PAGE_SIZE - 1) >> PAGE_SHIFT;
+
+  info = 0;
+  for(i = 0; i < count; i++)
+  {
+    if(entries[i].type == E820_USABLE && e820_range(&entries[i], mm_base_pfn, &start, &end) && end - start > info_pages)
+    {
+      info = start;
+      break;
+    }
+  }
+  if(info == 0)
+    mm_total_pages = info_pages = 0;
+  page_info = (unsigned char *)(info << PAGE_SHIFT);
+  page_tag = page_info + mm_total_pages;
+  memset(page_tag, 0, mm_total_pages);
+  page_refs = page_tag + mm_total_pages;
+  memset(page_refs, 0, mm_total_pages);
+
+  /* usable ranges first, then anything the BIOS reserved wins over them */
+  memset(page_info, PAGE_RESERVED, mm_total_pages);
+  for(i = 0; i < count; i++)
+    if(entries[i].type == E820_USABLE && e820_range(&entries[i], mm_base_pfn, &start, &end))
+      memset(&page_info[start - mm_base_pfn], 0, end - start);
+  for(i = 0; i < count; i++)
+  {
+    if(entries[i].type != E820_USABLE && e820_range(&entries[i], mm_base_pfn, &start, &end) && start < top)
+      memset(&page_info[start - mm_base_pfn], PAGE_RESERVED, (end < top ? end : top) - start);
+  }
+  memset(&page_info[info - mm_base_pfn], PAGE_RESERVED, info_pages);
+
+  /* hand each usable run out as the largest naturally aligned blocks that fit */
+  mm_free_pages = 0;
+  pfn = 0;
+  while(pfn < mm_total_pages)
+  {
+    if(page_info[pfn] != 0)
+    {
+      pfn++;
+      continue;
+    }
+    for(end = pfn; end < mm_total_pages && page_info[end] == 0; end++)
+      ;
+    while(pfn < end)
+    {
+      unsigned int order = MM_MAX_ORDER - 1;
+      while(((pfn + mm_base_pfn) & ((1 << order) - 1)) || pfn + (1 << order) > end)
+        order--;
+      free_list_add(pfn, order);
+      mm_free_pages += 1 << order;
+      pfn += 1 << order;
+    }
+  }
+  mm_usable_pages = mm_free_pages;
+  mm_min_free_pages = mm_free_pages;
+
+  /* same again for the DMA zone, one bit per page */
+  spin_lock_init(&dma_lock);
+  memset(dma_zone_map, 0, sizeof(dma_zone_map));
+  for(i = 0; i < count; i++)
+  {
+    if(entries[i].type == E820_USABLE && e820_range(&entries[i], DMA_ZONE_PFN, &start, &end))
+      for(pfn = start - DMA_ZONE_PFN; pfn < end - DMA_ZONE_PFN && pfn < DMA_ZONE_PAGES; pfn++)
+        dma_zone_map[pfn / 32] |= 1 << (pfn % 32);
+  }
+  for(i = 0; i < count; i++)
+  {
+    if(entries[i].type != E820_USABLE && e820_range(&entries[i], DMA_ZONE_PFN, &start, &end))
+      for(pfn = start - DMA_ZONE_PFN; pfn < end - DMA_ZONE_PFN && pfn < DMA_ZONE_PAGES; pfn++)
+        dma_zone_map[pfn / 32] &= ~(1 << (pfn % 32));
+  }
+
+  zero_pool = NULL;
+  zero_pool_count = 0;
+  spin_lock_init(&zero_pool_lock);
+  wait_queue_init(&zero_pool_wait);
+
+  spin_lock_init(&mm_stats_lock);
+  heap_requested = 0;
+  heap_granted = 0;
+  heap_live = 0;
+  heap_peak = 0;
+  alloc_sites = NULL;
+}
+
+/*
+ * Finds the smallest free block that holds 2^order pages ending at or below
+ * page frame limit, and splits it down to order, putting the upper halves
+ * back on the free lists. Returns the first page or NULL. With no limit
+ * this is the head of the first non-empty list
+ */
+static void * alloc_pages_below(unsigned int order, unsigned int limit)
+{
+  struct free_block * block;
+  unsigned int current, pfn;
+  unsigned int flags = spin_lock_irqsave(&zone_lock);
+
+  for(current = order; current < MM_MAX_ORDER; current++)
+  {
+    for(block = free_area[current]; block != NULL; block = block->next)
+    {
+      if(((unsigned int)block >> PAGE_SHIFT) + (1 << order) > limit)
+        continue;
+
+      pfn = addr_to_pfn(block);
+      free_list_del(pfn, current);
+      while(current > order)
+      {
+        current--;
+        free_list_add(pfn + (1 << current), current);
+      }
+      page_info[pfn] = order;
+      mm_free_pages -= 1 << order;
+      if(mm_free_pages < mm_min_free_pages)
+        mm_min_free_pages = mm_free_pages;
+      spin_unlock_irqrestore(&zone_lock, flags);
+      return block;
+    }
+  }
+  spin_unlock_irqrestore(&zone_lock, flags);
+  return NULL;
+}
+
+/*
+ * allocates 2^order physically contiguous pages, aligned to their size,
+ * and returns a pointer to the first one, or NULL
+ */
+void * kalloc_pages(unsigned int order)
+{
+  void * block;
+
+  if(order >= MM_MAX_ORDER)
+    return NULL;
+
+  block = alloc_pages_below(order, 0xFFFFFFFF);
+
+  /* out of free blocks, but the zeroed pool can still spare single pages */
+  if(block == NULL && order == 0)
+    block = zero_pool_get();
+  return block;
+}
+
+/*
+ * returns a block from kalloc_pages (or kalloc_page) to the free lists,
+ * merging it with its buddy while the buddy is free too
+ */
+void kfree_pages(void * addr)
+{
+  unsigned int pfn, order, flags;
+
+  if(addr == NULL)
+    return;
+
+  if(!mm_owns(addr))
+  {
+    print_string("kfree_pages: address not from the page allocator\n");
+    return;
+  }
+
+  flags = spin_lock_irqsave(&zone_lock);
+  pfn = addr_to_pfn(addr);
+  if(page_info[pfn] & PAGE_RESERVED)
+  {
+    spin_unlock_irqrestore(&zone_lock, flags);
+    print_string("kfree_pages: address not from the page allocator\n");
+    return;
+  }
+  if(page_info[pfn] & PAGE_FREE)
+  {
+    spin_unlock_irqrestore(&zone_lock, flags);
+    print_string("kfree_pages: double free\n");
+    return;
+  }
+  order = page_info[pfn] & PAGE_ORDER;
+  if(page_info[pfn] & PAGE_SLAB)
+    memset(&page_info[pfn], 0, 1 << order);
+  mm_free_pages += 1 << order;
+  profile_free(page_tag[pfn], PAGE_SIZE << order);
+  page_tag[pfn] = 0;
+
+  while(order < MM_MAX_ORDER - 1)
+  {
+    unsigned int buddy = ((pfn + mm_base_pfn) ^ (1 << order)) - mm_base_pfn;
+    if(buddy >= mm_total_pages || page_info[buddy] != (PAGE_FREE | order))
+      break;
+    free_list_del(buddy, order);
+    page_info[buddy] = 0;
+    page_info[pfn] = 0;
+    if(buddy < pfn)
+      pfn = buddy;
+    order++;
+  }
+
+  free_list_add(pfn, order);
+  spin_unlock_irqrestore(&zone_lock, flags);
+}
 
 /*
  * allocates an entire page (4096 bytes) in kernel memory space and returns
@@ -10,61 +544,628 @@ void * lim = (void*)0x3FFFFFF;			/* the end address of the malloc space */
  */
 void * kalloc_page(void)
 {
-  void * loc = mem;
-  mem = mem + 4096;
-  if((unsigned int)mem <= (unsigned int)lim)
-    return loc;
+  void * page = kalloc_pages(0);
+  if(page != NULL)
+    page_tag[addr_to_pfn(page)] = profile_alloc(__builtin_return_address(0), PAGE_SIZE);
+  return page;
+}
+
+/*
+ * frees a page returned by kalloc_page
+ */
+void kfree_page(void * page)
+{
+  kfree_pages(page);
+}
+
+/*
+ * Takes another reference to a page, for mapping it into one more
+ * address space (copy on write fork, see paging.c). A page starts with
+ * the one reference its allocation gave it. Returns -1 if it already has
+ * as many as can be counted. Pages the allocator doesn't own are never
+ * freed through here, so they need no count
+ */
+int page_ref_get(void * page)
+{
+  unsigned char * refs;
+  unsigned char old;
+
+  if(!mm_owns(page))
+    return 0;
+  refs = &page_refs[addr_to_pfn(page)];
+  do
+  {
+    old = *refs;
+    if(old == 0xFF)
+      return -1;
+  } while(__sync_val_compare_and_swap(refs, old, old + 1) != old);
+  return 0;
+}
+
+/*
+ * Drops a reference taken by page_ref_get, or the allocation's own.
+ * Returns 1 if that was the last, for the caller to free the page
+ */
+int page_ref_put(void * page)
+{
+  unsigned char * refs;
+  unsigned char old;
+
+  if(!mm_owns(page))
+    return 0;
+  refs = &page_refs[addr_to_pfn(page)];
+  do
+  {
+    old = *refs;
+    if(old == 0)
+      return 1;
+  } while(__sync_val_compare_and_swap(refs, old, old - 1) != old);
+  return 0;
+}
+
+/*
+ * Returns how many references a page has (2 for pages the allocator
+ * doesn't own, they are always treated as shared)
+ */
+unsigned int page_ref_count(void * page)
+{
+  if(!mm_owns(page))
+    return 2;
+  return page_refs[addr_to_pfn(page)] + 1;
+}
+
+/*
+ * allocates a page that is already zeroed, from the pool if it has one or
+ * by zeroing a fresh page otherwise. Returns NULL if out of memory
+ */
+void * kalloc_zeroed_page(void)
+{
+  void * page = zero_pool_get();
+  if(page == NULL)
+  {
+    page = kalloc_pages(0);
+    if(page == NULL)
+      return NULL;
+    zero_dwords(page, PAGE_SIZE / 4);
+  }
+  page_tag[addr_to_pfn(page)] = profile_alloc(__builtin_return_address(0), PAGE_SIZE);
+  return page;
+}
+
+/*
+ * Kernel thread that keeps the zeroed page pool topped up. Once the pool
+ * drops below ZERO_POOL_LOW it is refilled to ZERO_POOL_MAX (unless memory
+ * is getting short), otherwise the thread blocks until zero_pool_get
+ * takes it below ZERO_POOL_LOW again
+ */
+void page_zero_task(void)
+{
+  struct zero_page * page;
+  unsigned int flags;
+
+  for(;;)
+  {
+    if(zero_pool_count < ZERO_POOL_LOW)
+    {
+      while(zero_pool_count < ZERO_POOL_MAX && mm_free_pages > ZERO_POOL_RESERVE)
+      {
+        page = kalloc_pages(0);
+        if(page == NULL)
+          break;
+        zero_dwords(page, PAGE_SIZE / 4);
+
+        flags = spin_lock_irqsave(&zero_pool_lock);
+        page->next = zero_pool;
+        zero_pool = page;
+        zero_pool_count++;
+        spin_unlock_irqrestore(&zero_pool_lock, flags);
+      }
+    }
+
+    wait_event(&zero_pool_wait, zero_pool_count < ZERO_POOL_LOW && mm_free_pages > ZERO_POOL_RESERVE);
+  }
+}
+
+/*
+ * Returns the order of the smallest block of pages that holds size bytes
+ */
+static unsigned int size_to_order(size_t size)
+{
+  unsigned int order = 0;
+  while(((unsigned int)PAGE_SIZE << order) < size)
+    order++;
+  return order;
+}
+
+/*
+ * First fit search of the DMA zone for 'size' bytes meeting the dma_alloc
+ * constraints. Returns NULL if there is no such run of free pages
+ */
+static void * dma_zone_alloc(size_t size, unsigned int align, unsigned int max_addr, unsigned int boundary)
+{
+  unsigned int pages = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+  unsigned int first, addr, i, flags;
+
+  addr = (DMA_ZONE_START + align - 1) & ~(align - 1);
+  if(addr < DMA_ZONE_START)
+    return NULL;
+
+  flags = spin_lock_irqsave(&dma_lock);
+  for(first = (addr - DMA_ZONE_START) >> PAGE_SHIFT; first + pages <= DMA_ZONE_PAGES; first += align >> PAGE_SHIFT)
+  {
+    addr = DMA_ZONE_START + (first << PAGE_SHIFT);
+    if(max_addr != 0 && addr + (pages << PAGE_SHIFT) > max_addr)
+      break;
+    if(boundary != 0 && (addr & ~(boundary - 1)) != ((addr + size - 1) & ~(boundary - 1)))
+      continue;
+
+    for(i = first; i < first + pages; i++)
+      if(!(dma_zone_map[i / 32] & (1 << (i % 32))))
+        break;
+    if(i < first + pages)
+      continue;
+
+    for(i = first; i < first + pages; i++)
+      dma_zone_map[i / 32] &= ~(1 << (i % 32));
+    spin_unlock_irqrestore(&dma_lock, flags);
+    return (void *)addr;
+  }
+  spin_unlock_irqrestore(&dma_lock, flags);
+  return NULL;
+}
+
+/*
+ * Allocates 'size' bytes of zeroed, physically contiguous memory for a
+ * device to DMA to or from. The buffer starts on an 'align' byte boundary
+ * (at least a page), ends at or below max_addr (0 for anywhere) and does
+ * not cross a multiple of 'boundary' (0 for none), eg. ISA_DMA_LIMIT and
+ * ISA_DMA_BOUNDARY for the floppy. align and boundary must be powers of
+ * two. Returns NULL if the constraints can't be met. Release the buffer
+ * with dma_free
+ */
+void * dma_alloc(size_t size, unsigned int align, unsigned int max_addr, unsigned int boundary)
+{
+  void * loc = NULL;
+  unsigned int order;
+
+  if(size == 0 || (boundary != 0 && size > boundary))
+    return NULL;
+  if(align < PAGE_SIZE)
+    align = PAGE_SIZE;
+
+  /*
+   * a naturally aligned block at least as big as the buffer rounded up to
+   * a power of two is aligned enough and can't straddle a boundary that
+   * the buffer fits in
+   */
+  order = size_to_order(size > align ? size : align);
+  if(order < MM_MAX_ORDER && (max_addr == 0 || max_addr > MM_START))
+    loc = alloc_pages_below(order, max_addr == 0 ? 0xFFFFFFFF : max_addr >> PAGE_SHIFT);
+  if(loc == NULL)
+    loc = dma_zone_alloc(size, align, max_addr, boundary);
+
+  if(loc != NULL)
+    zero_dwords(loc, ((size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)) >> 2);
+  return loc;
+}
+
+/*
+ * Releases a buffer from dma_alloc, size must be the size it was allocated
+ * with
+ */
+void dma_free(void * addr, size_t size)
+{
+  unsigned int first, i, flags;
+
+  if(addr == NULL)
+    return;
+  if((unsigned int)addr < DMA_ZONE_START || (unsigned int)addr >= MM_START)
+  {
+    kfree_pages(addr);
+    return;
+  }
+
+  first = ((unsigned int)addr - DMA_ZONE_START) >> PAGE_SHIFT;
+  flags = spin_lock_irqsave(&dma_lock);
+  for(i = first; i < first + ((size + PAGE_SIZE - 1) >> PAGE_SHIFT); i++)
+    dma_zone_map[i / 32] |= 1 << (i % 32);
+  spin_unlock_irqrestore(&dma_lock, flags);
+}
+
+/*
+ * Tags every page of a block handed to the slab allocator so that kfree
+ * can tell slab objects from page blocks and find the slab they live in
+ */
+void mm_set_slab(void * block, unsigned int order)
+{
+  memset(&page_info[addr_to_pfn(block)], PAGE_SLAB | order, 1 << order);
+}
+
+/*
+ * Returns the order of the slab containing addr, or -1 if addr is not in a
+ * slab
+ */
+int mm_slab_order(void * addr)
+{
+  unsigned char info;
+  if(!mm_owns(addr))
+    return -1;
+  info = page_info[addr_to_pfn(addr)];
+  if(!(info & PAGE_SLAB))
+    return -1;
+  return info & PAGE_ORDER;
+}
+
+/*
+ * Creates the size class caches behind kmalloc. Must be called after
+ * slab_init
+ */
+void kmalloc_init(void)
+{
+  unsigned int i;
+  for(i = 0; i < KMALLOC_CLASSES; i++)
+    kmalloc_caches[i] = kmem_cache_create(kmalloc_names[i], 1 << (i + KMALLOC_MIN_SHIFT), NULL);
+
+  /* ALLOC_SITES * sizeof(struct alloc_site) fits in a page */
+  alloc_sites = kalloc_zeroed_page();
+}
+
+/*
+ * Adds an allocation to the fragmentation counters
+ */
+static void heap_account(size_t requested, unsigned int granted)
+{
+  unsigned int flags = spin_lock_irqsave(&mm_stats_lock);
+  if(heap_granted >= 0x80000000)
+  {
+    heap_requested >>= 1;
+    heap_granted >>= 1;
+  }
+  heap_requested += requested;
+  heap_granted += granted;
+  heap_live += granted;
+  if(heap_live > heap_peak)
+    heap_peak = heap_live;
+  spin_unlock_irqrestore(&mm_stats_lock, flags);
+}
+
+/*
+ * kmalloc on behalf of caller, which the allocation is charged to
+ */
+static void * kmalloc_caller(size_t size, void * caller)
+{
+  void * loc;
+  unsigned int granted;
+
+  if(size == 0)
+    return NULL;
+
+  if(size <= KMALLOC_MAX_SIZE)
+  {
+    unsigned int index = 0;
+    if(size > (1 << KMALLOC_MIN_SHIFT))
+      index = 32 - __builtin_clz(size - 1) - KMALLOC_MIN_SHIFT;
+    loc = kmem_cache_alloc(kmalloc_caches[index]);
+    granted = 1 << (index + KMALLOC_MIN_SHIFT);
+    if(loc != NULL)
+      *kmem_cache_tag(kmalloc_caches[index], loc) = profile_alloc(caller, granted);
+  }
+  else
+  {
+    unsigned int order = size_to_order(size);
+    loc = kalloc_pages(order);
+    granted = PAGE_SIZE << order;
+    if(loc != NULL)
+      page_tag[addr_to_pfn(loc)] = profile_alloc(caller, granted);
+  }
+
+  if(loc != NULL)
+    heap_account(size, granted);
+  return loc;
+}
+
+/*
+ * allocates 'size' bytes of kernel memory, or returns NULL. Small requests
+ * come from the power of two size class caches (cache line aligned), larger
+ * ones get a page aligned block of pages
+ */
+void * kmalloc(size_t size)
+{
+  return kmalloc_caller(size, __builtin_return_address(0));
+}
+
+/*
+ * Returns the number of bytes actually usable at ptr, which was returned
+ * by kmalloc
+ */
+size_t ksize(void * ptr)
+{
+  struct kmem_cache * cache = virt_to_cache(ptr);
+  if(cache != NULL)
+    return kmem_cache_size(cache);
+  return PAGE_SIZE << (page_info[addr_to_pfn(ptr)] & PAGE_ORDER);
+}
+
+/*
+ * frees memory returned by kmalloc, krealloc, malloc or calloc
+ */
+void kfree(void * ptr)
+{
+  struct kmem_cache * cache;
+  unsigned int flags;
+
+  if(ptr == NULL)
+    return;
+  if(!mm_owns(ptr))
+  {
+    print_string("kfree: pointer not from kmalloc\n");
+    return;
+  }
+
+  flags = spin_lock_irqsave(&mm_stats_lock);
+  heap_live -= ksize(ptr);
+  spin_unlock_irqrestore(&mm_stats_lock, flags);
+
+  /* blocks of pages are charged back to their site by kfree_pages */
+  cache = virt_to_cache(ptr);
+  if(cache != NULL)
+  {
+    profile_free(*kmem_cache_tag(cache, ptr), kmem_cache_size(cache));
+    kmem_cache_free(cache, ptr);
+  }
   else
+    kfree_pages(ptr);
+}
+
+/*
+ * resizes a kmalloc allocation, moving it only if it has outgrown its size
+ * class. Returns NULL (leaving ptr untouched) if there is not enough memory
+ */
+void * krealloc(void * ptr, size_t size)
+{
+  void * loc;
+  size_t old_size;
+
+  if(ptr == NULL)
+    return kmalloc_caller(size, __builtin_return_address(0));
+  if(size == 0)
+  {
+    kfree(ptr);
+    return NULL;
+  }
+
+  old_size = ksize(ptr);
+  if(size <= old_size)
+    return ptr;
+
+  loc = kmalloc_caller(size, __builtin_return_address(0));
+  if(loc == NULL)
     return NULL;
+  memcpy(loc, ptr, old_size);
+  kfree(ptr);
+  return loc;
 }
 
 /*
  * allocates 'size' bytes of memory if there is enough available, or
- * returns NULL
+ * returns NULL. Release it with kfree
  */
 void * malloc(size_t size)
 {
-  void * loc = mem;
-  mem = mem + size;
-  if((unsigned int)mem <= (unsigned int)lim)
-    return loc;
-  else
-    return NULL;
+  return kmalloc_caller(size, __builtin_return_address(0));
 }
 
 /*
  * allocates 'size' bytes of memory if there is enough available, or
- * returns NULL. Also the memory is zero'd out.
+ * returns NULL. Also the memory is zero'd out: single page requests come
+ * straight from the zeroed pool, everything else is cleared with rep stosd
  */
 void * calloc(size_t size)
 {
-  char * loc = malloc(size);	
-  if(loc != NULL)
+  void * loc;
+
+  if(size > KMALLOC_MAX_SIZE && size <= PAGE_SIZE)
   {
-    unsigned int i;
-    for(i = 0; i < size; i++)
-      loc[i] = 0;
+    loc = zero_pool_get();
+    if(loc != NULL)
+    {
+      page_tag[addr_to_pfn(loc)] = profile_alloc(__builtin_return_address(0), PAGE_SIZE);
+      heap_account(size, PAGE_SIZE);
+      return loc;
+    }
   }
+
+  loc = kmalloc_caller(size, __builtin_return_address(0));
+  if(loc != NULL)
+    zero_dwords(loc, (size + 3) >> 2);
   return loc;
 }
 
 /*
- * Displays the amount of free memory in bytes
+ * Fills in the free memory and fragmentation figures for the heap.
+ * Fragmentation is reported in percent:
+ * - internal: bytes lost to rounding requests up to a size class / pages
+ * - external: free memory that is not in maximum order (4MB) blocks, ie
+ *   how much of it has been broken up by smaller allocations
+ * - slab: space inside slabs that is not holding a live object
+ */
+void mm_get_stats(struct mm_stats * stats)
+{
+  unsigned int flags = spin_lock_irqsave(&zone_lock);
+  unsigned int free_pages, max_order_pages;
+  int order;
+
+  free_pages = mm_free_pages;
+  max_order_pages = free_count[MM_MAX_ORDER - 1] << (MM_MAX_ORDER - 1);
+  stats->largest_free = 0;
+  for(order = MM_MAX_ORDER - 1; order >= 0; order--)
+  {
+    if(free_area[order] != NULL)
+    {
+      stats->largest_free = PAGE_SIZE << order;
+      break;
+    }
+  }
+  spin_unlock_irqrestore(&zone_lock, flags);
+
+  stats->free_bytes = free_pages * PAGE_SIZE;
+  kmem_cache_usage(&stats->slab_bytes, &stats->slab_used);
+
+  flags = spin_lock_irqsave(&mm_stats_lock);
+  stats->heap_live = heap_live;
+  stats->internal_frag = 0;
+  if(heap_granted >= 100)
+    stats->internal_frag = (heap_granted - heap_requested) / (heap_granted / 100);
+  spin_unlock_irqrestore(&mm_stats_lock, flags);
+
+  stats->external_frag = 0;
+  if(free_pages >= 100)
+    stats->external_frag = (free_pages - max_order_pages) / (free_pages / 100);
+  stats->slab_frag = 0;
+  if(stats->slab_bytes >= 100)
+    stats->slab_frag = (stats->slab_bytes - stats->slab_used) / (stats->slab_bytes / 100);
+}
+
+/*
+ * Displays the amount of free memory in bytes, and how it is spread over
+ * the buddy free lists
  */
 void display_free_bytes(void)
 {
   char buffer[40] = {0};
-  int free = lim - mem;
+  struct mm_stats stats;
+  unsigned int i;
   print_string("Free memory: ");
-  itoa(free, buffer, 10);
-  print_string(buffer);
+  print_string(utoa(mm_get_free(), buffer, 10));
+  print_string(" of ");
+  print_string(utoa(mm_get_total(), buffer, 10));
   print_string(" bytes.\n");
+
+  print_string("Free blocks per order:");
+  for(i = 0; i < MM_MAX_ORDER; i++)
+  {
+    print_string(" ");
+    print_string(utoa(free_count[i], buffer, 10));
+  }
+  print_string("\n");
+
+  mm_get_stats(&stats);
+  print_string("Heap in use: ");
+  print_string(utoa(stats.heap_live, buffer, 10));
+  print_string(" bytes, largest free block: ");
+  print_string(utoa(stats.largest_free, buffer, 10));
+  print_string(" bytes, zeroed pages: ");
+  print_string(utoa(zero_pool_count, buffer, 10));
+  print_string(".\n");
+  print_string("Fragmentation - internal: ");
+  print_string(utoa(stats.internal_frag, buffer, 10));
+  print_string("% external: ");
+  print_string(utoa(stats.external_frag, buffer, 10));
+  print_string("% slab: ");
+  print_string(utoa(stats.slab_frag, buffer, 10));
+  print_string("%\n");
+}
+
+/*
+ * Works out the allocation rate of every site over the last second. Called
+ * once a second by the timer
+ */
+void mm_profile_tick(void)
+{
+  unsigned int i, flags;
+
+  if(alloc_sites == NULL)
+    return;
+  flags = spin_lock_irqsave(&mm_stats_lock);
+  for(i = 1; i < ALLOC_SITES; i++)
+  {
+    alloc_sites[i].rate = alloc_sites[i].allocs - alloc_sites[i].last_allocs;
+    alloc_sites[i].last_allocs = alloc_sites[i].allocs;
+  }
+  spin_unlock_irqrestore(&mm_stats_lock, flags);
+}
+
+/*
+ * Prints the peak memory use and the allocation sites holding the most
+ * memory. Sites are shown by the return address of the allocating call,
+ * look them up in the kernel's symbol table (nm)
+ */
+void display_memstat(void)
+{
+  char temp[33] = {0};
+  unsigned char shown[ALLOC_SITES] = {0};
+  unsigned int i, n, best, rate = 0;
+  struct alloc_site * site;
+
+  if(alloc_sites == NULL)
+    return;
+
+  for(i = 1; i < ALLOC_SITES; i++)
+    rate += alloc_sites[i].rate;
+
+  print_string("Heap in use: ");
+  print_string(utoa(heap_live, temp, 10));
+  print_string(" bytes, peak ");
+  print_string(utoa(heap_peak, temp, 10));
+  print_string(". Pages in use peak: ");
+  print_string(utoa((mm_usable_pages - mm_min_free_pages) * PAGE_SIZE, temp, 10));
+  print_string(" bytes. ");
+  print_string(utoa(rate, temp, 10));
+  print_string(" allocs/s\n");
+
+  print_string("caller");
+  print_string_atx("allocs", 14);
+  print_string_atx("frees", 26);
+  print_string_atx("live", 38);
+  print_string_atx("peak", 50);
+  print_string_atx("allocs/s", 62);
+  print_string("\n");
+
+  for(n = 0; n < MEMSTAT_TOP; n++)
+  {
+    best = 0;
+    for(i = 1; i < ALLOC_SITES; i++)
+      if(!shown[i] && alloc_sites[i].allocs != 0 && (best == 0 || alloc_sites[i].live > alloc_sites[best].live))
+        best = i;
+    if(best == 0)
+      break;
+    shown[best] = 1;
+
+    site = &alloc_sites[best];
+    if(best == ALLOC_SITE_OTHER)
+      print_string("other");
+    else
+      print_address((unsigned int)site->caller);
+    print_string_atx(utoa(site->allocs, temp, 10), 14);
+    print_string_atx(utoa(site->frees, temp, 10), 26);
+    print_string_atx(utoa(site->live, temp, 10), 38);
+    print_string_atx(utoa(site->peak, temp, 10), 50);
+    print_string_atx(utoa(site->rate, temp, 10), 62);
+    print_string("\n");
+  }
 }
 
 /*
  * Returns the number of free bytes left in the system
  */
-int mm_get_free(void)
+unsigned int mm_get_free(void)
+{
+  return mm_free_pages * PAGE_SIZE;
+}
+
+/*
+ * Returns the number of bytes the page allocator was given to manage
+ */
+unsigned int mm_get_total(void)
+{
+  return mm_usable_pages * PAGE_SIZE;
+}
+
+/*
+ * Returns the address just past the highest page the allocator manages,
+ * so everything it hands out is below it
+ */
+unsigned int mm_get_top(void)
 {
-  return lim - mem;
+  return (mm_base_pfn + mm_total_pages) << PAGE_SHIFT;
 }
@@ -1,27 +1,386 @@
+#include "common.h"
+#include "screen.h"
+#include "task.h"
+#include "timer.h"
+#include "smp.h"
+#include "mutex.h"
+
+/*
+ * Spinlocks
+ *
+ * Ticket locks: spin_lock takes the next ticket with one lock xadd and
+ * waits, reading only, for owner to come round to it, and spin_unlock
+ * moves owner on. Waiters are served in order, so no cpu can be starved
+ * by the others getting the line first, and only the release writes the
+ * word they all spin on.
+ *
+ * The plain versions leave interrupts alone, for callers that already
+ * have them off or data no interrupt handler touches. Anything also taken
+ * from an interrupt handler must use spin_lock_irqsave, or the handler
+ * can spin forever on a lock the code it interrupted holds. The flags it
+ * returns put the interrupt flag back the way it was, so these nest.
+ * Locks aren't recursive: taking one already held by the same cpu
+ * deadlocks.
+ *
+ * For data that is read far more often than it changes there are also
+ * reader-writer locks, which let readers in together but still have each
+ * of them write the lock word, and seqlocks, whose readers write nothing
+ * at all (see mutex.h). lock_bench compares the three.
+ */
+
+#define LOCK_BENCH_OPS          100000  /* per thread */
+#define LOCK_BENCH_WRITE_EVERY  100     /* one operation in this many is a write */
+
+enum {
+  LOCK_BENCH_SPINLOCK,
+  LOCK_BENCH_RWLOCK,
+  LOCK_BENCH_SEQLOCK,
+  LOCK_BENCH_KINDS
+};
+
+char * lock_bench_names[LOCK_BENCH_KINDS] = {"spinlock", "rwlock", "seqlock"};
+unsigned int lock_bench_kind;
+unsigned int lock_bench_threads;
+volatile unsigned int lock_bench_ready;       /* threads at the start line */
+volatile unsigned int lock_bench_go;
+unsigned long long lock_bench_cycles[MAX_CPUS];
+unsigned int lock_bench_torn;                 /* reads that saw half a write, should stay 0 */
+spinlock_t lock_bench_spin;
+rwlock_t lock_bench_rw;
+seqlock_t lock_bench_seq;
+unsigned int lock_bench_data[2];              /* both halves always written the same */
+
+void spin_lock_init(spinlock_t * lock)
+{
+  lock->value = 0;
+}
+
+void spin_lock(spinlock_t * lock)
+{
+  unsigned short ticket = __sync_fetch_and_add(&lock->ticket.next, 1);
+
+  while(lock->ticket.owner != ticket)
+    __asm__ __volatile__ ("pause" : : : "memory");
+  /* if it was ours first time round there was no pause, and nothing kept
+     the compiler from hoisting the critical section above the load */
+  __asm__ __volatile__ ("" : : : "memory");
+}
+
 /*
- * This defines OS level mutexes: ie: they should be global to
- * the entire kernel. As of now (dec 3, 2013), the only code using this lock is the
- * network buffers
- * 
- * todo: actually implement more than one lock lol
+ * Takes the lock if nobody holds or waits for it. Returns non-zero if it
+ * did
  */
-#define LOCKED 1
-#define UNLOCKED 0
+int spin_trylock(spinlock_t * lock)
+{
+  unsigned int old = lock->value;
+
+  if((old & 0xFFFF) != old >> 16)
+    return 0;
+  return __sync_bool_compare_and_swap(&lock->value, old, old + 0x10000);
+}
+
+void spin_unlock(spinlock_t * lock)
+{
+  /* only the holder writes owner, so no locked op is needed, just keep
+     the compiler from moving the critical section past it */
+  __asm__ __volatile__ ("" : : : "memory");
+  lock->ticket.owner = lock->ticket.owner + 1;
+}
 
-volatile int status = UNLOCKED;
+int spin_is_locked(spinlock_t * lock)
+{
+  unsigned int value = lock->value;
+  return (value & 0xFFFF) != value >> 16;
+}
 
-void spinlock() {
-  while (status == LOCKED) {}
+/*
+ * Turns interrupts off and takes the lock. Returns the flags to give
+ * spin_unlock_irqrestore
+ */
+unsigned int spin_lock_irqsave(spinlock_t * lock)
+{
+  unsigned int flags = irq_save();
+  spin_lock(lock);
+  return flags;
+}
+
+void spin_unlock_irqrestore(spinlock_t * lock, unsigned int flags)
+{
+  spin_unlock(lock);
+  irq_restore(flags);
+}
+
+void rwlock_init(rwlock_t * lock)
+{
+  lock->value = 0;
+}
+
+void read_lock(rwlock_t * lock)
+{
+  for(;;)
+  {
+    while(lock->value & RW_WRITER)
+      __asm__ __volatile__ ("pause" : : : "memory");
+    if(!(__sync_add_and_fetch(&lock->value, 1) & RW_WRITER))
+      return;
+    /* a writer got in first, let it have the lock */
+    __sync_sub_and_fetch(&lock->value, 1);
+  }
+}
+
+void read_unlock(rwlock_t * lock)
+{
+  __sync_sub_and_fetch(&lock->value, 1);
+}
+
+/*
+ * Claims the lock against other writers and new readers, then waits for
+ * the readers already in to leave
+ */
+void write_lock(rwlock_t * lock)
+{
+  unsigned int old;
+
+  for(;;)
+  {
+    old = lock->value;
+    if(!(old & RW_WRITER) && __sync_bool_compare_and_swap(&lock->value, old, old | RW_WRITER))
+      break;
+    __asm__ __volatile__ ("pause" : : : "memory");
+  }
+  while(lock->value != RW_WRITER)
+    __asm__ __volatile__ ("pause" : : : "memory");
+}
+
+void write_unlock(rwlock_t * lock)
+{
+  /* readers that are backing out may still be adding and subtracting */
+  __sync_and_and_fetch(&lock->value, ~RW_WRITER);
+}
+
+unsigned int read_lock_irqsave(rwlock_t * lock)
+{
+  unsigned int flags = irq_save();
+  read_lock(lock);
+  return flags;
+}
+
+void read_unlock_irqrestore(rwlock_t * lock, unsigned int flags)
+{
+  read_unlock(lock);
+  irq_restore(flags);
+}
 
-  asm volatile("cli"); /* Disable interrupts */
-  if (status == UNLOCKED)
-    status = LOCKED;
-  asm volatile("sti"); /* Enable interrupts */
+unsigned int write_lock_irqsave(rwlock_t * lock)
+{
+  unsigned int flags = irq_save();
+  write_lock(lock);
+  return flags;
 }
 
-void spinunlock() {
+void write_unlock_irqrestore(rwlock_t * lock, unsigned int flags)
+{
+  write_unlock(lock);
+  irq_restore(flags);
+}
+
+void seqlock_init(seqlock_t * lock)
+{
+  lock->sequence = 0;
+  spin_lock_init(&lock->lock);
+}
+
+/*
+ * Starts a write, readers that overlap it will retry. x86 keeps stores in
+ * order, so only the compiler has to be kept from moving the data writes
+ * outside the two sequence increments
+ */
+void write_seqlock(seqlock_t * lock)
+{
+  spin_lock(&lock->lock);
+  lock->sequence = lock->sequence + 1;
+  __asm__ __volatile__ ("" : : : "memory");
+}
+
+void write_sequnlock(seqlock_t * lock)
+{
+  __asm__ __volatile__ ("" : : : "memory");
+  lock->sequence = lock->sequence + 1;
+  spin_unlock(&lock->lock);
+}
+
+/*
+ * Writers that can be interrupted by a reader on the same cpu must use
+ * these, the reader would wait for them forever
+ */
+unsigned int write_seqlock_irqsave(seqlock_t * lock)
+{
+  unsigned int flags = irq_save();
+  write_seqlock(lock);
+  return flags;
+}
+
+void write_sequnlock_irqrestore(seqlock_t * lock, unsigned int flags)
+{
+  write_sequnlock(lock);
+  irq_restore(flags);
+}
+
+/*
+ * One read of the benchmark data under the lock being measured
+ */
+static void lock_bench_read(void)
+{
+  unsigned int a, b, sequence;
+
+  switch(lock_bench_kind)
+  {
+  case LOCK_BENCH_SPINLOCK:
+    spin_lock(&lock_bench_spin);
+    a = lock_bench_data[0];
+    b = lock_bench_data[1];
+    spin_unlock(&lock_bench_spin);
+    break;
+  case LOCK_BENCH_RWLOCK:
+    read_lock(&lock_bench_rw);
+    a = lock_bench_data[0];
+    b = lock_bench_data[1];
+    read_unlock(&lock_bench_rw);
+    break;
+  default:
+    do
+    {
+      sequence = read_seqbegin(&lock_bench_seq);
+      a = lock_bench_data[0];
+      b = lock_bench_data[1];
+    } while(read_seqretry(&lock_bench_seq, sequence));
+    break;
+  }
+  if(a != b)
+    __sync_fetch_and_add(&lock_bench_torn, 1);
+}
+
+static void lock_bench_write(unsigned int value)
+{
+  switch(lock_bench_kind)
+  {
+  case LOCK_BENCH_SPINLOCK:
+    spin_lock(&lock_bench_spin);
+    lock_bench_data[0] = lock_bench_data[1] = value;
+    spin_unlock(&lock_bench_spin);
+    break;
+  case LOCK_BENCH_RWLOCK:
+    write_lock(&lock_bench_rw);
+    lock_bench_data[0] = lock_bench_data[1] = value;
+    write_unlock(&lock_bench_rw);
+    break;
+  default:
+    write_seqlock(&lock_bench_seq);
+    lock_bench_data[0] = value;
+    __asm__ __volatile__ ("" : : : "memory");
+    lock_bench_data[1] = value;
+    write_sequnlock(&lock_bench_seq);
+    break;
+  }
+}
+
+/*
+ * One of the benchmark threads: waits until they are all ready, then
+ * reads and occasionally writes the shared data
+ */
+static void lock_bench_task(void)
+{
+  unsigned int index = __sync_fetch_and_add(&lock_bench_ready, 1);
+  unsigned long long start;
+  unsigned int i;
+
+  while(!lock_bench_go)
+    __asm__ __volatile__ ("pause" : : : "memory");
+
+  start = rdtsc();
+  for(i = 0; i < LOCK_BENCH_OPS; i++)
+  {
+    /* the threads take turns at writing */
+    if((i + index) % LOCK_BENCH_WRITE_EVERY == 0)
+      lock_bench_write(i);
+    else
+      lock_bench_read();
+  }
+  lock_bench_cycles[index] = rdtsc() - start;
+}
+
+/*
+ * Times read-mostly access to a two word value under a spinlock, a
+ * reader-writer lock and a seqlock, with a thread per cpu hammering it
+ * (the idle cpus steal them). Prints the average cost of an operation
+ * for each
+ */
+void lock_bench(void)
+{
+  unsigned int ids[MAX_CPUS];
+  unsigned long long total;
+  unsigned int i, threads, ops;
+  char temp[33] = {0};
+
+  lock_bench_threads = smp_cpu_count();
+  if(lock_bench_threads == 0)
+    lock_bench_threads = 1;
+  if(lock_bench_threads > MAX_CPUS)
+    lock_bench_threads = MAX_CPUS;
+  ops = lock_bench_threads * LOCK_BENCH_OPS;
+
+  spin_lock_init(&lock_bench_spin);
+  rwlock_init(&lock_bench_rw);
+  seqlock_init(&lock_bench_seq);
+
+  print_string(utoa(lock_bench_threads, temp, 10));
+  print_string(" threads, ");
+  print_string(utoa(LOCK_BENCH_OPS, temp, 10));
+  print_string(" operations each, 1 in ");
+  print_string(utoa(LOCK_BENCH_WRITE_EVERY, temp, 10));
+  print_string(" a write\n");
+
+  for(lock_bench_kind = 0; lock_bench_kind < LOCK_BENCH_KINDS; lock_bench_kind++)
+  {
+    lock_bench_ready = 0;
+    lock_bench_go = 0;
+    lock_bench_torn = 0;
+    lock_bench_data[0] = lock_bench_data[1] = 0;
+    for(threads = 0; threads < lock_bench_threads; threads++)
+      if((ids[threads] = create_task(lock_bench_task)) == 0)
+        break;
+
+    /* start them together so they really contend */
+    while(lock_bench_ready < threads)
+      sleep(1);
+    lock_bench_go = 1;
+
+    total = 0;
+    for(i = 0; i < threads; i++)
+    {
+      thread_join(ids[i]);
+      total += lock_bench_cycles[i];
+    }
+
+    if(threads < lock_bench_threads)
+    {
+      print_string("lockbench: can't create the threads\n");
+      return;
+    }
 
-  asm volatile("cli"); /* Disable interrupts */
-  status = UNLOCKED;
-  asm volatile("sti"); /* Enable interrupts */
+    print_string(lock_bench_names[lock_bench_kind]);
+    print_string_atx(utoa((unsigned int)udiv64(total, ops), temp, 10), 16);
+    print_string(" cycles");
+    if(clock_tsc_khz() != 0)
+    {
+      print_string_atx(utoa((unsigned int)udiv64(cycles_to_ns(total), ops), temp, 10), 32);
+      print_string(" ns");
+    }
+    if(lock_bench_torn != 0)
+    {
+      print_string_atx(utoa(lock_bench_torn, temp, 10), 44);
+      print_string(" torn reads!");
+    }
+    print_string("\n");
+  }
 }
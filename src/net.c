@@ -1,11 +1,37 @@
 #include "screen.h"
+#include "slab.h"
+#include "arena.h"
+#include "net.h"
 #include "net/ip.h"
 #include "net/in.h"
+#include "net/udp.h"
+#include "net/dhcp.h"
+#include "mutex.h"
 
-extern unsigned char * ipv4_address;
+extern struct kmem_cache * ipv4_addr_cache;
+
+struct arena * net_tx_arena;   /* headers + payload of each layer of the packet being sent */
+spinlock_t net_tx_lock;        /* net_tx_arena, held from the top layer of a send to the bottom */
+
+/*
+ * Creates the caches the network stack allocates from and initializes
+ * each protocol layer
+ */
+void net_init(void)
+{
+  net_tx_arena = arena_create(NET_TX_LAYERS * NET_BUFFER_SIZE);
+  spin_lock_init(&net_tx_lock);
+  ipv4_addr_cache = kmem_cache_create("ipv4_addr", 4, NULL);
+  ipv4_init();
+  udp_init();
+  dhcp_init();
+}
 
 void ip(void)
 {
+	unsigned char address[4];
+
+	ipv4_get_address(address);
 	print_string("IP Address: ");
-	print_ip(ipv4_address);
+	print_ip(address);
 }
@@ -3,10 +3,16 @@
 #include "net/udp.h"
 #include "net/in.h"
 #include "net/ip.h"
+#include "net/dhcp.h"
 #include "dev/rtl8139.h"
-#include "mm.h"
+#include "arena.h"
+#include "fiber.h"
 
-extern unsigned char * ipv4_address;
+#define DHCP_ARENA_SIZE 3072    /* receive buffer + option data of one transaction */
+#define DHCP_RX_SIZE    1024
+#define DHCP_TIMEOUT_MS 10000   /* for each reply, before giving up */
+
+struct arena * dhcp_arena;      /* reset at the start of every transaction */
 
 //doc: http://en.wikipedia.org/wiki/Dynamic_Host_Configuration_Protocol
 //doc: http://www.pcvr.nl/tcpip/bootp.htm
@@ -64,9 +70,31 @@ struct dhcp_packet {
   unsigned char options[60];  //should be 64 but magic takes up first 4 bytes
 };
 
+/*
+ * Creates the arena that each transaction allocates from
+ */
+void dhcp_init(void) {
+  dhcp_arena = arena_create(DHCP_ARENA_SIZE);
+}
+
+static void dhcp_fiber(void * arg) {
+  (void)arg;
+  dhcp_discover();
+}
+
+/*
+ * Runs dhcp_discover in a fiber, so waiting on the server doesn't hold
+ * up the caller. Runs it in place if there is no memory for the fiber
+ */
+void dhcp_start(void) {
+  if (fiber_spawn(dhcp_fiber, NULL) == 0)
+    dhcp_discover();
+}
+
 /*
  * Returns a dhcp option structure from a buffer which points
- * to the start of the option
+ * to the start of the option. The option data is copied into
+ * the transaction's arena
  */
 struct dhcp_option dhcp_get_option(unsigned char * option) {
   struct dhcp_option o;
@@ -74,8 +102,11 @@ struct dhcp_option dhcp_get_option(unsigned char * option) {
   option++;
   o.length = * option;
   option++;
-  o.data = (unsigned char * ) malloc(sizeof(char) * o.length);
-  memcpy(o.data, option, o.length);
+  o.data = (unsigned char * ) arena_alloc(dhcp_arena, o.length);
+  if (o.data == NULL)
+    o.length = 0;
+  else
+    memcpy(o.data, option, o.length);
   return o;
 }
 
@@ -83,8 +114,18 @@ struct dhcp_option dhcp_get_option(unsigned char * option) {
  * Initiates a dhcp discovery request to receive an IP address
  */
 void dhcp_discover(void) {
-  char buffer[1024];
   struct dhcp_packet dhcp;
+  if (dhcp_arena == NULL)
+    return;
+  //another discover still has the port (and the arena), it isn't ours to close
+  if (udp_bind(68) < 0)
+    return;
+  arena_reset(dhcp_arena);
+  char * buffer = arena_alloc(dhcp_arena, DHCP_RX_SIZE);
+  if (buffer == NULL) {
+    print_string("DHCP: out of buffer space\n");
+    goto out;
+  }
   memset( &dhcp, 0, sizeof(dhcp)); //init to all zero
 
   dhcp.opcode = 1;              //BOOTREQUEST
@@ -120,12 +161,15 @@ void dhcp_discover(void) {
   dhcp.options[8] = 0x78; //120
   dhcp.options[9] = 0xff; //end option
 
-  print_string("DHCP DISCOVER (Will wait forever if net is down, or driver broken)\n");
+  print_string("DHCP DISCOVER\n");
 
   ///////part 1: request, should offer afterwards
-  udp_bind(68);
   udp_broadcast((unsigned char * )&dhcp, sizeof(dhcp), 68, 67);
-  int size = udp_listen(68, buffer, 1024);
+  int size = udp_listen_timeout(68, buffer, DHCP_RX_SIZE, DHCP_TIMEOUT_MS);
+  if (size < 0) {
+    print_string("NO DHCP OFFER (net down, or driver broken)\n");
+    goto out;
+  }
 
   //copy that data into the dhcp packet structure
   if (size > (int) sizeof(struct dhcp_packet)) {
@@ -137,7 +181,7 @@ void dhcp_discover(void) {
     print_string(itoa(sizeof(struct dhcp_packet), temp, 10));
     print_string(" GOT: ");
     print_string(itoa(size, temp, 10));
-    return;
+    goto out;
   }
 
   struct dhcp_packet d;
@@ -174,12 +218,16 @@ void dhcp_discover(void) {
 
   ////part 2: request #2, should ack after
   udp_broadcast((unsigned char * ) &dhcp, sizeof(dhcp), 68, 67);
-  size = udp_listen(68, buffer, 1024);
+  size = udp_listen_timeout(68, buffer, DHCP_RX_SIZE, DHCP_TIMEOUT_MS);
+  if (size < 0) {
+    print_string("NO DHCP ACK\n");
+    goto out;
+  }
   
   //copy that data into the dhcp packet structure
   if (size > (int) sizeof(struct dhcp_packet)) {
     print_string("MALFORMED DHCP RESPONSE\n");
-    return;
+    goto out;
   }
   memcpy( &d, buffer, size);
 
@@ -189,9 +237,9 @@ void dhcp_discover(void) {
     print_string("  DHCP MSG: ");
     if (option.length == 1) {
       if (option.data[0] == (unsigned char) DHCP_ACK) {
-        memcpy(ipv4_address, d.yiaddr, 4);
+        ipv4_set_address(d.yiaddr);
         print_string("ACK the IP IS OURS!!!! ");
-        print_ip(ipv4_address);
+        print_ip(d.yiaddr);
       } else {
         print_string("UNKNOWN DHCP MESSAGE TYPE: ");
         char c = option.data[0];
@@ -208,6 +256,10 @@ void dhcp_discover(void) {
       print_string("CORRUPT DHCP MSG - NOT RIGHT LENGTH\n");
   }
 
+out:
+  //free the port for the next dhcp_discover
+  udp_close(68);
+
   /*
   //continue processing options until end
   while(*pointer != 0xFF)
@@ -2,8 +2,13 @@
 #include "common.h"
 #include "net/in.h"
 #include "net/ip.h"
-#include "mm.h"
+#include "arena.h"
+#include "net.h"
 #include "dev/rtl8139.h"
+#include "mutex.h"
+
+extern struct arena * net_tx_arena;
+extern spinlock_t net_tx_lock;
 
 struct ethernet_frame {
   unsigned char destination_mac48_address[6];
@@ -66,14 +71,33 @@ void eth_send_frame(char * data, unsigned short length, unsigned char * destinat
   protocol = protocol;
 }
 
-void eth_broadcast(unsigned char * data, unsigned short length, unsigned short protocol) {
+/*
+ * Broadcasts a frame. Called with net_tx_lock held, by the layers above
+ * that are building their part of the packet in the tx arena too
+ */
+void __eth_broadcast(unsigned char * data, unsigned short length, unsigned short protocol) {
   struct ethernet_frame frame;
+  if (length + sizeof(struct ethernet_frame) > NET_BUFFER_SIZE) {
+    print_string("Ethernet frame too large, dropping packet\n");
+    return;
+  }
   memset( &frame.destination_mac48_address, 0xff, 6);
   rtl8139_get_mac48_address(frame.source_mac48_address);
   frame.ethertype = htons(protocol);
-  unsigned char * buffer = malloc(length + sizeof(struct ethernet_frame));
-  memcpy(buffer, & frame, sizeof(struct ethernet_frame));
-  memcpy(buffer + sizeof(struct ethernet_frame), data, length);
-  
-  rtl8139_send_packet(buffer, length + sizeof(struct ethernet_frame));
+
+  unsigned int mark = arena_mark(net_tx_arena);
+  unsigned char * buffer = arena_alloc(net_tx_arena, length + sizeof(struct ethernet_frame));
+  if (buffer != NULL) {
+    memcpy(buffer, & frame, sizeof(struct ethernet_frame));
+    memcpy(buffer + sizeof(struct ethernet_frame), data, length);
+    rtl8139_send_packet(buffer, length + sizeof(struct ethernet_frame));
+  }
+  arena_release(net_tx_arena, mark);
+}
+
+/* __eth_broadcast, taking net_tx_lock around it */
+void eth_broadcast(unsigned char * data, unsigned short length, unsigned short protocol) {
+  unsigned int flags = spin_lock_irqsave(&net_tx_lock);
+  __eth_broadcast(data, length, protocol);
+  spin_unlock_irqrestore(&net_tx_lock, flags);
 }
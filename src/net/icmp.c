@@ -1,9 +1,10 @@
 #include "net/ip.h"
 #include "net/in.h"
 
-extern unsigned char * ipv4_address;
-
 void icmp_ping(char * destination) {
+    unsigned char address[4];
+
+    ipv4_get_address(address);
     print_string("sending ping from: ");
-    print_ip(ipv4_address);
+    print_ip(address);
 }
\ No newline at end of file
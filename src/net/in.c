@@ -1,6 +1,8 @@
 #include "screen.h" //for printing an ip and mac address
 #include "common.h"
-#include "mm.h"
+#include "slab.h"
+
+struct kmem_cache * ipv4_addr_cache;
 
 /*
  * Converts a string representation of an IPv4 address to binary
@@ -9,7 +11,7 @@
  * (input must be null-terminated)
  */
 unsigned char * string_to_ip(char * string_ip) {
-  unsigned char * ip = (unsigned char * ) malloc(4 * sizeof(char));
+  unsigned char * ip = (unsigned char * ) kmem_cache_alloc(ipv4_addr_cache);
   int place = 100;
   int octet = 0;
   while ( * string_ip) {
@@ -30,6 +32,13 @@ unsigned char * string_to_ip(char * string_ip) {
   return ip;
 }
 
+/*
+ * Releases an address returned by string_to_ip
+ */
+void free_ip(unsigned char * ip) {
+  kmem_cache_free(ipv4_addr_cache, ip);
+}
+
 /*
  * Prints an IP address given the starting byte
  */
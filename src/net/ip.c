@@ -4,7 +4,9 @@
 #include "net/ip.h"
 #include "net/udp.h"
 #include "net/in.h"
-#include "mm.h"
+#include "arena.h"
+#include "net.h"
+#include "mutex.h"
 
 struct ipv4_packet_header
 {
@@ -21,12 +23,37 @@ struct ipv4_packet_header
 };
 
 unsigned char ipv4_address[4];
+seqlock_t ipv4_address_lock;    //read for every packet, written on a DHCP ACK
+extern struct arena * net_tx_arena;
+extern spinlock_t net_tx_lock;
 
 void ipv4_init(void)
 {
+  seqlock_init(&ipv4_address_lock);
   memset(ipv4_address, 0, 4);
 }
 
+/*
+ * Copies our IPv4 address into address (4 bytes)
+ */
+void ipv4_get_address(unsigned char * address)
+{
+  unsigned int sequence;
+
+  do
+  {
+    sequence = read_seqbegin(&ipv4_address_lock);
+    memcpy(address, ipv4_address, 4);
+  } while(read_seqretry(&ipv4_address_lock, sequence));
+}
+
+void ipv4_set_address(unsigned char * address)
+{
+  unsigned int flags = write_seqlock_irqsave(&ipv4_address_lock);
+  memcpy(ipv4_address, address, 4);
+  write_sequnlock_irqrestore(&ipv4_address_lock, flags);
+}
+
 void ipv4_receive_packet(char * data, unsigned short length)
 {
   /*
@@ -100,13 +127,18 @@ unsigned long ipv4_checksum(unsigned short * packet)
 }
 
 /*
- * Broadcast an ipv4 packet
+ * Broadcast an ipv4 packet, called with net_tx_lock held
  * ie) destination = 255.255.255.255
  * limitation: only source can be 0.0.0.0 for now
  */
-void ipv4_broadcast(char * data, unsigned short length, unsigned char protocol)
+void __ipv4_broadcast(char * data, unsigned short length, unsigned char protocol)
 {	
   struct ipv4_packet_header packet;
+  if(length + sizeof(struct ipv4_packet_header) > NET_BUFFER_SIZE)
+  {
+    print_string("IPv4 packet too large, dropping packet\n");
+    return;
+  }
   packet.version_ihl = 0x45;						//version = ipv4
   packet.tos = 0x10;
   packet.length = htons(sizeof(struct ipv4_packet_header) + length);
@@ -119,11 +151,23 @@ void ipv4_broadcast(char * data, unsigned short length, unsigned char protocol)
   memset(packet.destination_address, 0xff, 4);	//255.255.255.255
   packet.checksum = ipv4_checksum((unsigned short *)&packet);
     
-  unsigned char * buffer = calloc(length + sizeof(struct ipv4_packet_header));
-  memcpy(buffer, &packet, sizeof(struct ipv4_packet_header));
-  memcpy(buffer + sizeof(struct ipv4_packet_header), data, length);
-    
-  eth_broadcast(buffer, length + sizeof(struct ipv4_packet_header), 0x0800);
+  unsigned int mark = arena_mark(net_tx_arena);
+  unsigned char * buffer = arena_alloc(net_tx_arena, length + sizeof(struct ipv4_packet_header));
+  if(buffer != NULL)
+  {
+    memcpy(buffer, &packet, sizeof(struct ipv4_packet_header));
+    memcpy(buffer + sizeof(struct ipv4_packet_header), data, length);
+    __eth_broadcast(buffer, length + sizeof(struct ipv4_packet_header), 0x0800);
+  }
+  arena_release(net_tx_arena, mark);
+}
+
+/* __ipv4_broadcast, taking net_tx_lock around it */
+void ipv4_broadcast(char * data, unsigned short length, unsigned char protocol)
+{
+  unsigned int flags = spin_lock_irqsave(&net_tx_lock);
+  __ipv4_broadcast(data, length, protocol);
+  spin_unlock_irqrestore(&net_tx_lock, flags);
 }
 
 /**
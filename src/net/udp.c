@@ -2,8 +2,15 @@
 #include "screen.h"
 #include "net/in.h"
 #include "net/ip.h"
-#include "mm.h"
+#include "arena.h"
+#include "net.h"
 #include "mutex.h"
+#include "task.h"
+#include "fiber.h"
+#include "timer.h"
+
+extern struct arena * net_tx_arena;
+extern spinlock_t net_tx_lock;
 
 #define MAX_PORTS   1024
 #define UDP_BUFFER  1024
@@ -16,12 +23,26 @@ enum {
 };
 
 
-//if -1 port is free, otherwise the size of the last operation
+//the state of each port
 int ports[MAX_PORTS] = {
   PORT_FREE
 }; 
+//the size of the datagram waiting in buffer, while its port is DATA_READY
+int port_length[MAX_PORTS];
+
+//threads blocked in udp_listen, on any port (each one rechecks its own)
+struct wait_queue udp_waiters;
+//same for fibers, which can't block their thread
+struct fiber_event udp_fiber_event;
+
+//a udp_listen_timeout in progress, on its caller's stack
+struct udp_wait {
+  struct timer timer;
+  volatile int timed_out;
+};
 
-//temp buffer for copying
+//temp buffer for copying, and the lock that covers it
+spinlock_t udp_lock;
 char buffer[UDP_BUFFER] = {
   0
 };
@@ -50,6 +71,9 @@ void udp_init() {
   int i;
   for (i = 0; i < MAX_PORTS; i++)
     ports[i] = PORT_FREE;
+  spin_lock_init(&udp_lock);
+  wait_queue_init(&udp_waiters);
+  fiber_event_init(&udp_fiber_event);
 }
 
 /*
@@ -85,15 +109,19 @@ void udp_receive_packet(char * data, unsigned short length) {
       if(ports[port] == DATA_READY) {
         print_string("PORT HAS DATA READY - PROBABLY GOING TO OVERWRITE STUFF WAITING IN QUEUE FOR PROCESS");
       }
+      int size = length - sizeof(struct udp_packet_header);
+      if (size > UDP_BUFFER) {
+        print_string("UDP datagram too large for the buffer, dropping it\n");
+        return;
+      }
       //copy the received packet to the buffer
-      spinlock();
-      memcpy(buffer, 0, 1024);
-      //print_string("Copying ");
-      //print_string(itoa(length - sizeof(struct udp_packet_header), temp, 10));
-      //print_string(" to buffer\n");
-      memcpy(buffer, data + sizeof(struct udp_packet_header), length - sizeof(struct udp_packet_header));
-      spinunlock();
-      ports[ntohs(packet.destination_port)] = length - sizeof(struct udp_packet_header);
+      unsigned int flags = spin_lock_irqsave(&udp_lock);
+      memcpy(buffer, data + sizeof(struct udp_packet_header), size);
+      port_length[port] = size;
+      ports[port] = DATA_READY;
+      spin_unlock_irqrestore(&udp_lock, flags);
+      wake_up(&udp_waiters);
+      fiber_signal(&udp_fiber_event);
     } else {
       print_string("Not listening on UDP port: ");
       print_string(itoa(ntohs(packet.destination_port), temp, 10));
@@ -107,19 +135,30 @@ void udp_receive_packet(char * data, unsigned short length) {
  */
 void udp_broadcast(unsigned char * data, unsigned short length, unsigned short source_port, unsigned short destination_port) {
   struct udp_packet_header udp;
+  if (length + sizeof(struct udp_packet_header) > NET_BUFFER_SIZE) {
+    print_string("UDP packet too large, dropping packet\n");
+    return;
+  }
   udp.source_port = htons(source_port);
   udp.destination_port = htons(destination_port);
   udp.length = htons(length + 8); //add 8 for header
   udp.checksum = 0x0000; //initially zero until we compute the checksum
 
-  char * buffer = calloc(length + sizeof(struct udp_packet_header));
-  memcpy(buffer, &udp, sizeof(struct udp_packet_header));
-  memcpy(buffer + sizeof(struct udp_packet_header), data, length);
+  //the layers below build their headers in the same arena, it stays ours until they are done
+  unsigned int flags = spin_lock_irqsave(&net_tx_lock);
+  unsigned int mark = arena_mark(net_tx_arena);
+  char * buffer = arena_alloc(net_tx_arena, length + sizeof(struct udp_packet_header));
+  if (buffer != NULL) {
+    memcpy(buffer, &udp, sizeof(struct udp_packet_header));
+    memcpy(buffer + sizeof(struct udp_packet_header), data, length);
   
-  //print_string("DUMPING UDP PACKET: \n");
-  //hd((unsigned long int)buffer, (unsigned long int)buffer + length + sizeof(struct udp_packet_header));
+    //print_string("DUMPING UDP PACKET: \n");
+    //hd((unsigned long int)buffer, (unsigned long int)buffer + length + sizeof(struct udp_packet_header));
   
-  ipv4_broadcast(buffer, length + sizeof(struct udp_packet_header), 17);
+    __ipv4_broadcast(buffer, length + sizeof(struct udp_packet_header), 17);
+  }
+  arena_release(net_tx_arena, mark);
+  spin_unlock_irqrestore(&net_tx_lock, flags);
   //print_string("UDP Broadcast done\n");
 }
 
@@ -148,12 +187,25 @@ int udp_close(unsigned short port) {
   return 1;
 }
 
+/*
+ * Timer callback for udp_listen_timeout, wakes everyone up so the
+ * listener sees it has run out of time
+ */
+static void udp_timeout(struct timer * timer) {
+  ((struct udp_wait *)timer)->timed_out = 1;
+  wake_up(&udp_waiters);
+  fiber_signal(&udp_fiber_event);
+}
+
 /*
  * Blocking call which waits for data on the specific port and fills it
  * into the provided data buffer. Assumes the buffer is large enough
- * to handle the data
+ * to handle the data. Gives up after timeout_ms milliseconds (0 waits
+ * forever) and returns -1
  */
-int udp_listen(unsigned short port, char * data, int length) {
+int udp_listen_timeout(unsigned short port, char * data, int length, unsigned int timeout_ms) {
+  struct udp_wait wait;
+
   if(ports[port] == PORT_BIND) {
     ports[port] = PORT_LISTEN;
   }
@@ -164,16 +216,36 @@ int udp_listen(unsigned short port, char * data, int length) {
     return -1;
   }
 
-  //sleep while waiting for data on the port
-  while (ports[port] == PORT_LISTEN) {
-    __asm__("hlt"); 
-  }
+  wait.timed_out = 0;
+  timer_setup(&wait.timer, udp_timeout);
+  if(timeout_ms != 0)
+    timer_add(&wait.timer, timeout_ms);
+
+  //sleep while waiting for data on the port, only this fiber if we are one
+  if(fiber_current() != NULL)
+    fiber_wait_event(&udp_fiber_event, ports[port] != PORT_LISTEN || wait.timed_out);
+  else
+    wait_event(&udp_waiters, ports[port] != PORT_LISTEN || wait.timed_out);
+
+  //the timer is on our stack, it must be gone before we return
+  timer_cancel(&wait.timer);
+  if(ports[port] != DATA_READY)
+    return -1;
 
-  spinlock();
-  memcpy(data, buffer, length);
-  int size = ports[port];
+  unsigned int flags = spin_lock_irqsave(&udp_lock);
+  int size = port_length[port];
+  memcpy(data, buffer, size < length ? size : length);
   ports[port] = PORT_LISTEN;
-  spinunlock();
+  spin_unlock_irqrestore(&udp_lock, flags);
 
   return size;
 }
+
+/*
+ * Blocking call which waits for data on the specific port and fills it
+ * into the provided data buffer. Assumes the buffer is large enough
+ * to handle the data, for as long as it takes
+ */
+int udp_listen(unsigned short port, char * data, int length) {
+  return udp_listen_timeout(port, data, length, 0);
+}
@@ -0,0 +1,431 @@
+#include "common.h"
+#include "screen.h"
+#include "idt.h"
+#include "mm.h"
+#include "paging.h"
+#include "mutex.h"
+#include "smp.h"
+
+/*
+ * x86 (non-PAE) paging
+ *
+ * The kernel, boot stack and all of the RAM the page allocator manages is
+ * identity mapped with 4MB PSE pages so that it costs one TLB entry per 4MB instead of 1024. Those
+ * entries are marked global (when the cpu supports PGE) so they survive
+ * a cr3 reload. Anything that wants 4KB granularity (guard pages, device
+ * memory with its own cache attributes, ...) goes through map_page, which
+ * splits a large page into a page table on demand when it has to.
+ *
+ * Page tables and the directory come from the page allocator, which is
+ * inside the identity map, so their physical and virtual addresses match.
+ *
+ * [USER_BASE, USER_END) belongs to the address space loaded in cr3, the
+ * rest to the kernel. paging_fork copies an address space lazily: the
+ * user page tables are copied but the pages are shared, read-only and
+ * marked PTE_COW in both, until a write faults and gets a copy of its
+ * own (CR0.WP makes ring 0 writes fault too). Kernel mappings are only
+ * ever changed in page_directory, a forked directory picks them up when
+ * a fault finds it out of date.
+ *
+ * Other cpus may be running on the same directory (every kernel thread
+ * runs on page_directory, user range included), so anything that takes
+ * away or changes a present mapping also has tlb_shootdown flush it
+ * there.
+ */
+#define PDE_INDEX(virt)   ((unsigned int)(virt) >> 22)
+#define PTE_INDEX(virt)   (((unsigned int)(virt) >> PAGE_SHIFT) & 0x3FF)
+#define PTE_ADDR          0xFFFFF000
+#define LARGE_PAGE_SIZE   0x400000
+
+#define CR0_PG            0x80000000
+#define CR0_WP            0x00010000
+#define CR4_PSE           0x00000010
+#define CR4_PGE           0x00000080
+
+#define CPUID_PSE         (1 << 3)
+#define CPUID_PGE         (1 << 13)
+
+unsigned int * page_directory;
+unsigned int kernel_page_flags;   /* PTE_GLOBAL if the cpu supports it */
+spinlock_t cow_lock;              /* paging_fork and cow_fault, which other cpus may run at once */
+
+void page_fault_handler(struct regs * r);
+
+static inline int user_addr(unsigned int virt)
+{
+  return virt >= USER_BASE && virt < USER_END;
+}
+
+static inline unsigned int * current_directory(void)
+{
+  unsigned int cr3;
+  __asm__ __volatile__ ("mov %%cr3, %0" : "=r" (cr3));
+  return (unsigned int *)cr3;
+}
+
+static inline void invlpg(void * virt)
+{
+  __asm__ __volatile__ ("invlpg (%0)" : : "r" (virt) : "memory");
+}
+
+static inline unsigned int cpuid_edx(unsigned int leaf)
+{
+  unsigned int eax, ebx, ecx, edx;
+  __asm__ __volatile__ ("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (leaf));
+  return edx;
+}
+
+/*
+ * Returns a zeroed page to use as a page table or directory
+ */
+static unsigned int * alloc_table(void)
+{
+  return kalloc_zeroed_page();
+}
+
+/*
+ * Identity maps [start, end) with 4MB pages, or with 4KB page tables if
+ * the cpu has no PSE. start and end must be 4MB aligned
+ */
+static void identity_map(unsigned int start, unsigned int end, int pse)
+{
+  unsigned int addr, i;
+  for(addr = start; addr < end; addr += LARGE_PAGE_SIZE)
+  {
+    if(pse)
+    {
+      page_directory[PDE_INDEX(addr)] = addr | PTE_LARGE | kernel_page_flags | PTE_WRITE | PTE_PRESENT;
+      continue;
+    }
+
+    unsigned int * table = alloc_table();
+    for(i = 0; i < 1024; i++)
+      table[i] = (addr + (i << PAGE_SHIFT)) | kernel_page_flags | PTE_WRITE | PTE_PRESENT;
+    page_directory[PDE_INDEX(addr)] = (unsigned int)table | PTE_WRITE | PTE_PRESENT;
+  }
+}
+
+/*
+ * Builds the kernel page directory and turns paging on. Must be called
+ * after mm_init (the tables come from the page allocator)
+ */
+void paging_init(void)
+{
+  unsigned int cr0, cr4, end;
+  unsigned int features = cpuid_edx(1);
+  int pse = (features & CPUID_PSE) != 0;
+
+  kernel_page_flags = (features & CPUID_PGE) ? PTE_GLOBAL : 0;
+  spin_lock_init(&cow_lock);
+  page_directory = alloc_table();
+  end = (mm_get_top() + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+  identity_map(0, end > KERNEL_MAP_END ? end : KERNEL_MAP_END, pse);
+
+  isr_install_handler(14, page_fault_handler);
+
+  __asm__ __volatile__ ("mov %%cr4, %0" : "=r" (cr4));
+  if(pse)
+    cr4 |= CR4_PSE;
+  if(kernel_page_flags & PTE_GLOBAL)
+    cr4 |= CR4_PGE;
+  __asm__ __volatile__ ("mov %0, %%cr4" : : "r" (cr4));
+
+  __asm__ __volatile__ ("mov %0, %%cr3" : : "r" (page_directory) : "memory");
+
+  __asm__ __volatile__ ("mov %%cr0, %0" : "=r" (cr0));
+  cr0 |= CR0_PG | CR0_WP;
+  __asm__ __volatile__ ("mov %0, %%cr0" : : "r" (cr0) : "memory");
+}
+
+/*
+ * Returns the page table covering virt, creating it (or breaking a 4MB
+ * page up into one with the same mapping) if needed. NULL if out of memory
+ */
+static unsigned int * get_table(void * virt)
+{
+  unsigned int * directory = user_addr((unsigned int)virt) ? current_directory() : page_directory;
+  unsigned int * pde = &directory[PDE_INDEX(virt)];
+  unsigned int * table;
+  unsigned int i;
+
+  if((*pde & PTE_PRESENT) && !(*pde & PTE_LARGE))
+    return (unsigned int *)(*pde & PTE_ADDR);
+
+  table = alloc_table();
+  if(table == NULL)
+    return NULL;
+
+  if(*pde & PTE_LARGE)
+  {
+    unsigned int base = *pde & ~(LARGE_PAGE_SIZE - 1);
+    unsigned int flags = *pde & (PTE_GLOBAL | PTE_PCD | PTE_PWT | PTE_USER | PTE_WRITE | PTE_PRESENT);
+    for(i = 0; i < 1024; i++)
+      table[i] = (base + (i << PAGE_SHIFT)) | flags;
+  }
+
+  /* access rights are decided per page, so the directory entry allows all */
+  *pde = (unsigned int)table | PTE_USER | PTE_WRITE | PTE_PRESENT;
+  if(table[0] != 0)
+  {
+    /* the old 4MB translation may be cached anywhere in the range */
+    for(i = 0; i < 1024; i++)
+      invlpg((void *)(((unsigned int)virt & ~(LARGE_PAGE_SIZE - 1)) + (i << PAGE_SHIFT)));
+  }
+  return table;
+}
+
+/*
+ * Flushes virt from the TLB of every cpu that may be using the directory
+ * it was changed in
+ */
+static void flush_page(void * virt)
+{
+  invlpg(virt);
+  tlb_shootdown(user_addr((unsigned int)virt) ? (unsigned int)current_directory() : 0, virt);
+}
+
+/*
+ * Maps the 4KB page at virt to the physical page phys with the given PTE_
+ * flags (PTE_PRESENT is implied). Returns 0 on success, -1 if a page table
+ * could not be allocated
+ */
+int map_page(void * virt, unsigned int phys, unsigned int flags)
+{
+  unsigned int irq_flags = irq_save();
+  unsigned int * table = get_table(virt);
+  unsigned int old;
+
+  if(table == NULL)
+  {
+    irq_restore(irq_flags);
+    return -1;
+  }
+  old = table[PTE_INDEX(virt)];
+  table[PTE_INDEX(virt)] = (phys & PTE_ADDR) | flags | PTE_PRESENT;
+  if(old & PTE_PRESENT)
+    flush_page(virt);
+  else
+    invlpg(virt);
+  irq_restore(irq_flags);
+  return 0;
+}
+
+/*
+ * Removes the mapping for the 4KB page at virt, so any access to it faults
+ */
+void unmap_page(void * virt)
+{
+  unsigned int irq_flags = irq_save();
+  unsigned int * table = get_table(virt);
+  if(table != NULL)
+  {
+    table[PTE_INDEX(virt)] = 0;
+    flush_page(virt);
+  }
+  irq_restore(irq_flags);
+}
+
+/*
+ * Returns the physical address virt is mapped to, or 0 if it is not mapped
+ */
+unsigned int virt_to_phys(void * virt)
+{
+  unsigned int * directory = user_addr((unsigned int)virt) ? current_directory() : page_directory;
+  unsigned int pde = directory[PDE_INDEX(virt)];
+  unsigned int pte;
+
+  if(!(pde & PTE_PRESENT))
+    return 0;
+  if(pde & PTE_LARGE)
+    return (pde & ~(LARGE_PAGE_SIZE - 1)) | ((unsigned int)virt & (LARGE_PAGE_SIZE - 1));
+
+  pte = ((unsigned int *)(pde & PTE_ADDR))[PTE_INDEX(virt)];
+  if(!(pte & PTE_PRESENT))
+    return 0;
+  return (pte & PTE_ADDR) | ((unsigned int)virt & (PAGE_SIZE - 1));
+}
+
+/*
+ * Frees a directory from paging_fork, with its user page tables and the
+ * pages only it still maps. It must not be loaded on any cpu
+ */
+void paging_free(unsigned int directory)
+{
+  unsigned int * dir = (unsigned int *)directory;
+  unsigned int i, j;
+
+  for(i = PDE_INDEX(USER_BASE); i < PDE_INDEX(USER_END); i++)
+  {
+    unsigned int * table = (unsigned int *)(dir[i] & PTE_ADDR);
+
+    if(!(dir[i] & PTE_PRESENT) || (dir[i] & PTE_LARGE))
+      continue;
+    for(j = 0; j < 1024; j++)
+    {
+      void * page = (void *)(table[j] & PTE_ADDR);
+      if((table[j] & PTE_PRESENT) && page_ref_put(page))
+        kfree_page(page);
+    }
+    kfree_page(table);
+  }
+  kfree_page(dir);
+}
+
+/*
+ * Makes a copy on write copy of the running address space, for a forked
+ * thread. Costs a page per user page table, whatever they map. Returns
+ * the new directory (for cr3), 0 if out of memory
+ */
+unsigned int paging_fork(void)
+{
+  unsigned int * parent = current_directory();
+  unsigned int * child = alloc_table();
+  unsigned int i, j, flags;
+
+  if(child == NULL)
+    return 0;
+
+  flags = spin_lock_irqsave(&cow_lock);
+  for(i = 0; i < 1024; i++)
+  {
+    unsigned int * table = (unsigned int *)(parent[i] & PTE_ADDR);
+    unsigned int * copy;
+
+    if(i < PDE_INDEX(USER_BASE) || i >= PDE_INDEX(USER_END) || !(parent[i] & PTE_PRESENT))
+    {
+      child[i] = parent[i];
+      continue;
+    }
+    /* a 4MB page can't be shared copy on write */
+    if(parent[i] & PTE_LARGE)
+      goto fail;
+
+    copy = alloc_table();
+    if(copy == NULL)
+      goto fail;
+    child[i] = (unsigned int)copy | (parent[i] & ~PTE_ADDR);
+    for(j = 0; j < 1024; j++)
+    {
+      if(!(table[j] & PTE_PRESENT))
+        continue;
+      if(page_ref_get((void *)(table[j] & PTE_ADDR)) != 0)
+        goto fail;
+      if(table[j] & PTE_WRITE)
+        table[j] = (table[j] & ~PTE_WRITE) | PTE_COW;
+      copy[j] = table[j];
+    }
+  }
+
+  /* the parent's writable pages just became read-only, wherever it runs */
+  spin_unlock(&cow_lock);
+  __asm__ __volatile__ ("mov %0, %%cr3" : : "r" (parent) : "memory");
+  tlb_shootdown((unsigned int)parent, NULL);
+  irq_restore(flags);
+  return (unsigned int)child;
+
+fail:
+  /* whatever the parent already had marked copy on write just faults once */
+  spin_unlock(&cow_lock);
+  __asm__ __volatile__ ("mov %0, %%cr3" : : "r" (parent) : "memory");
+  tlb_shootdown((unsigned int)parent, NULL);
+  irq_restore(flags);
+  paging_free((unsigned int)child);
+  return 0;
+}
+
+/*
+ * A write to a PTE_COW page: gives the address space a copy of its own,
+ * or just makes the page writable again if nothing else maps it any more.
+ * Returns 0 if address isn't a copy on write page (or out of memory)
+ */
+static int cow_fault(unsigned int address)
+{
+  unsigned int pde = current_directory()[PDE_INDEX(address)];
+  unsigned int * pte;
+  unsigned int page, flags;
+  void * copy;
+
+  if(!user_addr(address) || !(pde & PTE_PRESENT) || (pde & PTE_LARGE))
+    return 0;
+  pte = &((unsigned int *)(pde & PTE_ADDR))[PTE_INDEX(address)];
+
+  flags = spin_lock_irqsave(&cow_lock);
+  if((*pte & (PTE_WRITE | PTE_PRESENT)) == (PTE_WRITE | PTE_PRESENT))
+  {
+    /* another cpu on this directory got here first, our TLB was stale */
+    spin_unlock_irqrestore(&cow_lock, flags);
+    invlpg((void *)address);
+    return 1;
+  }
+  if((*pte & (PTE_COW | PTE_PRESENT)) != (PTE_COW | PTE_PRESENT))
+  {
+    spin_unlock_irqrestore(&cow_lock, flags);
+    return 0;
+  }
+
+  page = *pte & PTE_ADDR;
+  if(page_ref_count((void *)page) > 1)
+  {
+    copy = kalloc_page();
+    if(copy == NULL)
+    {
+      spin_unlock_irqrestore(&cow_lock, flags);
+      return 0;
+    }
+    memcpy(copy, (void *)page, PAGE_SIZE);
+    /* the other sharers may have copied or gone in the meantime */
+    if(page_ref_put((void *)page))
+      kfree_page((void *)page);
+    page = (unsigned int)copy;
+  }
+  *pte = page | (*pte & ~(PTE_ADDR | PTE_COW)) | PTE_WRITE;
+  spin_unlock_irqrestore(&cow_lock, flags);
+
+  /* not under cow_lock, a cpu spinning on it couldn't take the IPI */
+  flush_page((void *)address);
+  return 1;
+}
+
+/*
+ * A kernel address faulted in a forked directory that is behind
+ * page_directory: brings the entry up to date. Returns 0 if it wasn't
+ */
+static int kernel_pde_fault(unsigned int address)
+{
+  unsigned int * dir = current_directory();
+  unsigned int i = PDE_INDEX(address);
+
+  if(user_addr(address) || dir == page_directory || dir[i] == page_directory[i])
+    return 0;
+  dir[i] = page_directory[i];
+  invlpg((void *)address);
+  return 1;
+}
+
+/*
+ * Called on a page fault (isr14). Copy on write and out of date kernel
+ * mappings are dealt with, anything else is reported
+ */
+void page_fault_handler(struct regs * r)
+{
+  unsigned int address;
+  char temp[33] = {0};
+  __asm__ __volatile__ ("mov %%cr2, %0" : "=r" (address));
+
+  if((r->err_code & 0x3) == 0x3 && cow_fault(address))
+    return;
+  if(kernel_pde_fault(address))
+    return;
+
+  print_string("Page Fault at ");
+  print_address(address);
+  print_string(" (");
+  print_string((r->err_code & 0x1) ? "protection" : "not present");
+  print_string((r->err_code & 0x2) ? ", write" : ", read");
+  if(r->err_code & 0x4)
+    print_string(", user");
+  print_string(") eip ");
+  print_string(itoa(r->eip, temp, 16));
+  print_string(". System Halted!\n");
+  for(;;);
+}
@@ -0,0 +1,363 @@
+#include "common.h"
+#include "screen.h"
+#include "mm.h"
+#include "slab.h"
+#include "mutex.h"
+
+/*
+ * Slab allocator for fixed size kernel objects
+ *
+ * Each cache hands out objects of a single size, rounded up to a cache line.
+ * A slab is a naturally aligned block of 2^order pages from the page
+ * allocator with a struct slab header at the front and the objects after it,
+ * so the slab an object belongs to is found by masking its address.
+ *
+ * Free objects are tracked with a stack of indexes in the slab header rather
+ * than a pointer stored inside the object. That way the constructor only
+ * runs once, when the slab is created, and an object keeps its constructed
+ * state across kmem_cache_free / kmem_cache_alloc: allocation is a pop off
+ * the index stack. After the stack the header also has one tag byte per
+ * object that owners can use to mark who allocated it (see kmem_cache_tag).
+ *
+ * Every cache has its own lock, so allocations from different caches don't
+ * contend, and growing or shrinking a cache takes the page allocator's
+ * lock inside it. cache_chain_lock only guards the list of caches.
+ */
+#define SLAB_MIN_OBJECTS  8
+#define SLAB_MAX_ORDER    3
+
+struct slab {
+  struct kmem_cache * cache;
+  struct slab * next;
+  struct slab * prev;
+  char * objects;               /* address of the first object */
+  unsigned char * tags;         /* one byte per object, after free_index */
+  unsigned int free;            /* number of entries on the free stack */
+  unsigned short free_index[];  /* stack of free object indexes */
+};
+
+struct kmem_cache {
+  char * name;
+  unsigned int size;            /* object size rounded up to a cache line */
+  unsigned int order;           /* each slab is 2^order pages */
+  unsigned int per_slab;        /* objects per slab */
+  void (*ctor)(void *);
+  struct slab * partial;        /* slabs with some objects free */
+  struct slab * full;           /* slabs with no objects free */
+  struct slab * empty;          /* one completely free slab kept in reserve */
+  unsigned int slabs;
+  unsigned int active;          /* objects currently handed out */
+  unsigned int hits;            /* allocations served from an existing slab */
+  unsigned int misses;          /* allocations that had to grow the cache */
+  unsigned int frees;
+  spinlock_t lock;              /* everything above but the layout */
+  struct kmem_cache * next;
+};
+
+struct kmem_cache cache_cache;  /* the cache that kmem_cache structures come from */
+struct kmem_cache * cache_chain;
+spinlock_t cache_chain_lock;
+
+static void slab_list_add(struct slab ** list, struct slab * slab)
+{
+  slab->prev = NULL;
+  slab->next = *list;
+  if(*list != NULL)
+    (*list)->prev = slab;
+  *list = slab;
+}
+
+static void slab_list_del(struct slab ** list, struct slab * slab)
+{
+  if(slab->prev != NULL)
+    slab->prev->next = slab->next;
+  else
+    *list = slab->next;
+  if(slab->next != NULL)
+    slab->next->prev = slab->prev;
+}
+
+/*
+ * Returns the size of the slab header needed to track 'count' objects,
+ * rounded up so that the first object starts on a cache line
+ */
+static unsigned int slab_header_size(unsigned int count)
+{
+  unsigned int size = sizeof(struct slab) + count * (sizeof(unsigned short) + 1);
+  return (size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+}
+
+/*
+ * Works out the slab order and the number of objects per slab for a cache
+ */
+static void kmem_cache_layout(struct kmem_cache * cache)
+{
+  unsigned int bytes, count;
+
+  for(cache->order = 0; ; cache->order++)
+  {
+    bytes = PAGE_SIZE << cache->order;
+    count = (bytes - sizeof(struct slab)) / (cache->size + sizeof(unsigned short) + 1);
+    while(count > 0 && slab_header_size(count) + count * cache->size > bytes)
+      count--;
+    if(count >= SLAB_MIN_OBJECTS || cache->order == SLAB_MAX_ORDER)
+      break;
+  }
+  cache->per_slab = count;
+}
+
+/*
+ * Fills in a cache descriptor
+ */
+static void kmem_cache_setup(struct kmem_cache * cache, char * name, size_t size, void (*ctor)(void *))
+{
+  cache->name = name;
+  cache->size = (size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+  cache->ctor = ctor;
+  cache->partial = NULL;
+  cache->full = NULL;
+  cache->empty = NULL;
+  cache->slabs = 0;
+  cache->active = 0;
+  cache->hits = 0;
+  cache->misses = 0;
+  cache->frees = 0;
+  spin_lock_init(&cache->lock);
+  kmem_cache_layout(cache);
+}
+
+/*
+ * Puts a cache on the cache chain, for slabinfo
+ */
+static void kmem_cache_link(struct kmem_cache * cache)
+{
+  unsigned int flags = spin_lock_irqsave(&cache_chain_lock);
+  cache->next = cache_chain;
+  cache_chain = cache;
+  spin_unlock_irqrestore(&cache_chain_lock, flags);
+}
+
+/*
+ * Sets up the cache that all other cache descriptors are allocated from.
+ * Must be called after mm_init and before any kmem_cache_create
+ */
+void slab_init(void)
+{
+  cache_chain = NULL;
+  spin_lock_init(&cache_chain_lock);
+  kmem_cache_setup(&cache_cache, "kmem_cache", sizeof(struct kmem_cache), NULL);
+  kmem_cache_link(&cache_cache);
+}
+
+/*
+ * Creates a named cache of 'size' byte objects. If ctor is given it is run
+ * once on every object when its slab is created. Returns NULL if the
+ * objects are too large to slab
+ */
+struct kmem_cache * kmem_cache_create(char * name, size_t size, void (*ctor)(void *))
+{
+  struct kmem_cache * cache = kmem_cache_alloc(&cache_cache);
+  if(cache == NULL)
+    return NULL;
+
+  kmem_cache_setup(cache, name, size, ctor);
+  if(cache->per_slab == 0)
+  {
+    print_string("kmem_cache_create: object too large for a slab: ");
+    print_string(name);
+    print_string("\n");
+    kmem_cache_free(&cache_cache, cache);
+    return NULL;
+  }
+  kmem_cache_link(cache);
+  return cache;
+}
+
+/*
+ * Allocates a new slab for the cache and constructs all of its objects
+ */
+static struct slab * kmem_cache_grow(struct kmem_cache * cache)
+{
+  unsigned int i;
+  struct slab * slab = kalloc_pages(cache->order);
+  if(slab == NULL)
+    return NULL;
+
+  mm_set_slab(slab, cache->order);
+  slab->cache = cache;
+  slab->objects = (char *)slab + slab_header_size(cache->per_slab);
+  slab->tags = (unsigned char *)&slab->free_index[cache->per_slab];
+  slab->free = cache->per_slab;
+  for(i = 0; i < cache->per_slab; i++)
+  {
+    /* stacked in reverse so objects are handed out in address order */
+    slab->free_index[i] = cache->per_slab - 1 - i;
+    slab->tags[i] = 0;
+    if(cache->ctor != NULL)
+      cache->ctor(slab->objects + i * cache->size);
+  }
+  cache->slabs++;
+  return slab;
+}
+
+/*
+ * Returns a constructed object from the cache, or NULL if out of memory
+ */
+void * kmem_cache_alloc(struct kmem_cache * cache)
+{
+  struct slab * slab;
+  void * obj;
+  unsigned int flags = spin_lock_irqsave(&cache->lock);
+
+  slab = cache->partial;
+  if(slab != NULL)
+    cache->hits++;
+  else
+  {
+    if(cache->empty != NULL)
+    {
+      slab = cache->empty;
+      cache->empty = NULL;
+      cache->hits++;
+    }
+    else
+    {
+      slab = kmem_cache_grow(cache);
+      cache->misses++;
+      if(slab == NULL)
+      {
+        spin_unlock_irqrestore(&cache->lock, flags);
+        return NULL;
+      }
+    }
+    slab_list_add(&cache->partial, slab);
+  }
+
+  obj = slab->objects + slab->free_index[--slab->free] * cache->size;
+  if(slab->free == 0)
+  {
+    slab_list_del(&cache->partial, slab);
+    slab_list_add(&cache->full, slab);
+  }
+  cache->active++;
+  spin_unlock_irqrestore(&cache->lock, flags);
+  return obj;
+}
+
+/*
+ * Returns an object to its cache. The object should be left in its
+ * constructed state since the constructor is not run again
+ */
+void kmem_cache_free(struct kmem_cache * cache, void * obj)
+{
+  struct slab * slab;
+  unsigned int flags;
+
+  if(obj == NULL)
+    return;
+
+  flags = spin_lock_irqsave(&cache->lock);
+  slab = (struct slab *)((unsigned int)obj & ~((PAGE_SIZE << cache->order) - 1));
+  if(slab->free == 0)
+  {
+    slab_list_del(&cache->full, slab);
+    slab_list_add(&cache->partial, slab);
+  }
+  slab->free_index[slab->free++] = ((char *)obj - slab->objects) / cache->size;
+  cache->active--;
+  cache->frees++;
+
+  /* keep one empty slab around so alloc/free at a slab edge doesn't thrash */
+  if(slab->free == cache->per_slab)
+  {
+    slab_list_del(&cache->partial, slab);
+    if(cache->empty == NULL)
+      cache->empty = slab;
+    else
+    {
+      kfree_pages(slab);
+      cache->slabs--;
+    }
+  }
+  spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+/*
+ * Returns the cache that an object came from, or NULL if the address is
+ * not inside a slab
+ */
+struct kmem_cache * virt_to_cache(void * obj)
+{
+  int order = mm_slab_order(obj);
+  if(order < 0)
+    return NULL;
+  return ((struct slab *)((unsigned int)obj & ~((PAGE_SIZE << order) - 1)))->cache;
+}
+
+/*
+ * Returns the tag byte of an object from the cache. The slab allocator does
+ * not use it, whoever allocated the object can
+ */
+unsigned char * kmem_cache_tag(struct kmem_cache * cache, void * obj)
+{
+  struct slab * slab = (struct slab *)((unsigned int)obj & ~((PAGE_SIZE << cache->order) - 1));
+  return &slab->tags[((char *)obj - slab->objects) / cache->size];
+}
+
+/*
+ * Returns the (cache line rounded) object size of a cache
+ */
+size_t kmem_cache_size(struct kmem_cache * cache)
+{
+  return cache->size;
+}
+
+/*
+ * Sums the memory held by all slabs, and how much of it is live objects
+ */
+void kmem_cache_usage(unsigned int * slab_bytes, unsigned int * object_bytes)
+{
+  struct kmem_cache * cache;
+  unsigned int flags = spin_lock_irqsave(&cache_chain_lock);
+
+  *slab_bytes = 0;
+  *object_bytes = 0;
+  for(cache = cache_chain; cache != NULL; cache = cache->next)
+  {
+    *slab_bytes += cache->slabs * (PAGE_SIZE << cache->order);
+    *object_bytes += cache->active * cache->size;
+  }
+  spin_unlock_irqrestore(&cache_chain_lock, flags);
+}
+
+/*
+ * Prints the object counts and hit / miss statistics of every cache
+ */
+void slabinfo(void)
+{
+  char temp[33] = {0};
+  struct kmem_cache * cache;
+
+  print_string("cache");
+  print_string_atx("size", 16);
+  print_string_atx("active", 24);
+  print_string_atx("total", 33);
+  print_string_atx("slabs", 42);
+  print_string_atx("hits", 50);
+  print_string_atx("misses", 60);
+  print_string_atx("frees", 70);
+  print_string("\n");
+
+  for(cache = cache_chain; cache != NULL; cache = cache->next)
+  {
+    print_string(cache->name);
+    print_string_atx(utoa(cache->size, temp, 10), 16);
+    print_string_atx(utoa(cache->active, temp, 10), 24);
+    print_string_atx(utoa(cache->slabs * cache->per_slab, temp, 10), 33);
+    print_string_atx(utoa(cache->slabs, temp, 10), 42);
+    print_string_atx(utoa(cache->hits, temp, 10), 50);
+    print_string_atx(utoa(cache->misses, temp, 10), 60);
+    print_string_atx(utoa(cache->frees, temp, 10), 70);
+    print_string("\n");
+  }
+}
@@ -0,0 +1,584 @@
+#include "common.h"
+#include "screen.h"
+#include "mm.h"
+#include "paging.h"
+#include "gdt.h"
+#include "idt.h"
+#include "task.h"
+#include "timer.h"
+#include "smp.h"
+#include "fpu.h"
+#include "syscall.h"
+#include "mutex.h"
+
+/*
+ * Symmetric multiprocessing
+ *
+ * The cpus are listed in the ACPI MADT, or in the older Intel MP tables
+ * when there is no ACPI. The boot cpu starts each of the others with an
+ * INIT, SIPI, SIPI sequence: they come up in real mode in the trampoline
+ * (smp.s) copied to SMP_TRAMPOLINE, switch to protected mode and call
+ * ap_main on a stack page of their own. ap_main loads the kernel's GDT
+ * with the cpu's own TSS and the shared IDT, starts the local APIC timer
+ * as the cpu's scheduler tick and goes idle, after which the scheduler
+ * hands it threads like any other cpu.
+ *
+ * Device irqs still all go through the PIC to the boot cpu.
+ *
+ * A cpu that changes a mapping only flushes its own TLB. tlb_shootdown
+ * sends the others an IPI to flush theirs, and waits until they have.
+ */
+#define LAPIC_DEFAULT_BASE    0xFEE00000
+#define LAPIC_ID              0x020
+#define LAPIC_TPR             0x080
+#define LAPIC_EOI             0x0B0
+#define LAPIC_SVR             0x0F0
+#define LAPIC_ICR_LOW         0x300
+#define LAPIC_ICR_HIGH        0x310
+#define LAPIC_LVT_TIMER       0x320
+#define LAPIC_TIMER_INIT      0x380
+#define LAPIC_TIMER_COUNT     0x390
+#define LAPIC_TIMER_DIV       0x3E0
+
+#define LAPIC_SVR_ENABLE      0x100
+#define LAPIC_LVT_MASKED      0x10000
+#define LAPIC_TIMER_PERIODIC  0x20000
+#define LAPIC_DIV_16          0x3
+#define ICR_INIT              0x4500    /* INIT, level assert */
+#define ICR_STARTUP           0x4600    /* startup IPI, vector is the start page */
+#define ICR_PENDING           0x1000
+#define ICR_ASSERT            0x4000    /* fixed delivery, level assert */
+
+#define CALIBRATE_US          10000     /* how long to count lapic timer ticks for */
+#define AP_START_TIMEOUT_MS   100
+
+#define CR0_PG                0x80000000
+
+#define MADT_LAPIC            0         /* processor local APIC entry */
+#define MADT_LAPIC_ENABLED    0x1
+#define MP_PROCESSOR          0
+#define MP_PROCESSOR_ENABLED  0x1
+
+/* ACPI root system description pointer */
+struct acpi_rsdp {
+  char signature[8];                    /* "RSD PTR " */
+  unsigned char checksum;
+  char oem[6];
+  unsigned char revision;
+  unsigned int rsdt;
+} __attribute__((packed));
+
+struct acpi_header {
+  char signature[4];
+  unsigned int length;                  /* of the whole table */
+  unsigned char revision;
+  unsigned char checksum;
+  char oem[6];
+  char oem_table[8];
+  unsigned int oem_revision;
+  unsigned int creator;
+  unsigned int creator_revision;
+} __attribute__((packed));
+
+/* multiple APIC description table, followed by variable length entries */
+struct acpi_madt {
+  struct acpi_header header;            /* "APIC" */
+  unsigned int lapic;
+  unsigned int flags;
+} __attribute__((packed));
+
+struct madt_lapic {
+  unsigned char type;
+  unsigned char length;
+  unsigned char acpi_id;
+  unsigned char apic_id;
+  unsigned int flags;
+} __attribute__((packed));
+
+/* Intel MP floating pointer and configuration table */
+struct mp_float {
+  char signature[4];                    /* "_MP_" */
+  unsigned int config;
+  unsigned char length;
+  unsigned char revision;
+  unsigned char checksum;
+  unsigned char features[5];
+} __attribute__((packed));
+
+struct mp_config {
+  char signature[4];                    /* "PCMP" */
+  unsigned short length;
+  unsigned char revision;
+  unsigned char checksum;
+  char oem[8];
+  char product[12];
+  unsigned int oem_table;
+  unsigned short oem_size;
+  unsigned short count;                 /* entries that follow */
+  unsigned int lapic;
+  unsigned short ext_length;
+  unsigned char ext_checksum;
+  unsigned char reserved;
+} __attribute__((packed));
+
+struct mp_processor {
+  unsigned char type;
+  unsigned char apic_id;
+  unsigned char apic_version;
+  unsigned char flags;
+  unsigned int signature;
+  unsigned int features;
+  unsigned int reserved[2];
+} __attribute__((packed));
+
+/* the trampoline's parameters, at ap_trampoline_args in smp.s */
+struct ap_args {
+  unsigned int stack;
+  unsigned int cr3;                     /* 0 if paging is off */
+  unsigned int cr4;
+  unsigned int entry;
+};
+
+struct cpu {
+  unsigned int apic_id;
+  volatile unsigned int online;
+};
+
+struct cpu cpus[MAX_CPUS];
+unsigned int cpu_count;
+unsigned int lapic_base;
+volatile unsigned int * lapic;
+unsigned int lapic_timer_count;         /* lapic timer counts per scheduler tick */
+volatile unsigned int smp_booting_cpu;
+
+spinlock_t tlb_lock;                    /* one shootdown at a time */
+volatile unsigned int tlb_directory;    /* what to flush, see tlb_shootdown */
+void * volatile tlb_virt;
+volatile unsigned int tlb_flush_pending[MAX_CPUS];
+
+extern unsigned char ap_trampoline[];
+extern unsigned char ap_trampoline_args[];
+extern unsigned char ap_trampoline_end[];
+extern void lapic_timer();
+extern void lapic_spurious();
+extern void lapic_tlb();
+extern void idt_load();
+extern unsigned int timer_hz;
+
+static inline unsigned int lapic_read(unsigned int reg)
+{
+  return lapic[reg / 4];
+}
+
+static inline void lapic_write(unsigned int reg, unsigned int value)
+{
+  lapic[reg / 4] = value;
+}
+
+static int paging_enabled(void)
+{
+  unsigned int cr0;
+  __asm__ __volatile__ ("mov %%cr0, %0" : "=r" (cr0));
+  return (cr0 & CR0_PG) != 0;
+}
+
+/*
+ * Makes sure [phys, phys + size) is identity mapped once paging is on.
+ * The firmware tables and the local APIC can be above the RAM that
+ * paging_init maps. Returns -1 if the range is in the user window, where
+ * it can't be identity mapped
+ */
+static int smp_map(unsigned int phys, unsigned int size, unsigned int flags)
+{
+  unsigned int page;
+
+  if(!paging_enabled())
+    return 0;
+  if(phys + size > USER_BASE && phys < USER_END)
+    return -1;
+  for(page = phys & ~(PAGE_SIZE - 1); page < phys + size; page += PAGE_SIZE)
+    if(virt_to_phys((void *)page) != page)
+      map_page((void *)page, page, flags | PTE_WRITE);
+  return 0;
+}
+
+static int checksum(void * table, unsigned int length)
+{
+  unsigned char * bytes = table;
+  unsigned char sum = 0;
+  while(length--)
+    sum += *bytes++;
+  return sum == 0;
+}
+
+/*
+ * Looks for a signature on a 16 byte boundary in [start, start + length)
+ */
+static void * find_signature(unsigned int start, unsigned int length, const char * signature)
+{
+  unsigned int addr;
+  size_t size = strlen(signature);
+
+  for(addr = start; addr < start + length; addr += 16)
+    if(strncmp((const char *)addr, signature, size) == 0)
+      return (void *)addr;
+  return NULL;
+}
+
+/*
+ * The firmware puts its tables in the first KB of the EBDA or in the BIOS
+ * area between 0xE0000 and 0xFFFFF
+ */
+static void * find_bios_table(const char * signature)
+{
+  unsigned int ebda = *(unsigned short *)0x40E << 4;
+  void * table = NULL;
+
+  if(ebda != 0)
+    table = find_signature(ebda, 1024, signature);
+  if(table == NULL)
+    table = find_signature(0xE0000, 0x20000, signature);
+  return table;
+}
+
+static void add_cpu(unsigned int apic_id)
+{
+  if(cpu_count == MAX_CPUS)
+    return;
+  cpus[cpu_count].apic_id = apic_id;
+  cpus[cpu_count].online = 0;
+  cpu_count++;
+}
+
+/*
+ * Fills in cpus from the ACPI MADT. Returns 0 if there isn't one
+ */
+static int acpi_find_cpus(void)
+{
+  struct acpi_rsdp * rsdp = find_bios_table("RSD PTR ");
+  struct acpi_header * rsdt;
+  struct acpi_madt * madt = NULL;
+  unsigned int i, entries, addr, end;
+
+  if(rsdp == NULL || !checksum(rsdp, sizeof(struct acpi_rsdp)))
+    return 0;
+
+  rsdt = (struct acpi_header *)rsdp->rsdt;
+  if(smp_map((unsigned int)rsdt, sizeof(struct acpi_header), 0) != 0 ||
+     smp_map((unsigned int)rsdt, rsdt->length, 0) != 0)
+    return 0;
+  entries = (rsdt->length - sizeof(struct acpi_header)) / 4;
+
+  for(i = 0; i < entries && madt == NULL; i++)
+  {
+    struct acpi_header * table = (struct acpi_header *)((unsigned int *)(rsdt + 1))[i];
+    if(smp_map((unsigned int)table, sizeof(struct acpi_header), 0) != 0 ||
+       strncmp(table->signature, "APIC", 4) != 0)
+      continue;
+    if(smp_map((unsigned int)table, table->length, 0) == 0 && checksum(table, table->length))
+      madt = (struct acpi_madt *)table;
+  }
+  if(madt == NULL)
+    return 0;
+
+  lapic_base = madt->lapic;
+  end = (unsigned int)madt + madt->header.length;
+  for(addr = (unsigned int)(madt + 1); addr < end; addr += ((struct madt_lapic *)addr)->length)
+  {
+    struct madt_lapic * entry = (struct madt_lapic *)addr;
+    if(entry->length == 0)
+      break;
+    if(entry->type == MADT_LAPIC && (entry->flags & MADT_LAPIC_ENABLED))
+      add_cpu(entry->apic_id);
+  }
+  return cpu_count != 0;
+}
+
+/*
+ * Fills in cpus from the Intel MP configuration table. Returns 0 if there
+ * isn't one (the "default configurations" without a table aren't handled)
+ */
+static int mp_find_cpus(void)
+{
+  struct mp_float * mp = find_bios_table("_MP_");
+  struct mp_config * config;
+  unsigned char * entry;
+  unsigned int i;
+
+  if(mp == NULL || mp->config == 0 || !checksum(mp, mp->length * 16))
+    return 0;
+
+  config = (struct mp_config *)mp->config;
+  if(smp_map((unsigned int)config, sizeof(struct mp_config), 0) != 0 ||
+     smp_map((unsigned int)config, config->length, 0) != 0)
+    return 0;
+  if(strncmp(config->signature, "PCMP", 4) != 0 || !checksum(config, config->length))
+    return 0;
+
+  lapic_base = config->lapic;
+  entry = (unsigned char *)(config + 1);
+  for(i = 0; i < config->count; i++)
+  {
+    if(*entry == MP_PROCESSOR)
+    {
+      struct mp_processor * processor = (struct mp_processor *)entry;
+      if(processor->flags & MP_PROCESSOR_ENABLED)
+        add_cpu(processor->apic_id);
+      entry += sizeof(struct mp_processor);
+    }
+    else
+      entry += 8;       /* every other entry type is 8 bytes */
+  }
+  return cpu_count != 0;
+}
+
+/*
+ * Software enables the local APIC of the cpu we are on
+ */
+static void lapic_enable(void)
+{
+  lapic_write(LAPIC_TPR, 0);
+  lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+/*
+ * Counts how fast the local APIC timer runs against the PIT, so the
+ * other cpus can tick at timer_hz like the boot cpu does
+ */
+static void lapic_calibrate(void)
+{
+  unsigned int counted;
+  unsigned int flags = irq_save();
+
+  lapic_write(LAPIC_TIMER_DIV, LAPIC_DIV_16);
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_VECTOR);
+  lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+  timer_pit_wait(CALIBRATE_US);
+  counted = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_COUNT);
+  lapic_write(LAPIC_TIMER_INIT, 0);
+  irq_restore(flags);
+
+  lapic_timer_count = counted / (CALIBRATE_US / 1000) * 1000 / timer_hz;
+  if(lapic_timer_count == 0)
+    lapic_timer_count = 1;
+}
+
+/*
+ * Sends an inter-processor interrupt and waits for it to be delivered
+ */
+static void lapic_ipi(unsigned int apic_id, unsigned int command)
+{
+  lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+  lapic_write(LAPIC_ICR_LOW, command);
+  while(lapic_read(LAPIC_ICR_LOW) & ICR_PENDING);
+}
+
+/*
+ * Where the other cpus come in from the trampoline, in protected mode on
+ * their own stack with interrupts off
+ */
+static void ap_main(void)
+{
+  unsigned int cpu = smp_booting_cpu;
+
+  gdt_cpu_init(cpu);
+  idt_load();
+  fpu_cpu_init();
+  syscall_cpu_init();
+
+  lapic_enable();
+  lapic_write(LAPIC_TIMER_DIV, LAPIC_DIV_16);
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_PERIODIC | LAPIC_TIMER_VECTOR);
+  lapic_write(LAPIC_TIMER_INIT, lapic_timer_count);
+
+  cpus[cpu].online = 1;
+  thread_cpu_start();
+}
+
+/*
+ * Starts one of the other cpus and waits for it to come up. Returns 0 if
+ * it did
+ */
+static int smp_start_cpu(unsigned int cpu, struct ap_args * args)
+{
+  unsigned int apic_id = cpus[cpu].apic_id;
+  unsigned int waited;
+  void * stack = kalloc_page();
+
+  if(stack == NULL)
+    return -1;
+  if(thread_cpu_init(cpu, stack) != 0)
+  {
+    kfree_page(stack);
+    return -1;
+  }
+
+  args->stack = (unsigned int)stack + PAGE_SIZE;
+  smp_booting_cpu = cpu;
+
+  lapic_ipi(apic_id, ICR_INIT);
+  sleep(10);
+  lapic_ipi(apic_id, ICR_STARTUP | (SMP_TRAMPOLINE >> 12));
+  udelay(200);
+  if(!cpus[cpu].online)
+    lapic_ipi(apic_id, ICR_STARTUP | (SMP_TRAMPOLINE >> 12));
+
+  for(waited = 0; waited < AP_START_TIMEOUT_MS && !cpus[cpu].online; waited++)
+    sleep(1);
+  return cpus[cpu].online ? 0 : -1;
+}
+
+/*
+ * Finds the other cpus and starts them. Needs the timer running and
+ * interrupts on (it sleeps between the start up IPIs)
+ */
+void smp_init(void)
+{
+  struct ap_args * args;
+  unsigned int i, bsp, cr;
+  char temp[33] = {0};
+
+  cpu_count = 0;
+  lapic = NULL;
+  spin_lock_init(&tlb_lock);
+  lapic_base = LAPIC_DEFAULT_BASE;
+  if((!acpi_find_cpus() && !mp_find_cpus()) || smp_map(lapic_base, PAGE_SIZE, PTE_PCD) != 0)
+  {
+    print_string("No usable MP tables, running on the boot cpu only\n");
+    cpu_count = 1;
+    cpus[0].online = 1;
+    return;
+  }
+
+  lapic = (volatile unsigned int *)lapic_base;
+  lapic_enable();
+
+  /* the boot cpu is cpu 0, wherever it is in the table */
+  bsp = lapic_read(LAPIC_ID) >> 24;
+  for(i = 0; i < cpu_count; i++)
+  {
+    if(cpus[i].apic_id == bsp)
+    {
+      cpus[i].apic_id = cpus[0].apic_id;
+      cpus[0].apic_id = bsp;
+      break;
+    }
+  }
+  cpus[0].online = 1;
+
+  if(cpu_count > 1)
+  {
+    lapic_calibrate();
+    idt_set_gate(LAPIC_TIMER_VECTOR, (unsigned)lapic_timer, 0x08, 0x8E);
+    idt_set_gate(LAPIC_SPURIOUS_VECTOR, (unsigned)lapic_spurious, 0x08, 0x8E);
+    idt_set_gate(LAPIC_TLB_VECTOR, (unsigned)lapic_tlb, 0x08, 0x8E);
+
+    memcpy((void *)SMP_TRAMPOLINE, ap_trampoline, ap_trampoline_end - ap_trampoline);
+    args = (struct ap_args *)(SMP_TRAMPOLINE + (ap_trampoline_args - ap_trampoline));
+    args->cr3 = args->cr4 = 0;
+    if(paging_enabled())
+    {
+      __asm__ __volatile__ ("mov %%cr3, %0" : "=r" (cr));
+      args->cr3 = cr;
+      __asm__ __volatile__ ("mov %%cr4, %0" : "=r" (cr));
+      args->cr4 = cr;
+    }
+    args->entry = (unsigned int)ap_main;
+
+    for(i = 1; i < cpu_count; i++)
+      smp_start_cpu(i, args);
+  }
+
+  print_string(itoa(smp_cpu_count(), temp, 10));
+  print_string(" of ");
+  print_string(itoa(cpu_count, temp, 10));
+  print_string(" cpus online\n");
+}
+
+/*
+ * Returns how many cpus are up and running threads
+ */
+unsigned int smp_cpu_count(void)
+{
+  unsigned int i, online = 0;
+  for(i = 0; i < cpu_count; i++)
+    if(cpus[i].online)
+      online++;
+  return online;
+}
+
+/*
+ * Called on the local APIC timer interrupt (the other cpus' scheduler tick)
+ */
+unsigned int lapic_timer_handler(unsigned int old_esp)
+{
+  lapic_write(LAPIC_EOI, 0);
+  return task_switch(old_esp);
+}
+
+/*
+ * Does the flush tlb_shootdown asked this cpu for, if it asked
+ */
+static void tlb_flush_local(void)
+{
+  unsigned int cpu = cpu_id();
+  unsigned int cr3;
+
+  if(!tlb_flush_pending[cpu])
+    return;
+  __asm__ __volatile__ ("mov %%cr3, %0" : "=r" (cr3));
+  if(tlb_directory == 0 || tlb_directory == cr3)
+  {
+    if(tlb_virt == NULL)
+      __asm__ __volatile__ ("mov %0, %%cr3" : : "r" (cr3) : "memory");
+    else
+      __asm__ __volatile__ ("invlpg (%0)" : : "r" (tlb_virt) : "memory");
+  }
+  tlb_flush_pending[cpu] = 0;
+}
+
+/*
+ * Makes the other cpus drop what their TLBs hold for virt in directory
+ * (the physical address of a page directory), once this cpu has changed
+ * the mapping and flushed its own. A directory of 0 means every address
+ * space, for kernel mappings, and a NULL virt means all of the directory's
+ * non-global entries. Returns once they all have. Safe with interrupts
+ * off, it flushes for whoever holds tlb_lock while it waits for it
+ */
+void tlb_shootdown(unsigned int directory, void * virt)
+{
+  unsigned int i, self, flags;
+
+  if(lapic == NULL || smp_cpu_count() < 2)
+    return;
+
+  flags = irq_save();
+  while(!spin_trylock(&tlb_lock))
+    tlb_flush_local();
+
+  self = cpu_id();
+  tlb_directory = directory;
+  tlb_virt = virt;
+  for(i = 0; i < cpu_count; i++)
+  {
+    if(i == self || !cpus[i].online)
+      continue;
+    tlb_flush_pending[i] = 1;
+    lapic_ipi(cpus[i].apic_id, ICR_ASSERT | LAPIC_TLB_VECTOR);
+  }
+  for(i = 0; i < cpu_count; i++)
+    while(tlb_flush_pending[i])
+      __asm__ __volatile__ ("pause" : : : "memory");
+
+  spin_unlock(&tlb_lock);
+  irq_restore(flags);
+}
+
+/*
+ * Called on the TLB shootdown IPI
+ */
+void tlb_shootdown_handler(void)
+{
+  tlb_flush_local();
+  lapic_write(LAPIC_EOI, 0);
+}
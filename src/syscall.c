@@ -0,0 +1,318 @@
+#include "common.h"
+#include "screen.h"
+#include "mm.h"
+#include "paging.h"
+#include "gdt.h"
+#include "idt.h"
+#include "task.h"
+#include "smp.h"
+#include "timer.h"
+#include "syscall.h"
+
+/*
+ * System calls
+ *
+ * Ring 3 enters the kernel with SYSENTER when the cpu has it, and with
+ * int 0x80 otherwise (or when it prefers to). Both take the call number
+ * in eax and up to three arguments in ebx, esi and edi, and return the
+ * result in eax. For SYSENTER the caller also puts its esp in ecx and the
+ * address to come back to in edx, as SYSEXIT needs them. The number
+ * indexes a table of handlers, anything past its end returns -1.
+ *
+ * The stubs save the caller's registers as a struct syscall_regs on the
+ * kernel stack, the same for either way in, and the handlers get a
+ * pointer to it. fork copies it for the new thread.
+ */
+#define MSR_SYSENTER_CS   0x174
+#define MSR_SYSENTER_ESP  0x175
+#define MSR_SYSENTER_EIP  0x176
+
+#define CPUID_SEP         (1 << 11)
+
+#define CR0_PG            0x80000000
+
+/* where syscall_bench maps its code and stack, the identity map never reaches here */
+#define USER_BENCH_CODE   USER_BASE
+#define USER_BENCH_STACK  (USER_BASE + PAGE_SIZE)
+#define USER_BENCH_CALLS  100000
+
+/* and where fork_test maps its own, the parent's copy of the word must keep this */
+#define USER_FORK_CODE    (USER_BASE + 2 * PAGE_SIZE)
+#define USER_FORK_STACK   (USER_BASE + 3 * PAGE_SIZE)
+#define FORK_TEST_VALUE   0x600DF00D
+
+typedef int (*syscall_t)(struct syscall_regs * regs);
+
+/* what user_bench reads from the top of its stack and fills in */
+struct bench_args {
+  unsigned int sysenter_calls;
+  unsigned int int80_calls;
+  unsigned long long sysenter_cycles;
+  unsigned long long int80_cycles;
+};
+
+extern void sysenter_entry(void);
+extern void syscall_int(void);
+extern void user_return(unsigned int stack, int value);
+extern char user_bench[];
+extern char user_bench_end[];
+extern char user_fork[];
+extern char user_fork_end[];
+
+unsigned int sysenter_enabled;
+
+static int sys_null(struct syscall_regs * regs)
+{
+  (void)regs;
+  return 0;
+}
+
+/*
+ * Leaves ring 3 for good: user_enter returns ebx, or a forked thread
+ * frees its address space and exits
+ */
+static int sys_exit(struct syscall_regs * regs)
+{
+  unsigned int stack = thread_kernel_stack();
+  unsigned int own;
+
+  if(stack == 0)
+    return -1;
+  thread_set_kernel_stack(0);
+  own = thread_set_address_space(0);
+  if(own != 0)
+  {
+    paging_free(own);
+    thread_exit();
+  }
+  user_return(stack, regs->ebx);
+  return 0;
+}
+
+static int sys_gettid(struct syscall_regs * regs)
+{
+  (void)regs;
+  return thread_id();
+}
+
+static int sys_fork(struct syscall_regs * regs)
+{
+  return fork(regs);
+}
+
+static const syscall_t syscall_table[SYSCALL_COUNT] = {
+  [SYS_NULL] = sys_null,
+  [SYS_EXIT] = sys_exit,
+  [SYS_GETTID] = sys_gettid,
+  [SYS_FORK] = sys_fork,
+};
+
+static inline void wrmsr(unsigned int msr, unsigned int value)
+{
+  __asm__ __volatile__ ("wrmsr" : : "c" (msr), "a" (value), "d" (0));
+}
+
+static int paging_enabled(void)
+{
+  unsigned int cr0;
+  __asm__ __volatile__ ("mov %%cr0, %0" : "=r" (cr0));
+  return (cr0 & CR0_PG) != 0;
+}
+
+/*
+ * Called by both entry stubs with interrupts on
+ */
+int syscall_dispatch(struct syscall_regs * regs)
+{
+  if(regs->eax >= SYSCALL_COUNT)
+    return -1;
+  return syscall_table[regs->eax](regs);
+}
+
+/*
+ * Installs the int 0x80 gate (callable from ring 3) and, if the cpu has
+ * SYSENTER, sets it up on the boot cpu. Needs the GDT and IDT
+ */
+void syscall_init(void)
+{
+  unsigned int eax, ebx, ecx, edx;
+  unsigned int family, model, stepping;
+
+  idt_set_gate(SYSCALL_VECTOR, (unsigned)syscall_int, 0x08, 0xEF);
+
+  /* the first Pentium Pros report SEP without really having it */
+  __asm__ __volatile__ ("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (1));
+  family = (eax >> 8) & 0xF;
+  model = (eax >> 4) & 0xF;
+  stepping = eax & 0xF;
+  sysenter_enabled = (edx & CPUID_SEP) && !(family == 6 && model < 3 && stepping < 3);
+
+  print_string("System calls: int 0x80");
+  print_string(sysenter_enabled ? " and SYSENTER\n" : "\n");
+  syscall_cpu_init();
+}
+
+/*
+ * Points SYSENTER at the kernel on the cpu we are running on (the other
+ * cpus call this as they start)
+ */
+void syscall_cpu_init(void)
+{
+  if(!sysenter_enabled)
+    return;
+  wrmsr(MSR_SYSENTER_CS, 0x08);
+  wrmsr(MSR_SYSENTER_ESP, gdt_sysenter_stack(cpu_id()));
+  wrmsr(MSR_SYSENTER_EIP, (unsigned int)sysenter_entry);
+}
+
+static void print_cycles_per_call(char * name, unsigned long long cycles, unsigned int calls)
+{
+  char temp[33] = {0};
+
+  print_string(name);
+  print_string_atx(utoa((unsigned int)udiv64(cycles, calls), temp, 10), 16);
+  print_string(" cycles");
+  if(clock_tsc_khz() != 0)
+  {
+    print_string_atx(utoa((unsigned int)udiv64(cycles_to_ns(cycles), calls), temp, 10), 32);
+    print_string(" ns");
+  }
+  print_string("\n");
+}
+
+/*
+ * Measures the null system call round trip: copies user_bench to a user
+ * page, runs it in ring 3 and prints the tsc cycles per call for each
+ * way in, next to a plain call of the dispatcher from ring 0
+ */
+void syscall_bench(void)
+{
+  void * code = kalloc_page();
+  void * stack = kalloc_page();
+  unsigned int code_addr = (unsigned int)code;
+  unsigned int stack_addr = (unsigned int)stack;
+  struct bench_args * args;
+  struct syscall_regs regs;
+  unsigned long long start, direct;
+  unsigned int i;
+  char temp[33] = {0};
+
+  if(code == NULL || stack == NULL)
+  {
+    print_string("syscallbench: out of memory\n");
+    goto out;
+  }
+  memcpy(code, user_bench, user_bench_end - user_bench);
+
+  /* without paging ring 3 can reach any of memory, so run it in place */
+  if(paging_enabled())
+  {
+    if(virt_to_phys((void *)USER_BENCH_CODE) != 0 || virt_to_phys((void *)USER_BENCH_STACK) != 0)
+    {
+      print_string("syscallbench: user pages already in use\n");
+      goto out;
+    }
+    if(map_page((void *)USER_BENCH_CODE, code_addr, PTE_USER) != 0 ||
+       map_page((void *)USER_BENCH_STACK, stack_addr, PTE_USER | PTE_WRITE) != 0)
+    {
+      print_string("syscallbench: can't map the user pages\n");
+      goto unmap;
+    }
+    code_addr = USER_BENCH_CODE;
+    stack_addr = USER_BENCH_STACK;
+  }
+
+  args = (struct bench_args *)((char *)stack + PAGE_SIZE - sizeof(struct bench_args));
+  args->sysenter_calls = sysenter_enabled ? USER_BENCH_CALLS : 0;
+  args->int80_calls = USER_BENCH_CALLS;
+  user_enter(code_addr, stack_addr + PAGE_SIZE - sizeof(struct bench_args));
+
+  start = rdtsc();
+  for(i = 0; i < USER_BENCH_CALLS; i++)
+  {
+    regs.eax = SYS_NULL;
+    syscall_dispatch(&regs);
+  }
+  direct = rdtsc() - start;
+
+  print_string("null system call, ");
+  print_string(utoa(USER_BENCH_CALLS, temp, 10));
+  print_string(" calls each\n");
+  if(sysenter_enabled)
+    print_cycles_per_call("sysenter", args->sysenter_cycles, args->sysenter_calls);
+  print_cycles_per_call("int 0x80", args->int80_cycles, args->int80_calls);
+  print_cycles_per_call("ring 0 call", direct, USER_BENCH_CALLS);
+
+unmap:
+  if(paging_enabled())
+  {
+    unmap_page((void *)USER_BENCH_CODE);
+    unmap_page((void *)USER_BENCH_STACK);
+  }
+out:
+  if(code != NULL)
+    kfree_page(code);
+  if(stack != NULL)
+    kfree_page(stack);
+}
+
+/*
+ * Checks fork's copy on write from ring 3: user_fork forks, the child
+ * writes over the word at the top of its stack page and exits, and the
+ * parent's copy of the word must still hold FORK_TEST_VALUE
+ */
+void fork_test(void)
+{
+  void * code = kalloc_page();
+  void * stack = kalloc_page();
+  volatile unsigned int * word;
+  int child;
+
+  if(code == NULL || stack == NULL)
+  {
+    print_string("forktest: out of memory\n");
+    goto out;
+  }
+  if(!paging_enabled())
+  {
+    print_string("forktest: needs paging\n");
+    goto out;
+  }
+  if(virt_to_phys((void *)USER_FORK_CODE) != 0 || virt_to_phys((void *)USER_FORK_STACK) != 0)
+  {
+    print_string("forktest: user pages already in use\n");
+    goto out;
+  }
+  memcpy(code, user_fork, user_fork_end - user_fork);
+  if(map_page((void *)USER_FORK_CODE, (unsigned int)code, PTE_USER) != 0 ||
+     map_page((void *)USER_FORK_STACK, (unsigned int)stack, PTE_USER | PTE_WRITE) != 0)
+  {
+    print_string("forktest: can't map the user pages\n");
+    goto unmap;
+  }
+
+  /* the parent's copy stays at this physical page, the child's moves */
+  word = (unsigned int *)((char *)stack + PAGE_SIZE - sizeof(unsigned int));
+  *word = FORK_TEST_VALUE;
+  child = user_enter(USER_FORK_CODE, USER_FORK_STACK + PAGE_SIZE - sizeof(unsigned int));
+  if(child <= 0)
+  {
+    print_string("forktest: fork failed\n");
+    goto unmap;
+  }
+  thread_join(child);
+
+  if(*word == FORK_TEST_VALUE)
+    print_string("forktest: passed\n");
+  else
+    print_string("forktest: FAILED, the child's write reached the parent\n");
+
+unmap:
+  unmap_page((void *)USER_FORK_CODE);
+  unmap_page((void *)USER_FORK_STACK);
+out:
+  if(code != NULL)
+    kfree_page(code);
+  if(stack != NULL)
+    kfree_page(stack);
+}
@@ -1,7 +1,84 @@
 #include "common.h"
+#include "mutex.h"
 #include "mm.h"
+#include "slab.h"
 #include "screen.h"
 #include "task.h"
+#include "timer.h"
+#include "smp.h"
+#include "fpu.h"
+#include "paging.h"
+#include "syscall.h"
+
+/*
+ * Scheduler
+ *
+ * Runnable threads sit on one FIFO queue per priority (0 is the highest),
+ * and a bitmap records which queues are non-empty, so picking the next
+ * thread is a find-first-set and enqueueing is a tail insert: both O(1)
+ * however many threads there are.
+ *
+ * There are two sets of queues, active and expired. A thread runs until
+ * its time slice (longer for higher priorities) is used up, then moves to
+ * the expired set with a fresh slice. When nothing in the active set is
+ * left the two are swapped. That way a higher priority thread always runs
+ * first, and preempts a lower priority one at the next tick, but threads
+ * that spin rather than block can't starve the lower priorities forever.
+ *
+ * Threads waiting for something (data, an irq, a timeout) are taken off
+ * the run queues altogether and parked on a wait queue, or on the sleep
+ * list ordered by wake up time, until whoever produces the event puts
+ * them back with wake_up. When nothing at all is runnable the idle thread
+ * halts the cpu.
+ *
+ * A thread ends by calling thread_exit, or by returning from its entry
+ * function (which returns into thread_exit). It can't free the stack it
+ * is still running on, so it becomes a zombie and the reaper thread
+ * takes it out of the thread list afterwards, wakes anyone in
+ * thread_join and keeps the thread and its stack on a free list for the
+ * next create_task.
+ *
+ * Each cpu has its own current and idle thread and its own active and
+ * expired queues, so switching threads only touches the cpu's own run
+ * queue lock. A thread stays on the cpu it last ran on, where its data
+ * is likely still in the cache: wake ups put it back on that cpu's
+ * queues. A cpu with nothing left to run steals a thread from another
+ * one, starting from a random cpu so idle cpus don't all pile onto the
+ * same victim, and leaving alone threads that ran there within the last
+ * CACHE_HOT_TICKS (they'll be running again shortly, and warm).
+ *
+ * Locking, always with interrupts off:
+ *  - a cpu's run queue lock protects its queues, and the state, on_cpu,
+ *    queue and cpu fields of the threads whose cpu it is. Switching
+ *    happens with it held, and the interrupt.s stubs only drop it (in
+ *    task_switch_done) once they are running on the next thread's stack,
+ *    so no other cpu can pick up a thread whose stack is still in use.
+ *  - sched_lock protects everything shared: the thread list, the sleep,
+ *    zombie and free lists and the wait queues. It is taken before any
+ *    run queue lock, never while holding one.
+ *  - stealing holds the thief's run queue lock and only tries for the
+ *    victim's, so two cpus stealing from each other can't deadlock.
+ *
+ * FPU/SSE state is switched lazily. A thread gets an FXSAVE area the
+ * first time it uses the FPU (the #NM trap, see fpu.c), and from then on
+ * its state is saved when it is switched out after using it. Switching
+ * in only sets CR0.TS, the state is loaded at its next FPU instruction,
+ * or not at all if the cpu's registers still hold it.
+ */
+#define TIMESLICE_MS(priority)  (THREAD_PRIORITIES - (priority))
+#define THREAD_FREE_MAX         16    /* dead threads kept (with stacks) for reuse */
+#define CACHE_HOT_TICKS         1     /* a thread this recently run isn't stolen */
+#define FPU_NO_CPU              0xFFFFFFFF
+#define LOAD_FREQ               5     /* seconds between load average samples */
+#define LOAD_EXP_1              1884  /* 1 / exp(5s / 1min) in LOAD_FSHIFT fixed point */
+#define LOAD_EXP_5              2014
+#define LOAD_EXP_15             2037
+
+enum {
+  THREAD_RUNNABLE,                    /* running, or on a run queue */
+  THREAD_BLOCKED,                     /* on a wait queue or the sleep list */
+  THREAD_ZOMBIE                       /* exited, waiting for the reaper */
+};
 
 struct thread {
   unsigned int id;
@@ -9,45 +86,843 @@ struct thread {
   unsigned int esp3;
   unsigned int start_stack;
   unsigned int end_stack;
+  unsigned int state;
+  unsigned int on_cpu;                /* non-zero while some cpu is running it */
+  unsigned int cpu;                   /* the cpu it runs on, or is queued on */
+  unsigned int last_ran;              /* timer tick it last came off a cpu */
+  unsigned int priority;
+  unsigned int slice;                 /* timer ticks left before it expires */
+  struct run_queue * queue;           /* the queue set it is on, NULL if not queued */
+  unsigned int wake_time;             /* timer tick to wake at, while on the sleep list */
+  struct wait_queue * wait;           /* the wait queue it is on, NULL if none */
+  struct thread * run_next;           /* run queue, sleep, zombie or free list links */
+  struct thread * run_prev;
+  struct thread * wait_next;          /* wait queue link */
   struct thread * next_thread;
+  void * fpu_state;                   /* FXSAVE area, NULL until it first uses the FPU */
+  unsigned int fpu_used;              /* fpu_state holds its registers */
+  unsigned int fpu_cpu;               /* cpu it last loaded its FPU state on */
+  unsigned long long run_start;       /* tsc when it last got a cpu */
+  unsigned long long queued_at;       /* tsc when it was last queued */
+  unsigned long long runtime;         /* tsc cycles it has been running */
+  unsigned long long wait_time;       /* tsc cycles it has been runnable but queued */
+  unsigned int nvcsw;                 /* switched away because it blocked or yielded */
+  unsigned int nivcsw;                /* switched away because it was preempted */
+  unsigned int ring0_esp;             /* stack it enters the kernel on from ring 3, 0 if never there */
+  unsigned int cr3;                   /* its page directory, kernel_cr3 unless it was forked */
+};
+
+struct run_queue {
+  unsigned int bitmap;                /* bit n set if queue n is not empty */
+  unsigned int count;                 /* threads on it */
+  struct thread * head[THREAD_PRIORITIES];
+  struct thread * tail[THREAD_PRIORITIES];
+};
+
+/* each cpu's scheduler, on cache lines of its own (it comes from a slab) */
+struct cpu_sched {
+  spinlock_t lock;                    /* run queue lock, see above */
+  unsigned int id;
+  struct thread * current;
+  struct thread * idle;
+  struct run_queue queues[2];
+  struct run_queue * active;
+  struct run_queue * expired;
+  unsigned int online;
+  unsigned int seed;                  /* picks the first cpu to steal from */
+  unsigned int switches;
+  unsigned int migrations_in;         /* threads it stole */
+  unsigned int migrations_out;        /* threads stolen from it */
+  struct thread * fpu_owner;          /* whose state the FPU registers hold */
 };
 
 struct thread * thread_list;
-struct thread * current_thread;
+struct thread * thread_list_tail;
+struct cpu_sched * cpu_sched[MAX_CPUS];
+unsigned int cpus_online;
+spinlock_t sched_lock;
+struct thread * sleep_list;
+struct thread * zombie_list;
+struct thread * thread_free_list;
+unsigned int thread_free_count;
+struct wait_queue reaper_wait;
+struct wait_queue exit_wait;        /* threads in thread_join */
+struct kmem_cache * thread_cache;
+struct kmem_cache * cpu_sched_cache;
+struct kmem_cache * fpu_cache;
+unsigned int fpu_lazy;              /* set once fpu_init has turned on #NM trapping */
+unsigned int kernel_cr3;            /* page_directory, 0 if paging is off */
+unsigned int load_avg[3];           /* 1, 5 and 15 minute, LOAD_FSHIFT fixed point */
+unsigned int load_seconds;
+volatile unsigned int timer_kick_pending;   /* a thread became runnable under sched_lock */
+
+#define this_cpu        (cpu_sched[cpu_id()])
+#define current_thread  (this_cpu->current)
+#define idle_thread     (this_cpu->idle)
+
+extern unsigned int timer_hz;
+extern unsigned int timer_jiffies;
+
+void task_yield(void);
+static struct thread * thread_alloc(void (*t)(), unsigned int priority);
+static void thread_start(struct thread * new_thread);
+static void reaper_task(void);
 
 int current_id = 0;
 
+/*
+ * Returns a full time slice for a thread of the given priority, in ticks
+ */
+static unsigned int thread_slice(unsigned int priority)
+{
+  unsigned int ticks = TIMESLICE_MS(priority) * timer_hz / 1000;
+  return ticks ? ticks : 1;
+}
+
+static inline void sched_lock_acquire(void)
+{
+  spin_lock(&sched_lock);
+}
+
+static inline void sched_lock_release(void)
+{
+  spin_unlock(&sched_lock);
+}
+
+/*
+ * Tells the timer about threads made runnable while sched_lock was held,
+ * now that it isn't: timer_kick can end up in wake_up, so it must not run
+ * under sched_lock or a run queue lock. Called with interrupts off
+ */
+static void sched_kick_timer(void)
+{
+  if(timer_kick_pending)
+  {
+    timer_kick_pending = 0;
+    timer_kick();
+  }
+}
+
+/*
+ * Takes the run queue lock of the cpu a thread belongs to. Until it is
+ * held a steal can still move the thread, so check it didn't
+ */
+static struct cpu_sched * thread_rq_lock(struct thread * thread)
+{
+  struct cpu_sched * cpu;
+
+  for(;;)
+  {
+    cpu = cpu_sched[thread->cpu];
+    spin_lock(&cpu->lock);
+    if(cpu_sched[thread->cpu] == cpu)
+      return cpu;
+    spin_unlock(&cpu->lock);
+  }
+}
+
+/*
+ * Appends a thread to the queue for its priority. Called with the run
+ * queue lock of the cpu the queue belongs to held
+ */
+static void enqueue_thread(struct run_queue * queue, struct thread * thread)
+{
+  unsigned int priority = thread->priority;
+  thread->queue = queue;
+  thread->run_next = NULL;
+  thread->run_prev = queue->tail[priority];
+  if(queue->tail[priority] != NULL)
+    queue->tail[priority]->run_next = thread;
+  else
+    queue->head[priority] = thread;
+  queue->tail[priority] = thread;
+  queue->bitmap |= 1 << priority;
+  queue->count++;
+  thread->queued_at = rdtsc();
+}
+
+/*
+ * Takes a thread off whichever queue it is on. Called with the run queue
+ * lock of its cpu held
+ */
+static void dequeue_thread(struct thread * thread)
+{
+  struct run_queue * queue = thread->queue;
+  unsigned int priority = thread->priority;
+
+  if(thread->run_prev != NULL)
+    thread->run_prev->run_next = thread->run_next;
+  else
+    queue->head[priority] = thread->run_next;
+  if(thread->run_next != NULL)
+    thread->run_next->run_prev = thread->run_prev;
+  else
+    queue->tail[priority] = thread->run_prev;
+
+  if(queue->head[priority] == NULL)
+    queue->bitmap &= ~(1 << priority);
+  queue->count--;
+  thread->queue = NULL;
+}
+
+/*
+ * Finds the highest priority thread on a queue that hasn't run in the
+ * last CACHE_HOT_TICKS
+ */
+static struct thread * find_cold_thread(struct run_queue * queue)
+{
+  unsigned int bitmap = queue->bitmap;
+  struct thread * thread;
+
+  while(bitmap != 0)
+  {
+    for(thread = queue->head[__builtin_ctz(bitmap)]; thread != NULL; thread = thread->run_next)
+      if(timer_jiffies - thread->last_ran >= CACHE_HOT_TICKS)
+        return thread;
+    bitmap &= bitmap - 1;
+  }
+  return NULL;
+}
+
+/*
+ * Takes a thread off another cpu's run queues for one that has run out
+ * of its own. Returns NULL if there is nothing worth taking. Called with
+ * the thief's run queue lock held
+ */
+static struct thread * steal_thread(struct cpu_sched * cpu)
+{
+  struct cpu_sched * victim;
+  struct thread * thread = NULL;
+  unsigned int i, start;
+
+  if(cpus_online < 2)
+    return NULL;
+
+  /* xorshift, it only has to spread the thieves out */
+  cpu->seed ^= cpu->seed << 13;
+  cpu->seed ^= cpu->seed >> 17;
+  cpu->seed ^= cpu->seed << 5;
+  start = cpu->seed % MAX_CPUS;
+
+  for(i = 0; i < MAX_CPUS && thread == NULL; i++)
+  {
+    victim = cpu_sched[(start + i) % MAX_CPUS];
+    if(victim == NULL || victim == cpu || !victim->online || victim->active->count + victim->expired->count == 0)
+      continue;
+    if(!spin_trylock(&victim->lock))
+      continue;
+
+    thread = find_cold_thread(victim->active);
+    if(thread == NULL)
+      thread = find_cold_thread(victim->expired);
+    if(thread != NULL)
+    {
+      dequeue_thread(thread);
+      thread->cpu = cpu->id;
+      victim->migrations_out++;
+      cpu->migrations_in++;
+    }
+    spin_unlock(&victim->lock);
+  }
+  return thread;
+}
+
+/*
+ * Saves the FPU state of a thread being switched out if it may have
+ * changed it (no trap pending means it ran with the FPU on), and sets
+ * the next one up to trap on its first FPU instruction, unless the
+ * registers are still its own
+ */
+static void fpu_switch(struct cpu_sched * cpu, struct thread * prev, struct thread * next)
+{
+  if(cpu->fpu_owner == prev && !fpu_trapping())
+    fpu_save(prev->fpu_state);
+
+  if(cpu->fpu_owner == next && next->fpu_cpu == cpu->id)
+    fpu_clts();
+  else
+    fpu_stts();
+}
+
+/*
+ * Takes the highest priority runnable thread off the cpu's active queues,
+ * or steals one (the idle thread if there is none), makes it current and
+ * returns its saved stack pointer. Called with the cpu's run queue lock
+ * held
+ */
+static unsigned int pick_next_thread(struct cpu_sched * cpu)
+{
+  struct thread * prev = cpu->current;
+  struct thread * next;
+  unsigned long long now;
+
+  if(cpu->active->bitmap == 0)
+  {
+    struct run_queue * swap = cpu->active;
+    cpu->active = cpu->expired;
+    cpu->expired = swap;
+  }
+
+  if(cpu->active->bitmap != 0)
+  {
+    next = cpu->active->head[__builtin_ctz(cpu->active->bitmap)];
+    dequeue_thread(next);
+  }
+  else if((next = steal_thread(cpu)) == NULL)
+    next = cpu->idle;
+
+  if(next != prev)
+  {
+    /* a stolen thread was queued by another cpu's clock, which may be behind */
+    now = rdtsc();
+    prev->runtime += now - prev->run_start;
+    if(next != cpu->idle && now > next->queued_at)
+      next->wait_time += now - next->queued_at;
+    next->run_start = now;
+
+    prev->last_ran = timer_jiffies;
+    cpu->switches++;
+    if(fpu_lazy)
+      fpu_switch(cpu, prev, next);
+    if(next->ring0_esp != 0)
+      gdt_set_kernel_stack(cpu->id, next->ring0_esp);
+    if(next->cr3 != prev->cr3)
+      __asm__ __volatile__ ("mov %0, %%cr3" : : "r" (next->cr3) : "memory");
+  }
+  prev->on_cpu = 0;
+  next->on_cpu = 1;
+  cpu->current = next;
+
+  return next->esp0;
+}
+
+/*
+ * Runs when no other thread can. Interrupts are off between the check
+ * and the hlt (sti only takes effect after the next instruction), so a
+ * wake up from an irq can't slip in between and be slept through. A
+ * thread woken by another cpu, or left for this one to steal, is noticed
+ * at the next timer tick
+ */
+void cpu_idle(void)
+{
+  struct cpu_sched * cpu;
+
+  for(;;)
+  {
+    __asm__ __volatile__ ("cli");
+    cpu = this_cpu;
+    if(cpu->active->bitmap != 0 || cpu->expired->bitmap != 0)
+    {
+      spin_lock(&cpu->lock);
+      task_yield();
+    }
+    else
+      __asm__ __volatile__ ("sti; hlt");
+  }
+}
+
+/*
+ * Makes a blocked thread runnable again, on the cpu it last ran on. One
+ * that hasn't got as far as switching away (it is between prepare_to_wait
+ * and task_wait, or was preempted there and is still queued) just has its
+ * state put back. Called with sched_lock held, the timer is kicked once
+ * it has been released (see sched_kick_timer)
+ */
+static void wake_thread(struct thread * thread)
+{
+  struct cpu_sched * cpu = thread_rq_lock(thread);
+
+  thread->state = THREAD_RUNNABLE;
+  if(!thread->on_cpu && thread->queue == NULL)
+  {
+    enqueue_thread(cpu->active, thread);
+    timer_kick_pending = 1;
+  }
+  spin_unlock(&cpu->lock);
+}
+
+/*
+ * Wakes every thread on a wait queue. Called with sched_lock held
+ */
+static void wake_up_locked(struct wait_queue * queue)
+{
+  struct thread * thread;
+
+  while((thread = queue->head) != NULL)
+  {
+    queue->head = thread->wait_next;
+    thread->wait = NULL;
+    wake_thread(thread);
+  }
+  queue->tail = NULL;
+}
+
+/*
+ * Sets up an empty wait queue
+ */
+void wait_queue_init(struct wait_queue * queue)
+{
+  queue->head = NULL;
+  queue->tail = NULL;
+}
+
+/*
+ * First half of wait_event: puts the running thread on the wait queue
+ * and marks it blocked, before the condition is checked, so a wake_up
+ * from another cpu or an irq in between can't be missed
+ */
+void prepare_to_wait(struct wait_queue * queue)
+{
+  struct thread * thread;
+  unsigned int flags = irq_save();
+
+  thread = current_thread;
+  if(thread != NULL && thread != idle_thread)
+  {
+    sched_lock_acquire();
+    if(thread->wait == NULL)
+    {
+      thread->wait = queue;
+      thread->wait_next = NULL;
+      if(queue->tail != NULL)
+        queue->tail->wait_next = thread;
+      else
+        queue->head = thread;
+      queue->tail = thread;
+    }
+    spin_lock(&this_cpu->lock);
+    thread->state = THREAD_BLOCKED;
+    spin_unlock(&this_cpu->lock);
+    sched_lock_release();
+  }
+  irq_restore(flags);
+}
+
+/*
+ * Switches away from a thread that prepare_to_wait blocked, unless it has
+ * been woken since. Before threading is up it halts until the next interrupt
+ */
+void task_wait(void)
+{
+  struct thread * thread;
+  unsigned int flags = irq_save();
+
+  thread = current_thread;
+  if(thread == NULL || thread == idle_thread)
+  {
+    __asm__ __volatile__ ("sti; hlt");
+    irq_restore(flags);
+    return;
+  }
+
+  spin_lock(&this_cpu->lock);
+  if(thread->state == THREAD_BLOCKED)
+    task_yield();
+  else
+    spin_unlock(&this_cpu->lock);
+  irq_restore(flags);
+}
+
+/*
+ * Last half of wait_event: the condition is true, so the thread comes off
+ * the wait queue (if nobody woke it) and is runnable again
+ */
+void finish_wait(struct wait_queue * queue)
+{
+  struct thread * thread;
+  struct thread * prev = NULL;
+  struct thread ** link;
+  unsigned int flags = irq_save();
+
+  thread = current_thread;
+  if(thread != NULL && thread != idle_thread)
+  {
+    sched_lock_acquire();
+    spin_lock(&this_cpu->lock);
+    thread->state = THREAD_RUNNABLE;
+    spin_unlock(&this_cpu->lock);
+    if(thread->wait == queue)
+    {
+      for(link = &queue->head; *link != thread; link = &(*link)->wait_next)
+        prev = *link;
+      *link = thread->wait_next;
+      if(queue->tail == thread)
+        queue->tail = prev;
+      thread->wait = NULL;
+    }
+    sched_lock_release();
+  }
+  irq_restore(flags);
+}
+
+/*
+ * Wakes every thread waiting on a wait queue. Safe to call from irq handlers
+ */
+void wake_up(struct wait_queue * queue)
+{
+  unsigned int flags = irq_save();
+  sched_lock_acquire();
+  wake_up_locked(queue);
+  sched_lock_release();
+  sched_kick_timer();
+  irq_restore(flags);
+}
+
+/*
+ * Blocks the running thread until timer_jiffies reaches wake_time. The
+ * sleep list is kept in wake up order so the timer only looks at its head.
+ * The caller should timer_sync before working wake_time out
+ */
+void thread_sleep_until(unsigned int wake_time)
+{
+  struct thread ** link;
+  struct thread * thread;
+  unsigned int flags = irq_save();
+
+  thread = current_thread;
+  if(thread == NULL || thread == idle_thread)
+  {
+    while((int)(wake_time - timer_jiffies) > 0)
+      __asm__ __volatile__ ("sti; hlt; cli");
+    irq_restore(flags);
+    return;
+  }
+
+  timer_sync();
+  sched_lock_acquire();
+  if((int)(wake_time - timer_jiffies) > 0)
+  {
+    for(link = &sleep_list; *link != NULL; link = &(*link)->run_next)
+      if((int)(wake_time - (*link)->wake_time) < 0)
+        break;
+    thread->wake_time = wake_time;
+    thread->run_next = *link;
+    *link = thread;
+
+    spin_lock(&this_cpu->lock);
+    thread->state = THREAD_BLOCKED;
+    spin_unlock(&this_cpu->lock);
+    sched_lock_release();
+
+    /* it is on the sleep list, so a one-shot can be cut to its wake up */
+    timer_kick();
+    task_wait();
+  }
+  else
+    sched_lock_release();
+  irq_restore(flags);
+}
+
+/*
+ * Wakes the sleeping threads whose time has come (called by the timer
+ * handler every tick, with interrupts off)
+ */
+void task_wake_sleepers(unsigned int now)
+{
+  struct thread * thread;
+
+  sched_lock_acquire();
+  while((thread = sleep_list) != NULL && (int)(thread->wake_time - now) <= 0)
+  {
+    sleep_list = thread->run_next;
+    wake_thread(thread);
+  }
+  sched_lock_release();
+}
+
+/*
+ * Returns non-zero if more than one thread is runnable, so the timer has
+ * to keep ticking to share the cpu out between them. The other cpus'
+ * threads are only preempted by their own timers, but wake ups and cache
+ * affinity still need timer_jiffies moving, so with more than one cpu it
+ * always ticks. Called with interrupts off, which with one cpu is all the
+ * locking it needs
+ */
+int task_needs_tick(void)
+{
+  struct cpu_sched * cpu = this_cpu;
+
+  if(cpu->current == NULL || cpus_online > 1)
+    return 1;
+  if(cpu->active->bitmap == 0 && cpu->expired->bitmap == 0)
+    return 0;
+  return cpu->current != cpu->idle && cpu->current->state == THREAD_RUNNABLE;
+}
+
+/*
+ * Gets the timer tick the next sleeping thread wants to wake at. Returns
+ * 0 if no thread is sleeping. Only used with a single cpu, see above
+ */
+int task_next_wake(unsigned int * wake_time)
+{
+  if(sleep_list == NULL)
+    return 0;
+  *wake_time = sleep_list->wake_time;
+  return 1;
+}
+
+/*
+ * Allocates a cpu's scheduler with empty run queues
+ */
+static struct cpu_sched * cpu_sched_alloc(unsigned int id)
+{
+  struct cpu_sched * cpu = kmem_cache_alloc(cpu_sched_cache);
+  unsigned int i;
+
+  if(cpu == NULL)
+    return NULL;
+  spin_lock_init(&cpu->lock);
+  cpu->id = id;
+  cpu->current = cpu->idle = NULL;
+  for(i = 0; i < THREAD_PRIORITIES; i++)
+  {
+    cpu->queues[0].head[i] = cpu->queues[0].tail[i] = NULL;
+    cpu->queues[1].head[i] = cpu->queues[1].tail[i] = NULL;
+  }
+  cpu->queues[0].bitmap = cpu->queues[1].bitmap = 0;
+  cpu->queues[0].count = cpu->queues[1].count = 0;
+  cpu->active = &cpu->queues[0];
+  cpu->expired = &cpu->queues[1];
+  cpu->online = 0;
+  cpu->seed = 2654435761u * (id + 1);
+  cpu->switches = cpu->migrations_in = cpu->migrations_out = 0;
+  cpu->fpu_owner = NULL;
+  return cpu;
+}
+
 /*
  * Initalizes threading by setting the current_thread and the thread_list to null
  */
 void thread_init(void)
 {
+  unsigned int i;
+
   thread_list = NULL;
-  current_thread = NULL;
-  create_task(NULL);			/* kludge to get multi-tasking to work - for some reason first task is always skipped!? */
+  thread_list_tail = NULL;
+  for(i = 0; i < MAX_CPUS; i++)
+    cpu_sched[i] = NULL;
+  cpus_online = 1;
+  spin_lock_init(&sched_lock);
+  fpu_lazy = 0;
+  load_avg[0] = load_avg[1] = load_avg[2] = 0;
+  load_seconds = 0;
+
+  /* every thread starts out in the address space paging_init set up */
+  __asm__ __volatile__ ("mov %%cr0, %0" : "=r" (kernel_cr3));
+  if(kernel_cr3 & 0x80000000)
+    __asm__ __volatile__ ("mov %%cr3, %0" : "=r" (kernel_cr3));
+  else
+    kernel_cr3 = 0;
+
+  sleep_list = NULL;
+  zombie_list = NULL;
+  thread_free_list = NULL;
+  thread_free_count = 0;
+  wait_queue_init(&reaper_wait);
+  wait_queue_init(&exit_wait);
+
+  thread_cache = kmem_cache_create("thread", sizeof(struct thread), NULL);
+  cpu_sched_cache = kmem_cache_create("cpu_sched", sizeof(struct cpu_sched), NULL);
+  cpu_sched[cpu_id()] = cpu_sched_alloc(cpu_id());
+  this_cpu->online = 1;
+  idle_thread = thread_alloc(cpu_idle, THREAD_PRIORITIES - 1);
+  idle_thread->cpu = cpu_id();
+  create_task(NULL);			/* the boot code that is running now gets its thread */
+  create_task(reaper_task);
 }
 
 /*
  * Creates a task given the id and the function pointer where the task should start executing
  * Source: http://hosted.cjmovie.net/TutMultitask.htm
  */
-void create_task(void (*t)())
+unsigned int create_task(void (*t)())
+{
+  return create_task_priority(t, THREAD_PRIORITY_DEFAULT);
+}
+
+/*
+ * Creates a task that runs at the given priority (0 is the highest).
+ * Returns its thread id
+ */
+unsigned int create_task_priority(void (*t)(), unsigned int priority)
+{
+  struct thread * new_thread;
+  unsigned int id;
+
+  if(priority >= THREAD_PRIORITIES)
+    priority = THREAD_PRIORITIES - 1;
+
+  new_thread = thread_alloc(t, priority);
+  if(new_thread == NULL)
+    return 0;
+  id = new_thread->id;
+  thread_start(new_thread);
+  return id;
+}
+
+/*
+ * Adds a new thread to the thread list and makes it runnable
+ */
+static void thread_start(struct thread * new_thread)
 {
-  struct thread * new_thread = malloc(sizeof(struct thread));
-    
+  struct cpu_sched * cpu;
+  unsigned int flags;
+
+  flags = irq_save();
+  sched_lock_acquire();
+  if(thread_list == NULL)
+    thread_list = new_thread;
+  else
+    thread_list_tail->next_thread = new_thread;
+  thread_list_tail = new_thread;
+
+  /*
+   * the first thread is whatever is running now, the rest wait their turn
+   * on this cpu (an idle one will steal them if this one is busy)
+   */
+  cpu = this_cpu;
+  spin_lock(&cpu->lock);
+  new_thread->cpu = cpu->id;
+  if(cpu->current == NULL)
+  {
+    new_thread->on_cpu = 1;
+    cpu->current = new_thread;
+  }
+  else
+  {
+    enqueue_thread(cpu->active, new_thread);
+    timer_kick_pending = 1;
+  }
+  spin_unlock(&cpu->lock);
+  sched_lock_release();
+  sched_kick_timer();
+  irq_restore(flags);
+}
+
+/*
+ * Sets up the idle thread of another cpu, running on the given stack page
+ * (the one the cpu starts up on). Called by smp_init before it starts it
+ */
+int thread_cpu_init(unsigned int cpu, void * stack)
+{
+  struct thread * idle = kmem_cache_alloc(thread_cache);
+  struct cpu_sched * sched = cpu_sched_alloc(cpu);
+
+  if(idle == NULL || sched == NULL)
+  {
+    if(idle != NULL)
+      kmem_cache_free(thread_cache, idle);
+    if(sched != NULL)
+      kmem_cache_free(cpu_sched_cache, sched);
+    return -1;
+  }
+  idle->id = current_id++;
+  idle->start_stack = (unsigned int)stack;
+  idle->end_stack = idle->start_stack + PAGE_SIZE;
+  idle->esp0 = idle->end_stack;
+  idle->state = THREAD_RUNNABLE;
+  idle->on_cpu = 1;
+  idle->cpu = cpu;
+  idle->last_ran = timer_jiffies;
+  idle->priority = THREAD_PRIORITIES - 1;
+  idle->slice = thread_slice(idle->priority);
+  idle->queue = NULL;
+  idle->wait = NULL;
+  idle->next_thread = NULL;
+  idle->fpu_state = NULL;
+  idle->fpu_used = 0;
+  idle->fpu_cpu = FPU_NO_CPU;
+  idle->ring0_esp = 0;
+  idle->cr3 = kernel_cr3;
+  idle->run_start = rdtsc();
+  idle->runtime = idle->wait_time = 0;
+  idle->nvcsw = idle->nivcsw = 0;
+
+  sched->idle = idle;
+  sched->current = idle;
+  cpu_sched[cpu] = sched;
+  return 0;
+}
+
+/*
+ * Called on a cpu that has just started up, with interrupts off. From
+ * here on the scheduler hands it threads. Never returns
+ */
+void thread_cpu_start(void)
+{
+  sched_lock_acquire();
+  this_cpu->online = 1;
+  cpus_online++;
+  sched_lock_release();
+
+  __asm__ __volatile__ ("sti");
+  cpu_idle();
+}
+
+/*
+ * Allocates a thread and builds the stack frame it starts from, which
+ * looks as if it was interrupted just before its first instruction
+ */
+static struct thread * thread_alloc(void (*t)(), unsigned int priority)
+{
+  struct thread * new_thread;
+  unsigned int flags = irq_save();
+
+  /* a dead thread off the free list comes with its stack page */
+  sched_lock_acquire();
+  new_thread = thread_free_list;
+  if(new_thread != NULL)
+  {
+    thread_free_list = new_thread->run_next;
+    thread_free_count--;
+  }
+  sched_lock_release();
+  irq_restore(flags);
+
   if(new_thread == NULL)
-    print_string("NULL THREAD from MALLOC");
-    
+  {
+    new_thread = kmem_cache_alloc(thread_cache);
+    if(new_thread == NULL)
+    {
+      print_string("NULL THREAD from SLAB");
+      return NULL;
+    }
+
+    /* allocate a page for the thread's stack and point to the end of it (stack grows down) */
+    new_thread->start_stack = (unsigned int)kalloc_page();
+    if(new_thread->start_stack == 0)
+    {
+      kmem_cache_free(thread_cache, new_thread);
+      print_string("NULL THREAD STACK");
+      return NULL;
+    }
+    new_thread->end_stack = new_thread->start_stack + PAGE_SIZE;
+    new_thread->fpu_state = NULL;
+  }
+
   unsigned int *stack;
-    
-  /* allocate a page for the thread's stack and point to the end of it (stack grows down) */
-  new_thread->id = current_id++;
-  new_thread->start_stack = (unsigned int)kalloc_page();
-  new_thread->end_stack = new_thread->start_stack + 4096;
+
+  new_thread->id = __sync_fetch_and_add(&current_id, 1);
   new_thread->esp0 = new_thread->end_stack;
+  new_thread->state = THREAD_RUNNABLE;
+  new_thread->on_cpu = 0;
+  new_thread->cpu = 0;
+  new_thread->last_ran = timer_jiffies - CACHE_HOT_TICKS;   /* nothing cached yet */
+  new_thread->priority = priority;
+  new_thread->slice = thread_slice(priority);
+  new_thread->queue = NULL;
+  new_thread->wait = NULL;
   new_thread->next_thread = NULL;
+  new_thread->fpu_used = 0;           /* a reused thread keeps its FXSAVE area, not what's in it */
+  new_thread->fpu_cpu = FPU_NO_CPU;
+  new_thread->ring0_esp = 0;
+  new_thread->cr3 = kernel_cr3;
+  new_thread->run_start = rdtsc();
+  new_thread->runtime = new_thread->wait_time = 0;
+  new_thread->nvcsw = new_thread->nivcsw = 0;
   stack = (unsigned int*)new_thread->esp0;
-  
+
+  *--stack = (unsigned int)thread_exit;	/* where t returns to */
   *--stack = 0x0202;					/* EFLAGS */
   *--stack = 0x08;            /* CS - code seg */
   *--stack = (unsigned int)t;	/* EIP */
@@ -65,50 +940,552 @@ void create_task(void (*t)())
   *--stack = 0x10; 					  /* ES */
   *--stack = 0x10;					  /* FS */
   *--stack = 0x10;					  /* GS */
-    
+
   new_thread->esp0 = (unsigned int)stack;
-  struct thread * traverse = thread_list;
-  
-  /* no existing threads yet */
-  if(traverse == NULL)
+  return new_thread;
+}
+
+/*
+ * Changes the priority of a thread. It takes effect straight away, a
+ * queued thread moves to the queue for its new priority. Returns -1 if
+ * there is no thread with that id
+ */
+int thread_set_priority(unsigned int id, unsigned int priority)
+{
+  struct thread * thread;
+  unsigned int flags;
+
+  if(priority >= THREAD_PRIORITIES)
+    priority = THREAD_PRIORITIES - 1;
+
+  flags = irq_save();
+  sched_lock_acquire();
+  for(thread = thread_list; thread != NULL; thread = thread->next_thread)
   {
-    thread_list = new_thread;
-    current_thread = new_thread;
+    struct cpu_sched * cpu;
+
+    if(thread->id != id)
+      continue;
+
+    cpu = thread_rq_lock(thread);
+    if(thread->queue != NULL)
+    {
+      struct run_queue * queue = thread->queue;
+      dequeue_thread(thread);
+      thread->priority = priority;
+      enqueue_thread(queue, thread);
+    }
+    else
+      thread->priority = priority;
+    spin_unlock(&cpu->lock);
+    sched_lock_release();
+    irq_restore(flags);
+    return 0;
   }
+  sched_lock_release();
+  irq_restore(flags);
+  return -1;
+}
+
+/*
+ * Ends the running thread. Never returns
+ */
+void thread_exit(void)
+{
+  struct thread * thread;
+
+  irq_save();
+  sched_lock_acquire();
+
+  thread = current_thread;
+  spin_lock(&this_cpu->lock);
+  thread->state = THREAD_ZOMBIE;
+  spin_unlock(&this_cpu->lock);
+  thread->run_next = zombie_list;
+  zombie_list = thread;
+  wake_up_locked(&reaper_wait);
+
+  spin_lock(&this_cpu->lock);
+  sched_lock_release();
+  task_yield();
+  for(;;);        /* a zombie is never scheduled again */
+}
+
+/*
+ * Blocks until the thread with the given id has exited. Returns 0 once it
+ * has (or straight away if it already had), -1 for the calling thread's
+ * own id
+ */
+int thread_join(unsigned int id)
+{
+  if(thread_id() == id)
+    return -1;
+
+  wait_event(&exit_wait, !thread_exists(id));
+  return 0;
+}
+
+/*
+ * Returns non-zero if there is a thread with the given id that hasn't
+ * been reaped yet
+ */
+int thread_exists(unsigned int id)
+{
+  struct thread * thread;
+  unsigned int flags = irq_save();
+
+  sched_lock_acquire();
+  for(thread = thread_list; thread != NULL; thread = thread->next_thread)
+    if(thread->id == id)
+      break;
+  sched_lock_release();
+  irq_restore(flags);
+  return thread != NULL;
+}
+
+/*
+ * Takes a zombie out of the thread list, wakes its joiners and keeps it
+ * on the free list, or frees it and its stack if that is full
+ */
+static void thread_release(struct thread * thread)
+{
+  struct thread ** link;
+  struct thread * prev = NULL;
+  struct cpu_sched * cpu;
+  unsigned int flags = irq_save();
+
+  sched_lock_acquire();
+
+  /* its cpu may still be switching away from it, it has once the lock is free */
+  cpu = cpu_sched[thread->cpu];
+  spin_lock(&cpu->lock);
+  spin_unlock(&cpu->lock);
+
+  for(link = &thread_list; *link != thread; link = &(*link)->next_thread)
+    prev = *link;
+  *link = thread->next_thread;
+  if(thread_list_tail == thread)
+    thread_list_tail = prev;
+  wake_up_locked(&exit_wait);
+
+  if(thread_free_count < THREAD_FREE_MAX)
+  {
+    thread->run_next = thread_free_list;
+    thread_free_list = thread;
+    thread_free_count++;
+    thread = NULL;
+  }
+  sched_lock_release();
+  sched_kick_timer();
+  irq_restore(flags);
+
+  if(thread != NULL)
+  {
+    if(thread->fpu_state != NULL)
+      kmem_cache_free(fpu_cache, thread->fpu_state);
+    kfree_page((void *)thread->start_stack);
+    kmem_cache_free(thread_cache, thread);
+  }
+}
+
+/*
+ * Kernel thread that cleans up after exited threads. By the time it runs
+ * they have been switched away from for good, so their stacks are free
+ */
+static void reaper_task(void)
+{
+  struct thread * zombies;
+  struct thread * thread;
+  unsigned int flags;
+
+  for(;;)
+  {
+    wait_event(&reaper_wait, zombie_list != NULL);
+
+    flags = irq_save();
+    sched_lock_acquire();
+    zombies = zombie_list;
+    zombie_list = NULL;
+    sched_lock_release();
+    irq_restore(flags);
+
+    while((thread = zombies) != NULL)
+    {
+      zombies = thread->run_next;
+      thread_release(thread);
+    }
+  }
+}
+
+/*
+ * Fills in the accounting of up to max threads (the idle threads aren't
+ * included, see cpu_idle_time). Returns how many it filled in
+ */
+int thread_stats(struct thread_stat * stats, int max)
+{
+  struct thread * thread;
+  struct cpu_sched * cpu;
+  unsigned int flags = irq_save();
+  int n = 0;
+
+  sched_lock_acquire();
+  for(thread = thread_list; thread != NULL && n < max; thread = thread->next_thread, n++)
+  {
+    cpu = thread_rq_lock(thread);
+    stats[n].id = thread->id;
+    stats[n].priority = thread->priority;
+    stats[n].cpu = thread->cpu;
+    stats[n].runtime = thread->runtime;
+    stats[n].wait_time = thread->wait_time;
+    stats[n].nvcsw = thread->nvcsw;
+    stats[n].nivcsw = thread->nivcsw;
+    if(thread->state == THREAD_ZOMBIE)
+      stats[n].state = 'Z';
+    else if(thread->on_cpu)
+    {
+      stats[n].state = 'R';
+      stats[n].runtime += rdtsc() - thread->run_start;
+    }
+    else if(thread->state == THREAD_RUNNABLE)
+      stats[n].state = 'Q';
+    else
+      stats[n].state = 'B';
+    spin_unlock(&cpu->lock);
+  }
+  sched_lock_release();
+  irq_restore(flags);
+  return n;
+}
+
+/*
+ * Gets the tsc cycles a cpu has spent in its idle thread. Returns 0 if
+ * the cpu isn't online
+ */
+int cpu_idle_time(unsigned int id, unsigned long long * idle)
+{
+  struct cpu_sched * cpu;
+  unsigned int flags;
+
+  if(id >= MAX_CPUS || (cpu = cpu_sched[id]) == NULL || !cpu->online)
+    return 0;
+
+  flags = irq_save();
+  spin_lock(&cpu->lock);
+  *idle = cpu->idle->runtime;
+  if(cpu->current == cpu->idle)
+    *idle += rdtsc() - cpu->idle->run_start;
+  spin_unlock(&cpu->lock);
+  irq_restore(flags);
+  return 1;
+}
+
+/*
+ * Folds the number of runnable threads into the load averages every
+ * LOAD_FREQ seconds (called by the timer as seconds go by)
+ */
+void task_load_update(unsigned int seconds)
+{
+  static const unsigned int exp[3] = { LOAD_EXP_1, LOAD_EXP_5, LOAD_EXP_15 };
+  struct cpu_sched * cpu;
+  unsigned int i, runnable = 0;
+
+  load_seconds += seconds;
+  if(load_seconds < LOAD_FREQ)
+    return;
+
+  for(i = 0; i < MAX_CPUS; i++)
+  {
+    cpu = cpu_sched[i];
+    if(cpu == NULL || !cpu->online)
+      continue;
+    runnable += cpu->active->count + cpu->expired->count;
+    if(cpu->current != cpu->idle)
+      runnable++;
+  }
+
+  for(; load_seconds >= LOAD_FREQ; load_seconds -= LOAD_FREQ)
+    for(i = 0; i < 3; i++)
+      load_avg[i] = (load_avg[i] * exp[i] + (runnable << LOAD_FSHIFT) * ((1 << LOAD_FSHIFT) - exp[i])) >> LOAD_FSHIFT;
+}
+
+/*
+ * Gets the 1, 5 and 15 minute load averages, in LOAD_FSHIFT fixed point
+ */
+void task_load_average(unsigned int * load)
+{
+  load[0] = load_avg[0];
+  load[1] = load_avg[1];
+  load[2] = load_avg[2];
+}
+
+/*
+ * Starts lazy FPU switching (called by fpu_init)
+ */
+void thread_fpu_init(void)
+{
+  fpu_cache = kmem_cache_create("fpu_state", FPU_STATE_SIZE, NULL);
+  fpu_lazy = 1;
+}
+
+/*
+ * Called from the #NM trap with interrupts off: the running thread wants
+ * the FPU. Gives it an FXSAVE area the first time, and loads its state
+ * unless the registers still hold it
+ */
+void thread_fpu_trap(void)
+{
+  struct cpu_sched * cpu = this_cpu;
+  struct thread * thread = cpu->current;
+
+  fpu_clts();
+  if(thread == NULL || (cpu->fpu_owner == thread && thread->fpu_cpu == cpu->id))
+    return;
+
+  if(thread->fpu_state == NULL)
+  {
+    thread->fpu_state = kmem_cache_alloc(fpu_cache);
+    if(thread->fpu_state == NULL)
+    {
+      print_string("No memory for FPU state. System Halted!\n");
+      for(;;);
+    }
+  }
+
+  if(thread->fpu_used)
+    fpu_restore(thread->fpu_state);
   else
   {
-    while(traverse->next_thread != NULL)
-      traverse = traverse->next_thread;
-      
-    traverse->next_thread = new_thread;
+    fpu_reset();
+    thread->fpu_used = 1;
   }
+  cpu->fpu_owner = thread;
+  thread->fpu_cpu = cpu->id;
+}
+
+/*
+ * Returns the id of the thread that is running
+ */
+unsigned int thread_id(void)
+{
+  struct thread * thread = current_thread;
+  return thread != NULL ? thread->id : 0;
+}
+
+/*
+ * Sets the stack the running thread enters the kernel on while it is in
+ * ring 3 (see user_enter in syscall.s), 0 once it is back for good. The
+ * scheduler points the TSS of whichever cpu runs it there
+ */
+void thread_set_kernel_stack(unsigned int esp)
+{
+  unsigned int flags = irq_save();
+  struct thread * thread = current_thread;
+
+  thread->ring0_esp = esp;
+  if(esp != 0)
+    gdt_set_kernel_stack(cpu_id(), esp);
+  irq_restore(flags);
 }
 
 /*
- * Performs the actual task switch (called by the irq0 timer handler)
+ * Returns the stack set by thread_set_kernel_stack, 0 if the running
+ * thread isn't in ring 3
+ */
+unsigned int thread_kernel_stack(void)
+{
+  unsigned int flags = irq_save();
+  unsigned int esp = current_thread->ring0_esp;
+  irq_restore(flags);
+  return esp;
+}
+
+/*
+ * Performs the actual task switch (called by the irq0 timer handler, and
+ * the local apic timer on the other cpus). The running thread keeps the
+ * cpu until its slice runs out, or until a thread with a higher priority
+ * is waiting in the active set. An idle cpu looks for something to steal.
+ * Returns with the cpu's run queue lock held, the stub releases it
  */
 unsigned int task_switch(unsigned int old_esp)
 {
+  struct cpu_sched * cpu = this_cpu;
+  struct thread * thread;
+
+  spin_lock(&cpu->lock);
+
   /*
    * if we don't have a current thread yet, just continue where we were
    */
-  if(current_thread != NULL)
-    current_thread->esp0 = old_esp;
+  thread = cpu->current;
+  if(thread != NULL)
+    thread->esp0 = old_esp;
   else
     return old_esp;
 
-  /* switch to next thread in linked list, or start of list */
-  current_thread = current_thread->next_thread;
-  if(current_thread == NULL)
-    current_thread = thread_list;
+  if(thread == cpu->idle)
+    return pick_next_thread(cpu);
+
+  if(thread->slice > 0)
+    thread->slice--;
+
+  /*
+   * a thread preempted inside wait_event is queued like any other (it may
+   * have missed its wake up), it stays on the wait queue as well
+   */
+  if(thread->slice == 0)
+  {
+    thread->slice = thread_slice(thread->priority);
+    enqueue_thread(cpu->expired, thread);
+  }
+  else
+  {
+    /* lower bits are higher priorities, so anything below ours is more urgent */
+    if(!(cpu->active->bitmap & ((1 << thread->priority) - 1)))
+      return old_esp;
+    enqueue_thread(cpu->active, thread);
+  }
+
+  old_esp = pick_next_thread(cpu);
+  if(cpu->current != thread)
+    thread->nivcsw++;
+  return old_esp;
+}
 
-  return current_thread->esp0;
+/*
+ * Gives up the cpu (called by task_yield, with the cpu's run queue lock
+ * held). A thread that is still runnable goes to the back of its queue
+ * with what is left of its slice, a blocked one stays wherever it was
+ * parked
+ */
+unsigned int task_schedule(unsigned int old_esp)
+{
+  struct cpu_sched * cpu = this_cpu;
+  struct thread * thread = cpu->current;
+
+  thread->esp0 = old_esp;
+  if(thread != cpu->idle && thread->state == THREAD_RUNNABLE && thread->queue == NULL)
+    enqueue_thread(cpu->active, thread);
+  old_esp = pick_next_thread(cpu);
+  if(cpu->current != thread)
+    thread->nvcsw++;
+  return old_esp;
 }
 
 /*
- * Creates a new process, copies the stack from the old process
+ * Called by the switch stubs once they are on the next thread's stack, to
+ * drop the run queue lock task_switch or task_schedule returned holding
  */
-int fork(void)
+void task_switch_done(void)
 {
-  return 0;
+  spin_unlock(&this_cpu->lock);
+  sched_kick_timer();
+}
+
+/*
+ * Prints what each cpu's scheduler has been doing, and how many threads
+ * have moved between cpus
+ */
+void sched_stats(void)
+{
+  char temp[33] = {0};
+  struct cpu_sched * cpu;
+  unsigned int i;
+
+  print_string("cpu");
+  print_string_atx("queued", 8);
+  print_string_atx("switches", 18);
+  print_string_atx("stolen in", 32);
+  print_string_atx("stolen out", 46);
+  print_string("\n");
+
+  for(i = 0; i < MAX_CPUS; i++)
+  {
+    cpu = cpu_sched[i];
+    if(cpu == NULL || !cpu->online)
+      continue;
+    print_string(utoa(i, temp, 10));
+    print_string_atx(utoa(cpu->active->count + cpu->expired->count, temp, 10), 8);
+    print_string_atx(utoa(cpu->switches, temp, 10), 18);
+    print_string_atx(utoa(cpu->migrations_in, temp, 10), 32);
+    print_string_atx(utoa(cpu->migrations_out, temp, 10), 46);
+    print_string("\n");
+  }
+}
+
+/*
+ * Creates a new process from the one that made the system call in regs:
+ * a thread that carries on in ring 3 where the call returns to, with 0
+ * in eax, in a copy on write copy of the caller's address space (see
+ * paging_fork). It starts on a fresh kernel stack, with no FPU state.
+ * Returns the new thread's id, or -1
+ */
+int fork(struct syscall_regs * regs)
+{
+  struct thread * child;
+  unsigned int * stack;
+  unsigned int cr3, flags, priority, id;
+
+  if(kernel_cr3 == 0 || (regs->cs & 3) != 3)
+    return -1;
+
+  flags = irq_save();
+  priority = current_thread->priority;
+  irq_restore(flags);
+
+  cr3 = paging_fork();
+  if(cr3 == 0)
+    return -1;
+  child = thread_alloc(NULL, priority);
+  if(child == NULL)
+  {
+    paging_free(cr3);
+    return -1;
+  }
+
+  /* what the switch stubs pop, ending with an iret to ring 3 */
+  stack = (unsigned int *)child->end_stack;
+  *--stack = regs->ss;
+  *--stack = regs->esp;
+  *--stack = regs->eflags;
+  *--stack = regs->cs;
+  *--stack = regs->eip;
+
+  *--stack = 0;               /* EAX, fork returns 0 in the child */
+  *--stack = regs->ecx;
+  *--stack = regs->edx;
+  *--stack = regs->ebx;
+  *--stack = 0;               /* ESP, skipped by popa */
+  *--stack = regs->ebp;
+  *--stack = regs->esi;
+  *--stack = regs->edi;
+
+  *--stack = USER_DS;         /* DS */
+  *--stack = USER_DS;         /* ES */
+  *--stack = USER_DS;         /* FS */
+  *--stack = USER_DS;         /* GS */
+
+  child->esp0 = (unsigned int)stack;
+  child->ring0_esp = child->end_stack;
+  child->cr3 = cr3;
+  id = child->id;
+  thread_start(child);
+  return id;
+}
+
+/*
+ * Switches the running thread to the address space with page directory
+ * cr3, or back to the kernel's if it is 0. Returns the one it had if
+ * that was its own (from fork), 0 otherwise
+ */
+unsigned int thread_set_address_space(unsigned int cr3)
+{
+  unsigned int flags = irq_save();
+  struct thread * thread = current_thread;
+  unsigned int old = thread->cr3;
+
+  thread->cr3 = cr3 != 0 ? cr3 : kernel_cr3;
+  if(thread->cr3 != old)
+    __asm__ __volatile__ ("mov %0, %%cr3" : : "r" (thread->cr3) : "memory");
+  irq_restore(flags);
+  return old != kernel_cr3 ? old : 0;
 }
@@ -2,77 +2,715 @@
 #include "task.h"
 #include "screen.h"
 #include "mm.h"
+#include "timer.h"
+#include "mutex.h"
 
 #define TIMER_MAX 1193180
 
+/*
+ * Tickless operation
+ *
+ * While more than one thread is runnable the PIT runs periodically (mode
+ * 2) at timer_hz so the scheduler can share the cpu out. Otherwise there
+ * is nothing to preempt, and the PIT is programmed one-shot (mode 0) for
+ * the next sleeping thread's wake up time instead, so an idle system only
+ * takes an interrupt when something is due. A one-shot can be at most
+ * 65535 PIT counts (about 55ms), so longer waits take a few interrupts.
+ *
+ * timer_jiffies keeps counting in ticks either way: a one-shot adds the
+ * ticks it covered when it fires, and timer_sync reads back the ones that
+ * have gone by so far from the PIT, for anything about to compute a time
+ * from timer_jiffies. When a one-shot is cut short (a thread woke up, see
+ * timer_kick) the part of a tick it had counted is carried into the next
+ * one, which ends on the same tick boundary the old one would have.
+ *
+ * Finer than a tick, clock_monotonic_ns reads the TSC, whose frequency
+ * timer_init measures against PIT channel 2. Cycles become nanoseconds
+ * with a multiply and shift (tsc_mult is ns per cycle in TSC_SHIFT fixed
+ * point), so a timestamp costs about as much as the rdtsc itself. The
+ * cpus' TSCs are assumed to run in step, as they do on anything with an
+ * invariant TSC. Until it is calibrated the clock counts in ticks.
+ *
+ * Software timers (timer_add) hang off a hierarchical timing wheel: four
+ * levels of 64 slots, each slot covering 64 times as many ticks as one
+ * on the level below. Adding and cancelling are a list insert or unlink
+ * in the slot the expiry time picks. Each tick only looks at one level 0
+ * slot, and every 64 ticks the next level 1 slot is cascaded down (and
+ * so on up), so a timer is moved at most three times whatever the number
+ * pending. Expired timers go onto a list that the timer thread runs the
+ * callbacks from, with interrupts on. Timers due further out than 64
+ * ticks are allowed to fire up to 1/64 of their delay late, rounded to a
+ * boundary other timers will share, so they coalesce into fewer wake ups.
+ */
+#define PIT_CHANNEL0    0x40
+#define PIT_CHANNEL2    0x42
+#define PIT_COMMAND     0x43
+#define PIT_PERIODIC    0x34      /* channel 0, lo/hi byte, mode 2 */
+#define PIT_ONESHOT     0x30      /* channel 0, lo/hi byte, mode 0 */
+#define PIT_READBACK    0xC2      /* latch count and status of channel 0 */
+#define PIT_OUTPUT      0x80      /* status: out pin high, the one-shot has fired */
+#define PIT_MAX_COUNT   0xFFFF
+#define PIT_CH2_ONESHOT 0xB0      /* channel 2, lo/hi byte, mode 0 */
+#define PIT_CH2_PORT    0x61      /* channel 2 gate and the speaker */
+#define PIT_CH2_GATE    0x01
+#define PIT_CH2_SPEAKER 0x02
+#define PIT_CH2_OUTPUT  0x20
+#define PIT_CH2_MAX_US  54000     /* longest timer_pit_wait */
+
+#define TSC_CALIBRATE_US  50000   /* per attempt, within what one PIT count down can time */
+#define TSC_CALIBRATE_RUNS 3      /* the shortest wins, the others were interrupted */
+#define TSC_SHIFT         22
+
+#define WHEEL_BITS        6
+#define WHEEL_SIZE        (1 << WHEEL_BITS)
+#define WHEEL_MASK        (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS      4
+#define WHEEL_MAX_TICKS   ((1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+enum {
+  TIMER_BIOS = 1,                 /* as the BIOS left it, timer_init not called */
+  TIMER_PERIODIC,
+  TIMER_ONESHOT
+};
+
+enum {
+  CLOCK_JIFFIES = 1,              /* the TSC isn't calibrated (yet) */
+  CLOCK_TSC
+};
+
 unsigned int timer_hz = 18;
+unsigned int timer_divisor;           /* PIT counts per tick */
+unsigned int timer_mode = TIMER_BIOS; /* not 0 so it is in .data, the loader's bss isn't cleared */
+unsigned int timer_oneshot_ticks;     /* ticks the pending one-shot covers */
+unsigned int timer_oneshot_offset;    /* PIT counts of its first tick gone before it started */
+unsigned int timer_oneshot_counted;   /* of its ticks, how many timer_sync has put on the clock */
 unsigned long int timer_ticks = 0;
+unsigned int timer_jiffies = 0;       /* ticks since boot, never reset */
 unsigned long int seconds = 0;
 unsigned long int days = 0;
+unsigned int clock_source = CLOCK_JIFFIES;  /* not 0, see timer_mode */
+unsigned int tsc_khz;                 /* TSC cycles per millisecond */
+unsigned int tsc_mult;                /* ns per cycle << TSC_SHIFT */
+unsigned long long tsc_base;          /* TSC at calibration, clock_monotonic_ns 0 */
+struct timer * wheel[WHEEL_LEVELS][WHEEL_SIZE];
+unsigned int wheel_bitmap[WHEEL_LEVELS][WHEEL_SIZE / 32];  /* bit n set if slot n isn't empty */
+unsigned int wheel_jiffies;           /* next tick the wheel will run */
+struct timer * timer_expired;         /* due, waiting for the timer thread */
+struct timer * volatile timer_running;  /* whose callback the timer thread is in */
+spinlock_t timer_lock;                /* the wheel and the expired list */
+struct wait_queue timer_wait;
 
 void timer_set_tick_frequency(unsigned int hz);
 void clock();
+static void timer_reprogram(unsigned int offset);
+
+/*
+ * Measures the TSC frequency against PIT channel 2 and switches the
+ * monotonic clock over to it
+ */
+static void tsc_calibrate(void)
+{
+  unsigned long long start, cycles, best = 0;
+  unsigned int i;
+
+  for(i = 0; i < TSC_CALIBRATE_RUNS; i++)
+  {
+    start = rdtsc();
+    timer_pit_wait(TSC_CALIBRATE_US);
+    cycles = rdtsc() - start;
+    if(best == 0 || cycles < best)
+      best = cycles;
+  }
+
+  tsc_khz = (unsigned int)udiv64(best, TSC_CALIBRATE_US / 1000);
+  if(tsc_khz == 0)
+    return;
+  tsc_mult = (unsigned int)udiv64(1000000ULL << TSC_SHIFT, tsc_khz);
+  tsc_base = rdtsc();
+  clock_source = CLOCK_TSC;
+}
+
+/*
+ * Links a timer into a list at head. Called with timer_lock held
+ */
+static void timer_link(struct timer ** head, struct timer * timer)
+{
+  timer->next = *head;
+  if(timer->next != NULL)
+    timer->next->pprev = &timer->next;
+  timer->pprev = head;
+  *head = timer;
+}
+
+static void timer_unlink(struct timer * timer)
+{
+  *timer->pprev = timer->next;
+  if(timer->next != NULL)
+    timer->next->pprev = timer->pprev;
+  timer->pprev = NULL;
+}
+
+/*
+ * Puts a timer in the wheel slot for its expiry time. Called with
+ * timer_lock held
+ */
+static void wheel_insert(struct timer * timer)
+{
+  unsigned int delta = timer->expires - wheel_jiffies;
+  unsigned int level, slot;
+
+  if((int)delta < 0)
+  {
+    /* already due, it goes in the slot the next tick runs */
+    timer->expires = wheel_jiffies;
+    delta = 0;
+  }
+  else if(delta > WHEEL_MAX_TICKS)
+  {
+    timer->expires = wheel_jiffies + WHEEL_MAX_TICKS;
+    delta = WHEEL_MAX_TICKS;
+  }
+
+  for(level = 0; level < WHEEL_LEVELS - 1; level++)
+    if(delta < 1U << (WHEEL_BITS * (level + 1)))
+      break;
+  slot = (timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+  timer_link(&wheel[level][slot], timer);
+  wheel_bitmap[level][slot / 32] |= 1U << (slot % 32);
+}
+
+/*
+ * Takes everything out of a slot, to expire or cascade. Called with
+ * timer_lock held
+ */
+static struct timer * wheel_take(unsigned int level, unsigned int slot)
+{
+  struct timer * list = wheel[level][slot];
+
+  wheel[level][slot] = NULL;
+  wheel_bitmap[level][slot / 32] &= ~(1U << (slot % 32));
+  return list;
+}
+
+static int wheel_empty(void)
+{
+  unsigned int level;
+
+  for(level = 0; level < WHEEL_LEVELS; level++)
+    if(wheel_bitmap[level][0] != 0 || wheel_bitmap[level][1] != 0)
+      return 0;
+  return 1;
+}
+
+/*
+ * Runs the wheel up to now: at each tick, cascades the higher levels
+ * whose turn it is and moves the due level 0 slot onto the expired list.
+ * Called with timer_lock held. Returns non-zero if anything expired
+ */
+static int wheel_run(unsigned int now)
+{
+  struct timer * timer;
+  unsigned int level, slot;
+  int expired = 0;
+
+  while((int)(now - wheel_jiffies) >= 0 && !wheel_empty())
+  {
+    slot = wheel_jiffies & WHEEL_MASK;
+    for(level = 1; slot == 0 && level < WHEEL_LEVELS; level++)
+    {
+      unsigned int index = (wheel_jiffies >> (WHEEL_BITS * level)) & WHEEL_MASK;
+      timer = wheel_take(level, index);
+      while(timer != NULL)
+      {
+        struct timer * next = timer->next;
+        wheel_insert(timer);
+        timer = next;
+      }
+      if(index != 0)
+        break;
+    }
+
+    timer = wheel_take(0, slot);
+    while(timer != NULL)
+    {
+      struct timer * next = timer->next;
+      timer_link(&timer_expired, timer);
+      expired = 1;
+      timer = next;
+    }
+    wheel_jiffies++;
+  }
+  /* with nothing pending there is nothing to walk through */
+  if(wheel_empty())
+    wheel_jiffies = now + 1;
+  return expired;
+}
+
+/*
+ * Gets the tick the wheel next needs to run at: when its earliest level 0
+ * slot is due, or when the next cascade is if only higher levels hold
+ * timers. Returns 0 if no timers are pending. Called with timer_lock held
+ */
+static int wheel_next(unsigned int * when)
+{
+  unsigned int slot = wheel_jiffies & WHEEL_MASK;
+  unsigned int word, later;
+
+  if(wheel_empty())
+    return 0;
+
+  /* anything before the wrap is in this rotation of level 0, the rest
+     (and the higher levels) wait for the cascade at the wrap at least */
+  *when = wheel_jiffies + (WHEEL_SIZE - slot);
+  for(word = slot / 32; word < WHEEL_SIZE / 32; word++)
+  {
+    later = wheel_bitmap[0][word];
+    if(word == slot / 32)
+      later &= ~0U << (slot % 32);
+    if(later != 0)
+    {
+      *when = wheel_jiffies + word * 32 + __builtin_ctz(later) - slot;
+      break;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Moves the wheel on to the current tick and wakes the timer thread if
+ * anything expired. Called from the tick path with interrupts off
+ */
+static void timer_run_wheel(void)
+{
+  unsigned int flags;
+  int expired;
+
+  if(timer_mode == TIMER_BIOS)
+    return;
+
+  flags = spin_lock_irqsave(&timer_lock);
+  expired = wheel_run(timer_jiffies);
+  spin_unlock_irqrestore(&timer_lock, flags);
+
+  if(expired)
+    wake_up(&timer_wait);
+}
+
+/*
+ * Sets a timer up to call func when it expires
+ */
+void timer_setup(struct timer * timer, void (*func)(struct timer * timer))
+{
+  timer->func = func;
+  timer->next = NULL;
+  timer->pprev = NULL;
+  timer->expires = 0;
+}
+
+/*
+ * Starts a timer to go off in ms milliseconds (or moves it there if it is
+ * already pending). The callback runs in the timer thread, with
+ * interrupts on. Safe to call from interrupt handlers and callbacks
+ */
+void timer_add(struct timer * timer, unsigned int ms)
+{
+  unsigned int flags, ticks, slack;
+
+  ticks = (unsigned int)udiv64((unsigned long long)ms * timer_hz + 999, 1000);
+  if(ticks == 0)
+    ticks = 1;
+
+  /* timer_jiffies may be behind while a one-shot runs */
+  timer_sync();
+  flags = spin_lock_irqsave(&timer_lock);
+  if(timer->pprev != NULL)
+    timer_unlink(timer);
+
+  /* the tick we are part way through doesn't count, hence the + 1 */
+  timer->expires = timer_jiffies + ticks + 1;
+  if(ticks >= WHEEL_SIZE)
+  {
+    slack = 1U << (31 - __builtin_clz(ticks) - WHEEL_BITS);
+    timer->expires = (timer->expires + slack - 1) & ~(slack - 1);
+  }
+  wheel_insert(timer);
+  spin_unlock_irqrestore(&timer_lock, flags);
+  timer_kick();
+}
+
+/*
+ * Stops a timer. Returns 1 if it was pending, 0 if it had already gone
+ * off. Once it returns the callback isn't running either, so the timer
+ * can be freed (it must not be called from the callback itself)
+ */
+int timer_cancel(struct timer * timer)
+{
+  unsigned int flags = spin_lock_irqsave(&timer_lock);
+  int pending = timer->pprev != NULL;
+
+  if(pending)
+    timer_unlink(timer);
+  spin_unlock_irqrestore(&timer_lock, flags);
+
+  while(timer_running == timer)
+    __asm__ __volatile__ ("pause");
+  return pending;
+}
+
+/*
+ * Kernel thread that runs the callbacks of expired timers
+ */
+static void timer_task(void)
+{
+  struct timer * timer;
+  unsigned int flags;
+
+  for(;;)
+  {
+    wait_event(&timer_wait, timer_expired != NULL);
+
+    flags = spin_lock_irqsave(&timer_lock);
+    while((timer = timer_expired) != NULL)
+    {
+      timer_unlink(timer);
+      timer_running = timer;
+      spin_unlock_irqrestore(&timer_lock, flags);
+
+      timer->func(timer);
+
+      flags = spin_lock_irqsave(&timer_lock);
+      timer_running = NULL;
+    }
+    spin_unlock_irqrestore(&timer_lock, flags);
+  }
+}
 
 /*
  * Installs the timer
  */
 void timer_init(void)
 {
-  timer_set_tick_frequency(1000);
+  unsigned int i, j;
+
   timer_ticks = 0;
+  timer_jiffies = 0;
   seconds = 0;
+
+  for(i = 0; i < WHEEL_LEVELS; i++)
+  {
+    for(j = 0; j < WHEEL_SIZE; j++)
+      wheel[i][j] = NULL;
+    wheel_bitmap[i][0] = wheel_bitmap[i][1] = 0;
+  }
+  wheel_jiffies = 0;
+  timer_expired = NULL;
+  timer_running = NULL;
+  spin_lock_init(&timer_lock);
+  wait_queue_init(&timer_wait);
+  create_task_priority(timer_task, THREAD_PRIORITY_HIGH);
+
+  tsc_calibrate();
+  timer_set_tick_frequency(1000);
+
+  if(clock_source == CLOCK_TSC)
+  {
+    char temp[33] = {0};
+    print_string("TSC ");
+    print_string(utoa(tsc_khz / 1000, temp, 10));
+    print_string("MHz...");
+  }
 }
 
 /*
- * Called everytime the IRQ for the timer fires
+ * Converts TSC cycles to nanoseconds, 0 if the TSC isn't calibrated
  */
-unsigned int timer_handler(unsigned int old_esp)
+unsigned long long cycles_to_ns(unsigned long long cycles)
 {
-  timer_ticks++;
-    
-  if(timer_ticks % timer_hz == 0)
+  unsigned int high = (unsigned int)(cycles >> 32);
+  unsigned int low = (unsigned int)cycles;
+
+  if(clock_source != CLOCK_TSC)
+    return 0;
+  /* 32 x 32 bit multiplies, so there is no 64 bit overflow for centuries */
+  return (((unsigned long long)high * tsc_mult) << (32 - TSC_SHIFT)) +
+         (((unsigned long long)low * tsc_mult) >> TSC_SHIFT);
+}
+
+/*
+ * Returns the TSC frequency in kHz (cycles per millisecond), 0 if it
+ * isn't calibrated
+ */
+unsigned int clock_tsc_khz(void)
+{
+  return clock_source == CLOCK_TSC ? tsc_khz : 0;
+}
+
+/*
+ * Nanoseconds since the clock was calibrated, never going backwards. In
+ * whole ticks before then
+ */
+unsigned long long clock_monotonic_ns(void)
+{
+  if(clock_source != CLOCK_TSC)
+    return (unsigned long long)timer_jiffies * (1000000000 / timer_hz);
+  return cycles_to_ns(rdtsc() - tsc_base);
+}
+
+/*
+ * Busy waits for at least ns nanoseconds, for device timings too short
+ * to sleep for. Interrupts stay as they were
+ */
+void ndelay(unsigned int ns)
+{
+  unsigned long long start, cycles;
+
+  if(clock_source != CLOCK_TSC)
   {
-    seconds++;
-    
+    unsigned int us = ns / 1000 + 1;
+    for(; us > PIT_CH2_MAX_US; us -= PIT_CH2_MAX_US)
+      timer_pit_wait(PIT_CH2_MAX_US);
+    timer_pit_wait(us);
+    return;
+  }
+  start = rdtsc();
+  cycles = udiv64((unsigned long long)ns * tsc_khz + 999999, 1000000);
+  while(rdtsc() - start < cycles)
+    __asm__ __volatile__ ("pause");
+}
+
+/*
+ * Busy waits for at least us microseconds
+ */
+void udelay(unsigned int us)
+{
+  while(us > 1000000)
+  {
+    ndelay(1000000000);
+    us -= 1000000;
+  }
+  ndelay(us * 1000);
+}
+
+/*
+ * Moves the clock on by a number of ticks, updating the uptime display
+ * and the once a second bookkeeping when a second boundary is crossed
+ */
+static void timer_advance(unsigned int ticks)
+{
+  timer_jiffies += ticks;
+  timer_ticks += ticks;
+
+  if(timer_ticks >= timer_hz)
+  {
+    seconds += timer_ticks / timer_hz;
+    task_load_update(timer_ticks / timer_hz);
+    timer_ticks %= timer_hz;
+
     print_string_at("System Uptime: ", 0, 24);
     char time_string[35] = {0};
     char mem_string[35] = {0};
     itoa(seconds, time_string, 10);
-    itoa(mm_get_free(), mem_string, 10);
+    utoa(mm_get_free(), mem_string, 10);
     print_string_at(time_string, 15,24);
     print_string_at(" seconds.", 15 + strlen(time_string), 24);
     print_string_at(" Freemem: ", 50, 24);
     print_string_at(mem_string, 60, 24);
     print_string_at(" bytes.", 60 + strlen(mem_string), 24);
-    timer_ticks = 0;
+    mm_profile_tick();
+  }
+  timer_run_wheel();
+}
+
+/*
+ * Called everytime the IRQ for the timer fires
+ */
+unsigned int timer_handler(unsigned int old_esp)
+{
+  unsigned int esp;
+
+  timer_advance(timer_mode == TIMER_ONESHOT ? timer_oneshot_ticks - timer_oneshot_counted : 1);
+  task_wake_sleepers(timer_jiffies);
+
+  esp = task_switch(old_esp);
+  timer_reprogram(0);
+  return esp;
+}
+
+/*
+ * Starts the PIT counting down from count in the given mode
+ */
+static void timer_program(unsigned char mode, unsigned int count)
+{
+  outportb(PIT_COMMAND, mode);
+  outportb(PIT_CHANNEL0, (unsigned char)count);
+  outportb(PIT_CHANNEL0, (unsigned char)(count >> 8));
+}
+
+/*
+ * Caps a one-shot of ticks so it ends by the tick when, at least 1 tick
+ */
+static unsigned int timer_ticks_until(unsigned int when, unsigned int ticks)
+{
+  if((int)(when - timer_jiffies) <= 0)
+    return 1;
+  if(when - timer_jiffies < ticks)
+    return when - timer_jiffies;
+  return ticks;
+}
+
+/*
+ * Picks periodic or one-shot mode for what the scheduler needs next.
+ * offset is how many PIT counts of the current tick have already gone by,
+ * so the next tick ends where it would have anyway. Called with
+ * interrupts off
+ */
+static void timer_reprogram(unsigned int offset)
+{
+  unsigned int ticks, wake_time, max_ticks, flags;
+
+  if(timer_mode == TIMER_BIOS)
+    return;
+
+  ticks = 1;
+  if(task_needs_tick())
+  {
+    /* periodic mode starts on a whole tick, so finish this one first */
+    if(offset == 0)
+    {
+      if(timer_mode != TIMER_PERIODIC)
+      {
+        timer_program(PIT_PERIODIC, timer_divisor);
+        timer_mode = TIMER_PERIODIC;
+      }
+      return;
+    }
   }
-  return task_switch(old_esp);
+  else
+  {
+    max_ticks = PIT_MAX_COUNT / timer_divisor;
+    ticks = max_ticks;
+    if(task_next_wake(&wake_time))
+      ticks = timer_ticks_until(wake_time, ticks);
+    flags = spin_lock_irqsave(&timer_lock);
+    if(wheel_next(&wake_time))
+      ticks = timer_ticks_until(wake_time, ticks);
+    spin_unlock_irqrestore(&timer_lock, flags);
+  }
+
+  timer_program(PIT_ONESHOT, ticks * timer_divisor - offset);
+  timer_oneshot_ticks = ticks;
+  timer_oneshot_offset = offset;
+  timer_oneshot_counted = 0;
+  timer_mode = TIMER_ONESHOT;
 }
 
 /*
- * Sets the resolution of our PIT timer
+ * Puts the whole ticks a one-shot in progress has counted so far on the
+ * clock, and gets how many PIT counts into the next one it is. Returns 0
+ * if there is no one-shot in progress (or it has fired, and the pending
+ * irq will do the rest). Called with interrupts off
+ */
+static int timer_oneshot_sync(unsigned int * offset)
+{
+  unsigned int count, elapsed, ticks;
+
+  if(timer_mode != TIMER_ONESHOT)
+    return 0;
+  outportb(PIT_COMMAND, PIT_READBACK);
+  if(inportb(PIT_CHANNEL0) & PIT_OUTPUT)
+    return 0;
+  count = inportb(PIT_CHANNEL0);
+  count |= inportb(PIT_CHANNEL0) << 8;
+
+  /* counted from the start of its first tick, not from when it started */
+  elapsed = timer_oneshot_ticks * timer_divisor - count;
+  ticks = elapsed / timer_divisor;
+  if(ticks > timer_oneshot_counted)
+  {
+    timer_advance(ticks - timer_oneshot_counted);
+    timer_oneshot_counted = ticks;
+  }
+  *offset = elapsed % timer_divisor;
+  return 1;
+}
+
+/*
+ * Brings timer_jiffies up to date, which between the irqs of a one-shot
+ * it isn't. Call it before working out a time from timer_jiffies. Not
+ * with sched_lock or a run queue lock held: it runs the tick bookkeeping,
+ * which may wake the timer thread
+ */
+void timer_sync(void)
+{
+  unsigned int flags = irq_save();
+  unsigned int offset;
+
+  timer_oneshot_sync(&offset);
+  irq_restore(flags);
+}
+
+/*
+ * Tells the timer the scheduler's needs may have changed (a thread became
+ * runnable, or started sleeping). A one-shot in progress is brought up to
+ * date and programmed again, from where it was in the current tick. If it
+ * has already fired the pending irq will do all of that instead. The same
+ * locking rule as timer_sync applies
+ */
+void timer_kick(void)
+{
+  unsigned int flags = irq_save();
+  unsigned int offset;
+
+  if(timer_oneshot_sync(&offset))
+    timer_reprogram(offset);
+  irq_restore(flags);
+}
+
+/*
+ * Sets the resolution of our PIT timer and starts it ticking periodically
+ * (timer_reprogram goes tickless at the next irq if it can)
  */
 void timer_set_tick_frequency(unsigned int hz)
 {
-  unsigned int div;
-  unsigned char tmp;
-  
-  div = TIMER_MAX / hz;
-  outportb(0x43, 0xb6);
-  outportb(0x40, (unsigned char)div);
-  outportb(0x40, (unsigned char)(div >> 8));
-  
-  tmp = inportb(0x61);
-  if(tmp != (tmp | 3))
-    outportb(0x61,tmp | 3);
-  
+  unsigned int flags = irq_save();
+
+  timer_divisor = TIMER_MAX / hz;
+  timer_program(PIT_PERIODIC, timer_divisor);
+  timer_mode = TIMER_PERIODIC;
   timer_hz = hz;
+
+  irq_restore(flags);
 }
 
+/*
+ * Busy waits for the given number of microseconds (at most 54000) on PIT
+ * channel 2, with the speaker kept off. It doesn't need the timer irq or
+ * threading, so it is what other clocks are calibrated against
+ */
+void timer_pit_wait(unsigned int us)
+{
+  unsigned int count = (TIMER_MAX / 100) * us / 10000;
+  unsigned char port = inportb(PIT_CH2_PORT);
+
+  outportb(PIT_CH2_PORT, (port & ~PIT_CH2_SPEAKER) | PIT_CH2_GATE);
+  outportb(PIT_COMMAND, PIT_CH2_ONESHOT);
+  outportb(PIT_CHANNEL2, (unsigned char)count);
+  outportb(PIT_CHANNEL2, (unsigned char)(count >> 8));
+  while(!(inportb(PIT_CH2_PORT) & PIT_CH2_OUTPUT));
+
+  outportb(PIT_CH2_PORT, port);
+}
+
+/*
+ * Blocks the calling thread for at least time_ms milliseconds (rounded up
+ * to whole timer ticks), leaving the cpu to other threads meanwhile
+ */
 void sleep(int time_ms) {
-  int start_ms = (seconds * 1000) + timer_ticks;
-  int current_ms = start_ms;
-  while (current_ms - start_ms < time_ms) {
-    current_ms = (seconds * 1000) + timer_ticks;
-  }
+  unsigned int ticks;
+  if (time_ms <= 0)
+    return;
+  /* the tick we are part way through doesn't count, hence the + 1 */
+  ticks = (unsigned int)udiv64((unsigned long long)time_ms * timer_hz + 999, 1000);
+  timer_sync();
+  thread_sleep_until(timer_jiffies + ticks + 1);
 }
\ No newline at end of file
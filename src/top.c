@@ -0,0 +1,153 @@
+#include "common.h"
+#include "screen.h"
+#include "mm.h"
+#include "task.h"
+#include "timer.h"
+#include "smp.h"
+
+/*
+ * top: which threads are using the cpus. Samples the scheduler's
+ * accounting (task.c) over TOP_INTERVAL_MS and shows each thread's share
+ * of a cpu in that time, plus its totals since it started
+ */
+#define TOP_MAX_THREADS   64
+#define TOP_INTERVAL_MS   1000
+
+/*
+ * Returns part as tenths of a percent of whole
+ */
+static unsigned int permille(unsigned long long part, unsigned long long whole)
+{
+  /* udiv64 only takes a 32 bit divisor */
+  while(whole > 0xFFFFFFFFULL)
+  {
+    whole >>= 1;
+    part >>= 1;
+  }
+  if(whole == 0)
+    return 0;
+  return (unsigned int)udiv64(part * 1000, (unsigned int)whole);
+}
+
+static void print_permille_atx(unsigned int value, unsigned int x)
+{
+  char temp[33] = {0};
+  char * end;
+
+  utoa(value / 10, temp, 10);
+  end = temp + strlen(temp);
+  *end++ = '.';
+  *end++ = '0' + value % 10;
+  *end = '\0';
+  print_string_atx(temp, x);
+}
+
+/*
+ * Prints a LOAD_FSHIFT fixed point load average with two decimals
+ */
+static void print_load(unsigned int load)
+{
+  char temp[33] = {0};
+  unsigned int hundredths = ((load & ((1 << LOAD_FSHIFT) - 1)) * 100) >> LOAD_FSHIFT;
+
+  print_string(utoa(load >> LOAD_FSHIFT, temp, 10));
+  print_string(hundredths < 10 ? ".0" : ".");
+  print_string(utoa(hundredths, temp, 10));
+}
+
+/*
+ * Prints the load averages, how idle each cpu was and what each thread
+ * did over the sample. Times are totals since the thread started
+ */
+void top(void)
+{
+  struct thread_stat * before;
+  struct thread_stat * after;
+  unsigned long long idle_before[MAX_CPUS];
+  unsigned long long idle, start, elapsed, cycles_per_ms, runtime;
+  unsigned int load[3];
+  unsigned int cpu;
+  int i, j, count_before, count_after;
+  char temp[33] = {0};
+
+  before = kmalloc(2 * TOP_MAX_THREADS * sizeof(struct thread_stat));
+  if(before == NULL)
+    return;
+  after = before + TOP_MAX_THREADS;
+
+  print_string("Sampling for ");
+  print_string(utoa(TOP_INTERVAL_MS, temp, 10));
+  print_string("ms...\n");
+
+  count_before = thread_stats(before, TOP_MAX_THREADS);
+  for(cpu = 0; cpu < MAX_CPUS; cpu++)
+    if(!cpu_idle_time(cpu, &idle_before[cpu]))
+      idle_before[cpu] = 0;
+  start = rdtsc();
+  sleep(TOP_INTERVAL_MS);
+  elapsed = rdtsc() - start;
+  count_after = thread_stats(after, TOP_MAX_THREADS);
+  cycles_per_ms = clock_tsc_khz();
+  if(cycles_per_ms == 0)
+    cycles_per_ms = udiv64(elapsed, TOP_INTERVAL_MS);
+  if(cycles_per_ms == 0)
+    cycles_per_ms = 1;
+
+  task_load_average(load);
+  print_string("load average: ");
+  print_load(load[0]);
+  print_string(" ");
+  print_load(load[1]);
+  print_string(" ");
+  print_load(load[2]);
+  print_string("  threads: ");
+  print_string(itoa(count_after, temp, 10));
+  print_string("\n");
+
+  for(cpu = 0; cpu < MAX_CPUS; cpu++)
+  {
+    if(!cpu_idle_time(cpu, &idle))
+      continue;
+    print_string("cpu");
+    print_string(utoa(cpu, temp, 10));
+    print_string(" idle");
+    print_permille_atx(permille(idle - idle_before[cpu], elapsed), 10);
+    print_string("%\n");
+  }
+
+  print_string("id");
+  print_string_atx("pri", 6);
+  print_string_atx("st", 11);
+  print_string_atx("cpu", 15);
+  print_string_atx("%cpu", 20);
+  print_string_atx("time ms", 28);
+  print_string_atx("wait ms", 40);
+  print_string_atx("vol", 52);
+  print_string_atx("invol", 62);
+  print_string("\n");
+
+  for(i = 0; i < count_after; i++)
+  {
+    runtime = after[i].runtime;
+    for(j = 0; j < count_before; j++)
+      if(before[j].id == after[i].id)
+        break;
+    if(j < count_before)
+      runtime -= before[j].runtime;
+
+    print_string(utoa(after[i].id, temp, 10));
+    print_string_atx(utoa(after[i].priority, temp, 10), 6);
+    temp[0] = after[i].state;
+    temp[1] = '\0';
+    print_string_atx(temp, 11);
+    print_string_atx(utoa(after[i].cpu, temp, 10), 15);
+    print_permille_atx(permille(runtime, elapsed), 20);
+    print_string_atx(utoa(udiv64(after[i].runtime, cycles_per_ms), temp, 10), 28);
+    print_string_atx(utoa(udiv64(after[i].wait_time, cycles_per_ms), temp, 10), 40);
+    print_string_atx(utoa(after[i].nvcsw, temp, 10), 52);
+    print_string_atx(utoa(after[i].nivcsw, temp, 10), 62);
+    print_string("\n");
+  }
+
+  kfree(before);
+}
@@ -0,0 +1,110 @@
+#include "common.h"
+#include "screen.h"
+#include "task.h"
+#include "workqueue.h"
+#include "mutex.h"
+
+/*
+ * Deferred interrupt work
+ *
+ * Interrupt handlers run with interrupts off, so anything slow done there
+ * (protocol processing, printing) holds up the timer and keyboard. A
+ * handler should only deal with the device, then work_schedule whatever
+ * is left. The worker thread, at THREAD_PRIORITY_HIGH so it gets the cpu
+ * ahead of ordinary threads, runs the queued work in FIFO order with
+ * interrupts on.
+ *
+ * A work item is only ever queued once: scheduling it again before it
+ * has started does nothing, so the function has to handle everything
+ * that is waiting (every packet in the ring, not just one). Once it has
+ * started it can be queued again, even by itself.
+ */
+struct work * work_head;
+struct work * work_tail;
+spinlock_t work_lock;                 /* the handler's cpu and the worker's may differ */
+struct wait_queue work_wait;
+
+static void worker_task(void);
+
+/*
+ * Sets up the queue and starts the worker thread (needs threading up)
+ */
+void workqueue_init(void)
+{
+  work_head = NULL;
+  work_tail = NULL;
+  spin_lock_init(&work_lock);
+  wait_queue_init(&work_wait);
+  create_task_priority(worker_task, THREAD_PRIORITY_HIGH);
+}
+
+/*
+ * Sets up a work item that calls func when it runs
+ */
+void work_init(struct work * work, void (*func)(struct work * work))
+{
+  work->func = func;
+  work->next = NULL;
+  work->pending = 0;
+}
+
+/*
+ * Queues a work item for the worker thread. Safe to call from interrupt
+ * handlers. Returns 0 if it was already queued
+ */
+int work_schedule(struct work * work)
+{
+  unsigned int flags = spin_lock_irqsave(&work_lock);
+
+  if(work->pending)
+  {
+    spin_unlock_irqrestore(&work_lock, flags);
+    return 0;
+  }
+  work->pending = 1;
+  work->next = NULL;
+  if(work_tail != NULL)
+    work_tail->next = work;
+  else
+    work_head = work;
+  work_tail = work;
+  spin_unlock_irqrestore(&work_lock, flags);
+
+  wake_up(&work_wait);
+  return 1;
+}
+
+/*
+ * Takes the first queued work item off, or returns NULL if there is none
+ */
+static struct work * work_dequeue(void)
+{
+  struct work * work;
+  unsigned int flags = spin_lock_irqsave(&work_lock);
+
+  work = work_head;
+  if(work != NULL)
+  {
+    work_head = work->next;
+    if(work_head == NULL)
+      work_tail = NULL;
+    work->pending = 0;
+  }
+  spin_unlock_irqrestore(&work_lock, flags);
+  return work;
+}
+
+/*
+ * Kernel thread that runs the deferred work
+ */
+static void worker_task(void)
+{
+  struct work * work;
+
+  for(;;)
+  {
+    wait_event(&work_wait, work_head != NULL);
+    while((work = work_dequeue()) != NULL)
+      work->func(work);
+  }
+}